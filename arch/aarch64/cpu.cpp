@@ -0,0 +1,67 @@
+#include "bundle.h"
+#include <sys/auxv.h>
+#include "reloc.h"
+
+/* libgcc of GCC 14 and later, behind target_clones */
+extern "C" {
+__attribute__((weak)) extern char __aarch64_cpu_features[];
+__attribute__((weak)) void __init_cpu_features_resolver(unsigned long, const void *);
+}
+
+#ifndef AT_HWCAP2
+#define AT_HWCAP2 26
+#endif
+
+/* bits of AT_HWCAP and AT_HWCAP2, as in asm/hwcap.h */
+static const struct {
+    const char *name;
+    uint32_t hwcap;
+    uint32_t bit;
+} cpu_features[] = {
+    {"fp", 1, 0},
+    {"asimd", 1, 1},
+    {"aes", 1, 3},
+    {"pmull", 1, 4},
+    {"sha1", 1, 5},
+    {"sha2", 1, 6},
+    {"crc32", 1, 7},
+    {"atomics", 1, 8},
+    {"fphp", 1, 9},
+    {"asimdhp", 1, 10},
+    {"asimdrdm", 1, 12},
+    {"lrcpc", 1, 15},
+    {"sha3", 1, 17},
+    {"asimddp", 1, 20},
+    {"sha512", 1, 21},
+    {"sve", 1, 22},
+    {"asimdfhm", 1, 23},
+    {"sve2", 2, 1},
+    {"sveaes", 2, 2},
+    {"svei8mm", 2, 9},
+    {"svebf16", 2, 12},
+    {"i8mm", 2, 13},
+    {"bf16", 2, 14},
+};
+
+int32_t arch_cpu_feature(const std::string &name)
+{
+    for (auto &f : cpu_features) {
+        if (name == f.name) {
+            uint64_t hwcap = getauxval(f.hwcap == 1 ? AT_HWCAP : AT_HWCAP2);
+            return (hwcap >> f.bit) & 1 ? 1 : -1;
+        }
+    }
+    return -1;
+}
+
+int arch_cpu_symbol(const std::string &name, uint64_t &addr)
+{
+    if (name == "__aarch64_cpu_features") {
+        addr = (uint64_t)__aarch64_cpu_features;
+    } else if (name == "__init_cpu_features_resolver") {
+        addr = (uint64_t)__init_cpu_features_resolver;
+    } else {
+        return -1;
+    }
+    return addr ? 0 : -1;
+}
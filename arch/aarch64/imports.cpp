@@ -0,0 +1,123 @@
+#include "imports.h"
+#include <cstring>
+
+/*
+ * Entered from a stub with the import index in x16, x16/x17 are free at
+ * a call. EL0 cannot read its CPU number, so the counter row is picked
+ * by a hash of the thread pointer instead, which still keeps threads
+ * apart. A sampled call is made from here, on a frame of its own with
+ * IMPORT_STACK_COPY bytes of the caller's stack arguments copied below
+ * it, then timed by umko_import_leave. The CFI lets exceptions unwind
+ * through that frame, longjmp simply drops it.
+ */
+asm(".text\n"
+    ".globl umko_import_entry\n"
+    ".hidden umko_import_entry\n"
+    ".type umko_import_entry, %function\n"
+    "umko_import_entry:\n"
+    "    .cfi_startproc\n"
+    "    stp x0, x1, [sp, #-32]!\n"
+    "    .cfi_def_cfa_offset 32\n"
+    "    stp x2, x3, [sp, #16]\n"
+    "    mrs x0, cntvct_el0\n"
+    "    mrs x1, tpidr_el0\n"
+    "    eor x1, x1, x1, lsr #16\n"
+    "    eor x1, x1, x1, lsr #8\n"
+    "    and x1, x1, #(" IMPORT_STR(IMPORT_CPU_SLOTS) " - 1)\n"
+    "    lsl x1, x1, #" IMPORT_STR(IMPORT_MAX_SHIFT) "\n"
+    "    add x1, x1, x16\n"
+    "    adrp x2, umko_import_counts\n"
+    "    ldr x2, [x2, :lo12:umko_import_counts]\n"
+    "    add x2, x2, x1, lsl #3\n"
+    "1:  ldxr x3, [x2]\n"
+    "    add x3, x3, #1\n"
+    "    stxr w1, x3, [x2]\n"
+    "    cbnz w1, 1b\n"
+    "    sub x3, x3, #1\n"
+    "    adrp x2, umko_import_sampling\n"
+    "    ldr w2, [x2, :lo12:umko_import_sampling]\n"
+    "    cbnz w2, 3f\n"
+    "2:  adrp x17, umko_import_targets\n"
+    "    add x17, x17, :lo12:umko_import_targets\n"
+    "    ldr x17, [x17, x16, lsl #3]\n"
+    "    .cfi_remember_state\n"
+    "    ldp x2, x3, [sp, #16]\n"
+    "    ldp x0, x1, [sp], #32\n"
+    "    .cfi_def_cfa_offset 0\n"
+    "    br x17\n"
+    "    .cfi_restore_state\n"
+    "3:  adrp x2, umko_import_sample_mask\n"
+    "    ldr x2, [x2, :lo12:umko_import_sample_mask]\n"
+    "    tst x3, x2\n"
+    "    b.ne 2b\n"
+    /* x29+16: x0-x3, then the stack arguments */
+    "    stp x29, x30, [sp, #-16]!\n"
+    "    .cfi_def_cfa_offset 48\n"
+    "    .cfi_offset x29, -48\n"
+    "    .cfi_offset x30, -40\n"
+    "    mov x29, sp\n"
+    "    .cfi_def_cfa x29, 48\n"
+    "    stp x16, x0, [sp, #-16]!\n"
+    "    sub sp, sp, #" IMPORT_STR(IMPORT_STACK_COPY) "\n"
+    "    add x10, x29, #48\n"
+    "    mov x9, #0\n"
+    "4:  ldr x11, [x10, x9]\n"
+    "    str x11, [sp, x9]\n"
+    "    add x9, x9, #8\n"
+    "    cmp x9, #" IMPORT_STR(IMPORT_STACK_COPY) "\n"
+    "    b.lo 4b\n"
+    "    adrp x17, umko_import_targets\n"
+    "    add x17, x17, :lo12:umko_import_targets\n"
+    "    ldr x17, [x17, x16, lsl #3]\n"
+    "    ldp x2, x3, [x29, #32]\n"
+    "    ldp x0, x1, [x29, #16]\n"
+    "    blr x17\n"
+    /* the results are in x0/x1 and v0-v3, the copy is free now */
+    "    stp x0, x1, [x29, #16]\n"
+    "    stp q0, q1, [sp]\n"
+    "    stp q2, q3, [sp, #32]\n"
+    "    ldp x0, x1, [x29, #-16]\n"
+    "    bl umko_import_leave\n"
+    "    ldp q2, q3, [sp, #32]\n"
+    "    ldp q0, q1, [sp]\n"
+    "    ldp x0, x1, [x29, #16]\n"
+    "    mov sp, x29\n"
+    "    ldp x29, x30, [sp], #16\n"
+    "    .cfi_def_cfa sp, 32\n"
+    "    .cfi_restore x29\n"
+    "    .cfi_restore x30\n"
+    "    add sp, sp, #32\n"
+    "    .cfi_def_cfa_offset 0\n"
+    "    ret\n"
+    "    .cfi_endproc\n"
+    ".size umko_import_entry, .-umko_import_entry\n");
+
+bool arch_import_supported()
+{
+    return true;
+}
+
+/* movz x16, #index; ldr x17, 1f; br x17; nop; 1: .quad umko_import_entry */
+void arch_import_stub(char *stub, uint32_t index)
+{
+    uint32_t code[4] = {
+        0xd2800000 | ((index & 0xffff) << 5) | 16,
+        0x58000000 | (3 << 5) | 17,
+        0xd61f0220,
+        0xd503201f,
+    };
+    uint64_t entry = (uint64_t)umko_import_entry;
+    memcpy(stub, code, sizeof(code));
+    memcpy(stub + sizeof(code), &entry, 8);
+}
+
+uint64_t arch_import_clock(uint32_t *cpu_slot)
+{
+    uint64_t ticks, tp;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks));
+    asm volatile("mrs %0, tpidr_el0" : "=r"(tp));
+    tp ^= tp >> 16;
+    tp ^= tp >> 8;
+    *cpu_slot = tp & (IMPORT_CPU_SLOTS - 1);
+    return ticks;
+}
@@ -0,0 +1,72 @@
+#include "lazy.h"
+#include <cstring>
+
+/*
+ * Entered from the PLT header with the module in x16 and the address of
+ * the GOT slot and the lr of the call saved on the stack. The argument
+ * registers, x8 for an indirect result and q0-q7 are kept around
+ * umko_lazy_resolve.
+ */
+asm(".text\n"
+    ".globl umko_lazy_entry\n"
+    ".hidden umko_lazy_entry\n"
+    ".type umko_lazy_entry, %function\n"
+    "umko_lazy_entry:\n"
+    "    stp x29, x30, [sp, #-224]!\n"
+    "    mov x29, sp\n"
+    "    stp x0, x1, [sp, #16]\n"
+    "    stp x2, x3, [sp, #32]\n"
+    "    stp x4, x5, [sp, #48]\n"
+    "    stp x6, x7, [sp, #64]\n"
+    "    str x8, [sp, #80]\n"
+    "    stp q0, q1, [sp, #96]\n"
+    "    stp q2, q3, [sp, #128]\n"
+    "    stp q4, q5, [sp, #160]\n"
+    "    stp q6, q7, [sp, #192]\n"
+    "    mov x0, x16\n"
+    "    ldr x1, [sp, #224]\n"
+    "    bl umko_lazy_resolve\n"
+    "    mov x16, x0\n"
+    "    ldp q6, q7, [sp, #192]\n"
+    "    ldp q4, q5, [sp, #160]\n"
+    "    ldp q2, q3, [sp, #128]\n"
+    "    ldp q0, q1, [sp, #96]\n"
+    "    ldr x8, [sp, #80]\n"
+    "    ldp x6, x7, [sp, #64]\n"
+    "    ldp x4, x5, [sp, #48]\n"
+    "    ldp x2, x3, [sp, #32]\n"
+    "    ldp x0, x1, [sp, #16]\n"
+    "    ldp x29, x30, [sp], #224\n"
+    "    ldp x17, x30, [sp], #16\n"
+    "    br x16\n"
+    ".size umko_lazy_entry, .-umko_lazy_entry\n");
+
+/* stp x16, x30, [sp, #-16]!; ldr x16, 1f; ldr x17, 2f; br x17;
+   1: .quad ctx; 2: .quad umko_lazy_entry */
+void arch_lazy_plt_header(void *header, uint64_t ctx)
+{
+	uint32_t *insn = (uint32_t *)header;
+	uint64_t entry = (uint64_t)umko_lazy_entry;
+
+	insn[0] = 0xa9800000 | (0x7e << 15) | (30 << 10) | (31 << 5) | 16;
+	insn[1] = 0x58000000 | (3 << 5) | 16;
+	insn[2] = 0x58000000 | (4 << 5) | 17;
+	insn[3] = 0xd61f0220;
+	memcpy(insn + 4, &ctx, 8);
+	memcpy(insn + 6, &entry, 8);
+}
+
+/* adrp x16, slot; add x16, x16, :lo12:slot; ldr x17, [x16]; br x17,
+   the slot starts at the header */
+uint64_t arch_lazy_plt_entry(void *entry, uint64_t slot, uint64_t header, uint64_t base)
+{
+	uint32_t *insn = (uint32_t *)entry;
+	int64_t pages = (int64_t)((slot & ~0xfffUL) - ((uint64_t)entry & ~0xfffUL)) >> 12;
+
+	(void)base;
+	insn[0] = 0x90000000 | ((pages & 0x3) << 29) | (((pages >> 2) & 0x7ffff) << 5) | 16;
+	insn[1] = 0x91000000 | ((slot & 0xfff) << 10) | (16 << 5) | 16;
+	insn[2] = 0xf9400000 | (16 << 5) | 17;
+	insn[3] = 0xd61f0220;
+	return header;
+}
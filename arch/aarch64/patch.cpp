@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <sys/mman.h>
+#include "patch.h"
+#include "logger.h"
+#include "module.h"
+
+#define CATENATE(x, y) x##y
+#define CAT(x, y) CATENATE(x, y)
+
+#define BUILD_BUG_ON(cond)	\
+	enum { CAT(assert_line, __COUNTER__) = sizeof(int[-!!(cond)]) }
+
+#define AARCH64_BREAK_FAULT	(0xd4200000 | (0x100 << 5))
+
+#include "insn.h"
+
+#define VENEER_PAGE_SIZE 4096
+#define VENEER_SIZE 16
+#define INSN_LDR_X16_LITERAL_8 0x58000050   /* ldr x16, .+8 */
+#define INSN_BR_X16 0xd61f0200              /* br x16 */
+
+static char *veneer_page;
+static uint64_t veneer_used = VENEER_PAGE_SIZE;
+
+/* targets beyond the +/-128M of a B go through a veneer in the module
+   area, which is close to every module */
+static void *alloc_veneer(void *to)
+{
+    if (veneer_used + VENEER_SIZE > VENEER_PAGE_SIZE) {
+        void *p = mmap(module_area_hint(VENEER_PAGE_SIZE), VENEER_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            log_error("patch: cannot mmap veneer page\n");
+            return nullptr;
+        }
+        veneer_page = (char *)p;
+        veneer_used = 0;
+    } else {
+        mprotect(veneer_page, VENEER_PAGE_SIZE, PROT_READ | PROT_WRITE);
+    }
+    uint32_t *veneer = (uint32_t *)(veneer_page + veneer_used);
+    veneer[0] = INSN_LDR_X16_LITERAL_8;
+    veneer[1] = INSN_BR_X16;
+    *(uint64_t *)&veneer[2] = (uint64_t)to;
+    veneer_used += VENEER_SIZE;
+    mprotect(veneer_page, VENEER_PAGE_SIZE, PROT_READ | PROT_EXEC);
+    __builtin___clear_cache((char *)veneer, (char *)veneer + VENEER_SIZE);
+    return veneer;
+}
+
+/* B is one of the instructions the architecture allows to be modified
+   while other cores execute it, a single aligned store is enough */
+int arch_patch_jump(void *from, uint64_t size, void *to)
+{
+    unsigned long pc = (unsigned long)from;
+    if (size < AARCH64_INSN_SIZE) {
+        log_error("patch: function at %p is too short for a branch\n", from);
+        return -1;
+    }
+    uint32_t insn = aarch64_insn_gen_branch_imm(pc, (unsigned long)to, AARCH64_INSN_BRANCH_NOLINK);
+    if (insn == AARCH64_BREAK_FAULT) {
+        void *veneer = alloc_veneer(to);
+        if (veneer == nullptr) {
+            return -1;
+        }
+        insn = aarch64_insn_gen_branch_imm(pc, (unsigned long)veneer, AARCH64_INSN_BRANCH_NOLINK);
+        if (insn == AARCH64_BREAK_FAULT) {
+            log_error("patch: veneer %p is out of branch range from %p\n", veneer, from);
+            return -1;
+        }
+    }
+    __atomic_store_n((uint32_t *)from, insn, __ATOMIC_RELEASE);
+    __builtin___clear_cache((char *)from, (char *)from + AARCH64_INSN_SIZE);
+    log_debug("patch: b from %p to %p\n", from, to);
+    return 0;
+}
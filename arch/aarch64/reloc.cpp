@@ -1,11 +1,18 @@
 #include <stdint.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/auxv.h>
 #include <elfio/elfio.hpp>
 #include "logger.h"
 #include "reloc.h"
 
 
 using namespace ELFIO;
+
+#ifndef R_AARCH64_IRELATIVE
+#define R_AARCH64_IRELATIVE 1032
+#endif
+
 /* Preparations for inclusion of some Linux kernel routines */
 
 #define fallthrough __attribute__((__fallthrough__))
@@ -19,6 +26,7 @@ using namespace ELFIO;
 #define AARCH64_BREAK_FAULT	(AARCH64_BREAK_MON | (FAULT_BRK_IMM << 5))
 
 #define SZ_2M			0x00200000
+#define SZ_128M			0x08000000
 
 #define ADR_IMM_HILOSPLIT	2
 #define ADR_IMM_SIZE		SZ_2M
@@ -236,6 +244,58 @@ uint32_t aarch64_insn_encode_immediate(enum aarch64_insn_imm_type type,
 	return insn;
 }
 
+/* arch/arm64/lib/insn.c */
+static inline long label_imm_common(unsigned long pc, unsigned long addr,
+				     long range)
+{
+	long offset;
+
+	if ((pc & 0x3) || (addr & 0x3)) {
+		log_error("%s: A64 instructions must be word aligned\n", __func__);
+		return range;
+	}
+
+	offset = ((long)addr - (long)pc);
+
+	if (offset < -range || offset >= range) {
+		log_debug("%s: offset out of range\n", __func__);
+		return range;
+	}
+
+	return offset;
+}
+
+uint32_t aarch64_insn_gen_branch_imm(unsigned long pc, unsigned long addr,
+				enum aarch64_insn_branch_type type)
+{
+	uint32_t insn;
+	long offset;
+
+	/*
+	 * B/BL support [-128M, 128M) offset
+	 * ARM64 virtual address arrangement guarantees all kernel and module
+	 * texts are within +/-128M.
+	 */
+	offset = label_imm_common(pc, addr, SZ_128M);
+	if (offset >= SZ_128M)
+		return AARCH64_BREAK_FAULT;
+
+	switch (type) {
+	case AARCH64_INSN_BRANCH_LINK:
+		insn = aarch64_insn_get_bl_value();
+		break;
+	case AARCH64_INSN_BRANCH_NOLINK:
+		insn = aarch64_insn_get_b_value();
+		break;
+	default:
+		log_error("%s: unknown branch encoding %d\n", __func__, type);
+		return AARCH64_BREAK_FAULT;
+	}
+
+	return aarch64_insn_encode_immediate(AARCH64_INSN_IMM_26, insn,
+					     offset >> 2);
+}
+
 static int reloc_insn_movw(enum aarch64_reloc_op op, uint32_t *place, uint64_t val,
 			   int lsb, enum aarch64_insn_movw_imm_type imm_type)
 {
@@ -348,6 +408,7 @@ int do_relocate_add(uint32_t reloc_type, void *ins_loc, uint64_t val)
 
 	/* Data relocations. */
 	case R_AARCH64_ABS64:
+	case R_AARCH64_IRELATIVE:
 		overflow_check = false;
 		ovf = reloc_data(RELOC_OP_ABS, loc, val, 64);
 		break;
@@ -522,6 +583,75 @@ int do_relocate_add(uint32_t reloc_type, void *ins_loc, uint64_t val)
 		ovf = reloc_insn_imm(RELOC_OP_PREL, loc, val, 2, 26,
 						AARCH64_INSN_IMM_26);
 		break;
+
+	/* TLS relocations, val is a TP offset or the address of a GOT slot. */
+	case R_AARCH64_TLSLE_MOVW_TPREL_G2:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G2:
+		ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 32,
+						AARCH64_INSN_IMM_MOVNZ);
+		break;
+	case R_AARCH64_TLSLE_MOVW_TPREL_G1:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G1:
+		ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 16,
+						AARCH64_INSN_IMM_MOVNZ);
+		break;
+	case R_AARCH64_TLSLE_MOVW_TPREL_G1_NC:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G1_NC:
+		overflow_check = false;
+		ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 16,
+						AARCH64_INSN_IMM_MOVKZ);
+		break;
+	case R_AARCH64_TLSLE_MOVW_TPREL_G0:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G0:
+		ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 0,
+						AARCH64_INSN_IMM_MOVNZ);
+		break;
+	case R_AARCH64_TLSLE_MOVW_TPREL_G0_NC:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G0_NC:
+		overflow_check = false;
+		ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 0,
+						AARCH64_INSN_IMM_MOVKZ);
+		break;
+	case R_AARCH64_TLSLE_ADD_TPREL_HI12:
+	case R_AARCH64_TLSLD_ADD_DTPREL_HI12:
+		ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 12, 12,
+						AARCH64_INSN_IMM_12);
+		break;
+	case R_AARCH64_TLSLE_ADD_TPREL_LO12:
+	case R_AARCH64_TLSLD_ADD_DTPREL_LO12:
+		ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 0, 12,
+						AARCH64_INSN_IMM_12);
+		break;
+	case R_AARCH64_TLSLE_ADD_TPREL_LO12_NC:
+	case R_AARCH64_TLSLD_ADD_DTPREL_LO12_NC:
+	case R_AARCH64_TLSGD_ADD_LO12_NC:
+	case R_AARCH64_TLSLD_ADD_LO12_NC:
+	case R_AARCH64_TLSDESC_ADD_LO12:
+		overflow_check = false;
+		ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 0, 12,
+						AARCH64_INSN_IMM_12);
+		break;
+	case R_AARCH64_LD64_GOT_LO12_NC:
+	case R_AARCH64_TLSIE_LD64_GOTTPREL_LO12_NC:
+	case R_AARCH64_TLSDESC_LD64_LO12:
+		overflow_check = false;
+		ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 3, 9,
+						AARCH64_INSN_IMM_12);
+		break;
+	case R_AARCH64_ADR_GOT_PAGE:
+	case R_AARCH64_TLSIE_ADR_GOTTPREL_PAGE21:
+	case R_AARCH64_TLSGD_ADR_PAGE21:
+	case R_AARCH64_TLSLD_ADR_PAGE21:
+	case R_AARCH64_TLSDESC_ADR_PAGE21:
+		ovf = reloc_insn_adrp(loc, val);
+		if (ovf && ovf != -ERANGE) {
+			return ovf;
+		}
+		break;
+	case R_AARCH64_TLSDESC_CALL:
+		ovf = 0;
+		break;
+
 	default:
 		log_error("unsupported RELA relocation: type: %u, loc: %p, val:0x%lx\n",
 				reloc_type, loc, val);
@@ -536,3 +666,137 @@ int do_relocate_add(uint32_t reloc_type, void *ins_loc, uint64_t val)
 	
 	return 0;
 }
+
+int reloc_class(uint32_t reloc_type)
+{
+	switch (reloc_type) {
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G2:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G1:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G1_NC:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G0:
+	case R_AARCH64_TLSLD_MOVW_DTPREL_G0_NC:
+	case R_AARCH64_TLSLD_ADD_DTPREL_HI12:
+	case R_AARCH64_TLSLD_ADD_DTPREL_LO12:
+	case R_AARCH64_TLSLD_ADD_DTPREL_LO12_NC:
+		return RELOC_CLASS_DTPOFF;
+	case R_AARCH64_IRELATIVE:
+		return RELOC_CLASS_IRELATIVE;
+	case R_AARCH64_ADR_GOT_PAGE:
+	case R_AARCH64_LD64_GOT_LO12_NC:
+		return RELOC_CLASS_GOT;
+	case R_AARCH64_TLSIE_ADR_GOTTPREL_PAGE21:
+	case R_AARCH64_TLSIE_LD64_GOTTPREL_LO12_NC:
+		return RELOC_CLASS_GOT_TPOFF;
+	case R_AARCH64_TLSGD_ADR_PAGE21:
+	case R_AARCH64_TLSGD_ADD_LO12_NC:
+		return RELOC_CLASS_GOT_TLSGD;
+	case R_AARCH64_TLSLD_ADR_PAGE21:
+	case R_AARCH64_TLSLD_ADD_LO12_NC:
+		return RELOC_CLASS_GOT_TLSLD;
+	case R_AARCH64_TLSDESC_ADR_PAGE21:
+	case R_AARCH64_TLSDESC_LD64_LO12:
+	case R_AARCH64_TLSDESC_ADD_LO12:
+		return RELOC_CLASS_GOT_TLSDESC;
+	default:
+		return RELOC_CLASS_PLAIN;
+	}
+}
+
+/* how a relocated field changes when the image moves, for instances;
+   the low 12 bits of an address stay as images move by pages */
+int reloc_addr_kind(uint32_t reloc_type)
+{
+	switch (reloc_type) {
+	case R_AARCH64_ABS64:
+	case R_AARCH64_IRELATIVE:
+	case R_AARCH64_ABS32:
+	case R_AARCH64_ABS16:
+	case R_AARCH64_MOVW_UABS_G0_NC:
+	case R_AARCH64_MOVW_UABS_G0:
+	case R_AARCH64_MOVW_UABS_G1_NC:
+	case R_AARCH64_MOVW_UABS_G1:
+	case R_AARCH64_MOVW_UABS_G2_NC:
+	case R_AARCH64_MOVW_UABS_G2:
+	case R_AARCH64_MOVW_UABS_G3:
+	case R_AARCH64_MOVW_SABS_G0:
+	case R_AARCH64_MOVW_SABS_G1:
+	case R_AARCH64_MOVW_SABS_G2:
+		return RELOC_ADDR_ABS;
+	case R_AARCH64_PREL64:
+	case R_AARCH64_PREL32:
+	case R_AARCH64_PREL16:
+	case R_AARCH64_MOVW_PREL_G0_NC:
+	case R_AARCH64_MOVW_PREL_G0:
+	case R_AARCH64_MOVW_PREL_G1_NC:
+	case R_AARCH64_MOVW_PREL_G1:
+	case R_AARCH64_MOVW_PREL_G2_NC:
+	case R_AARCH64_MOVW_PREL_G2:
+	case R_AARCH64_MOVW_PREL_G3:
+	case R_AARCH64_LD_PREL_LO19:
+	case R_AARCH64_ADR_PREL_LO21:
+	case R_AARCH64_ADR_PREL_PG_HI21_NC:
+	case R_AARCH64_ADR_PREL_PG_HI21:
+	case R_AARCH64_TSTBR14:
+	case R_AARCH64_CONDBR19:
+	case R_AARCH64_JUMP26:
+	case R_AARCH64_CALL26:
+	case R_AARCH64_ADR_GOT_PAGE:
+	case R_AARCH64_TLSIE_ADR_GOTTPREL_PAGE21:
+	case R_AARCH64_TLSGD_ADR_PAGE21:
+	case R_AARCH64_TLSLD_ADR_PAGE21:
+	case R_AARCH64_TLSDESC_ADR_PAGE21:
+		return RELOC_ADDR_PCREL;
+	default:
+		return RELOC_ADDR_NONE;
+	}
+}
+
+bool reloc_is_call(uint32_t reloc_type)
+{
+	return reloc_type == R_AARCH64_CALL26 || reloc_type == R_AARCH64_JUMP26;
+}
+
+/* +/-128M of B and BL */
+bool reloc_call_reaches(uint64_t loc, uint64_t val)
+{
+	int64_t disp = (int64_t)(val - loc);
+	return disp >= -(1L << 27) && disp < (1L << 27);
+}
+
+/* adrp x16, slot; ldr x17, [x16, :lo12:slot]; br x17; nop */
+void arch_plt_entry(void *entry, uint64_t slot)
+{
+	uint32_t *insn = (uint32_t *)entry;
+	int64_t pages = (int64_t)((slot & ~0xfffUL) - ((uint64_t)entry & ~0xfffUL)) >> 12;
+
+	insn[0] = 0x90000000 | ((pages & 0x3) << 29) | (((pages >> 2) & 0x7ffff) << 5) | 16;
+	insn[1] = 0xf9400000 | (((slot & 0xfff) >> 3) << 10) | (16 << 5) | 17;
+	insn[2] = 0xd61f0220;
+	insn[3] = 0xd503201f;
+}
+
+/* ldr x<arg>, 1f; ldr x16, 2f; br x16; nop; 1: .quad ctx; 2: .quad target */
+void arch_ctx_stub(void *stub, uint32_t arg, uint64_t ctx, uint64_t target)
+{
+	uint32_t *insn = (uint32_t *)stub;
+
+	insn[0] = 0x58000000 | (4 << 5) | arg;
+	insn[1] = 0x58000000 | (5 << 5) | 16;
+	insn[2] = 0xd61f0200;
+	insn[3] = 0xd503201f;
+	memcpy(insn + 4, &ctx, 8);
+	memcpy(insn + 6, &target, 8);
+}
+
+/* resolvers get AT_HWCAP with _IFUNC_ARG_HWCAP set and the __ifunc_arg_t
+   of glibc, for the features only in AT_HWCAP2 */
+uint64_t arch_ifunc_resolve(uint64_t resolver)
+{
+	struct {
+		uint64_t size;
+		uint64_t hwcap;
+		uint64_t hwcap2;
+	} arg = {sizeof(arg), getauxval(AT_HWCAP), getauxval(AT_HWCAP2)};
+
+	return ((uint64_t (*)(uint64_t, void *))resolver)(arg.hwcap | (1ULL << 62), &arg);
+}
@@ -0,0 +1,9 @@
+/* TLS descriptor resolver for blocks in static TLS: x0 points to the
+   descriptor, whose second word is the TP offset to return. */
+asm(".text\n"
+    ".globl umko_tlsdesc_return\n"
+    ".type umko_tlsdesc_return, %function\n"
+    "umko_tlsdesc_return:\n"
+    "    ldr x0, [x0, #8]\n"
+    "    ret\n"
+    ".size umko_tlsdesc_return, .-umko_tlsdesc_return\n");
@@ -0,0 +1,113 @@
+#include "bundle.h"
+#include <cstring>
+#include <cpuid.h>
+#include "reloc.h"
+
+/* libgcc, behind __builtin_cpu_supports and target_clones */
+extern "C" {
+extern char __cpu_model[];
+extern unsigned int __cpu_features2[];
+void __cpu_indicator_init(void);
+}
+
+enum { CPU_EAX, CPU_EBX, CPU_ECX, CPU_EDX };
+
+/* XCR0 state the OS must save for the registers of a feature */
+#define XCR0_AVX    0x06
+#define XCR0_AVX512 0xe6
+
+struct CpuFeature {
+    const char *name;
+    uint32_t leaf;
+    uint32_t reg;
+    uint32_t bit;
+    uint32_t xcr0;
+};
+
+static const CpuFeature cpu_features[] = {
+    {"sse2", 1, CPU_EDX, 26, 0},
+    {"sse3", 1, CPU_ECX, 0, 0},
+    {"ssse3", 1, CPU_ECX, 9, 0},
+    {"fma", 1, CPU_ECX, 12, XCR0_AVX},
+    {"cx16", 1, CPU_ECX, 13, 0},
+    {"sse4.1", 1, CPU_ECX, 19, 0},
+    {"sse4.2", 1, CPU_ECX, 20, 0},
+    {"movbe", 1, CPU_ECX, 22, 0},
+    {"popcnt", 1, CPU_ECX, 23, 0},
+    {"aes", 1, CPU_ECX, 25, 0},
+    {"xsave", 1, CPU_ECX, 26, 0},
+    {"avx", 1, CPU_ECX, 28, XCR0_AVX},
+    {"f16c", 1, CPU_ECX, 29, XCR0_AVX},
+    {"bmi", 7, CPU_EBX, 3, 0},
+    {"avx2", 7, CPU_EBX, 5, XCR0_AVX},
+    {"bmi2", 7, CPU_EBX, 8, 0},
+    {"avx512f", 7, CPU_EBX, 16, XCR0_AVX512},
+    {"avx512dq", 7, CPU_EBX, 17, XCR0_AVX512},
+    {"avx512cd", 7, CPU_EBX, 28, XCR0_AVX512},
+    {"avx512bw", 7, CPU_EBX, 30, XCR0_AVX512},
+    {"avx512vl", 7, CPU_EBX, 31, XCR0_AVX512},
+    {"avx512vnni", 7, CPU_ECX, 11, XCR0_AVX512},
+    {"sahf", 0x80000001, CPU_ECX, 0, 0},
+    {"lzcnt", 0x80000001, CPU_ECX, 5, 0},
+};
+
+/* the micro-architecture levels of the psABI */
+static const struct {
+    const char *name;
+    const char *features;
+} cpu_levels[] = {
+    {"x86-64-v2", "cx16,sahf,popcnt,sse3,sse4.1,sse4.2,ssse3"},
+    {"x86-64-v3", "x86-64-v2,avx,avx2,bmi,bmi2,f16c,fma,lzcnt,movbe,xsave"},
+    {"x86-64-v4", "x86-64-v3,avx512f,avx512bw,avx512cd,avx512dq,avx512vl"},
+};
+
+static uint64_t cpu_xcr0()
+{
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1U << 27))) {
+        return 0;   /* no OSXSAVE */
+    }
+    asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+
+static bool cpu_has(const CpuFeature &f)
+{
+    uint32_t regs[4];
+    if (!__get_cpuid_count(f.leaf, 0, &regs[CPU_EAX], &regs[CPU_EBX], &regs[CPU_ECX], &regs[CPU_EDX])) {
+        return false;
+    }
+    if (!(regs[f.reg] & (1U << f.bit))) {
+        return false;
+    }
+    return (cpu_xcr0() & f.xcr0) == f.xcr0;
+}
+
+int32_t arch_cpu_feature(const std::string &name)
+{
+    for (auto &level : cpu_levels) {
+        if (name == level.name) {
+            return cpu_features_weight(level.features);
+        }
+    }
+    for (auto &f : cpu_features) {
+        if (name == f.name) {
+            return cpu_has(f) ? 1 : -1;
+        }
+    }
+    return -1;
+}
+
+int arch_cpu_symbol(const std::string &name, uint64_t &addr)
+{
+    if (name == "__cpu_model") {
+        addr = (uint64_t)__cpu_model;
+    } else if (name == "__cpu_features2") {
+        addr = (uint64_t)__cpu_features2;
+    } else if (name == "__cpu_indicator_init") {
+        addr = (uint64_t)__cpu_indicator_init;
+    } else {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "imports.h"
+#include <cstring>
+#include <cpuid.h>
+#include <x86intrin.h>
+
+/*
+ * Entered from a stub with the import index in %r11, the one register
+ * free at a call. rdtscp gives the timestamp and, in TSC_AUX, the CPU
+ * whose counter row is bumped. A sampled call is made from here, on a
+ * frame of its own with IMPORT_STACK_COPY bytes of the caller's stack
+ * arguments copied below it, then timed by umko_import_leave. The CFI
+ * lets exceptions unwind through that frame, longjmp simply drops it.
+ */
+asm(".text\n"
+    ".globl umko_import_entry\n"
+    ".hidden umko_import_entry\n"
+    ".type umko_import_entry, @function\n"
+    "umko_import_entry:\n"
+    "    .cfi_startproc\n"
+    "    push %rax\n"
+    "    .cfi_adjust_cfa_offset 8\n"
+    "    push %rcx\n"
+    "    .cfi_adjust_cfa_offset 8\n"
+    "    push %rdx\n"
+    "    .cfi_adjust_cfa_offset 8\n"
+    "    rdtscp\n"
+    "    shl $32, %rdx\n"
+    "    or %rdx, %rax\n"
+    "    and $(" IMPORT_STR(IMPORT_CPU_SLOTS) " - 1), %ecx\n"
+    "    shl $" IMPORT_STR(IMPORT_MAX_SHIFT) ", %ecx\n"
+    "    add %r11d, %ecx\n"
+    "    mov umko_import_counts(%rip), %rdx\n"
+    "    lea (%rdx,%rcx,8), %rdx\n"
+    "    mov $1, %ecx\n"
+    "    lock xadd %rcx, (%rdx)\n"
+    "    cmpl $0, umko_import_sampling(%rip)\n"
+    "    jne 2f\n"
+    "1:  lea umko_import_targets(%rip), %rdx\n"
+    "    mov (%rdx,%r11,8), %r11\n"
+    "    .cfi_remember_state\n"
+    "    pop %rdx\n"
+    "    .cfi_adjust_cfa_offset -8\n"
+    "    pop %rcx\n"
+    "    .cfi_adjust_cfa_offset -8\n"
+    "    pop %rax\n"
+    "    .cfi_adjust_cfa_offset -8\n"
+    "    jmp *%r11\n"
+    "    .cfi_restore_state\n"
+    "2:  test %rcx, umko_import_sample_mask(%rip)\n"
+    "    jnz 1b\n"
+    /* rbp+8: rdx, rcx, rax, the return address, then the stack arguments */
+    "    push %rbp\n"
+    "    .cfi_adjust_cfa_offset 8\n"
+    "    .cfi_rel_offset %rbp, 0\n"
+    "    mov %rsp, %rbp\n"
+    "    .cfi_def_cfa_register %rbp\n"
+    "    push %r11\n"
+    "    push %rax\n"
+    "    sub $(" IMPORT_STR(IMPORT_STACK_COPY) " + 8), %rsp\n"
+    "    xor %r11d, %r11d\n"
+    "3:  mov 40(%rbp,%r11), %r10\n"
+    "    mov %r10, (%rsp,%r11)\n"
+    "    add $8, %r11\n"
+    "    cmp $" IMPORT_STR(IMPORT_STACK_COPY) ", %r11\n"
+    "    jb 3b\n"
+    "    mov -8(%rbp), %r11\n"
+    "    lea umko_import_targets(%rip), %r10\n"
+    "    mov (%r10,%r11,8), %r11\n"
+    "    mov 8(%rbp), %rdx\n"
+    "    mov 16(%rbp), %rcx\n"
+    "    mov 24(%rbp), %rax\n"
+    "    call *%r11\n"
+    /* the results are in rax/rdx/xmm0/xmm1, the copy is free now */
+    "    mov %rax, 24(%rbp)\n"
+    "    mov %rdx, 8(%rbp)\n"
+    "    movdqu %xmm0, 0(%rsp)\n"
+    "    movdqu %xmm1, 16(%rsp)\n"
+    "    mov -8(%rbp), %rdi\n"
+    "    mov -16(%rbp), %rsi\n"
+    "    call umko_import_leave\n"
+    "    movdqu 0(%rsp), %xmm0\n"
+    "    movdqu 16(%rsp), %xmm1\n"
+    "    mov 8(%rbp), %rdx\n"
+    "    mov 24(%rbp), %rax\n"
+    "    mov %rbp, %rsp\n"
+    "    pop %rbp\n"
+    "    .cfi_def_cfa %rsp, 32\n"
+    "    .cfi_restore %rbp\n"
+    "    add $24, %rsp\n"
+    "    .cfi_adjust_cfa_offset -24\n"
+    "    ret\n"
+    "    .cfi_endproc\n"
+    ".size umko_import_entry, .-umko_import_entry\n");
+
+bool arch_import_supported()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return edx & (1U << 27);    /* rdtscp */
+}
+
+/* mov $index, %r11d; jmp *0(%rip); .quad umko_import_entry */
+void arch_import_stub(char *stub, uint32_t index)
+{
+    static const uint8_t code[] = {0x41, 0xbb, 0, 0, 0, 0, 0xff, 0x25, 0, 0, 0, 0};
+    uint64_t entry = (uint64_t)umko_import_entry;
+    memset(stub, 0xcc, IMPORT_STUB_SIZE);
+    memcpy(stub, code, sizeof(code));
+    memcpy(stub + 2, &index, 4);
+    memcpy(stub + sizeof(code), &entry, 8);
+}
+
+uint64_t arch_import_clock(uint32_t *cpu_slot)
+{
+    unsigned int aux;
+    uint64_t tsc = __rdtscp(&aux);
+    *cpu_slot = aux & (IMPORT_CPU_SLOTS - 1);
+    return tsc;
+}
@@ -0,0 +1,140 @@
+#include "lazy.h"
+#include <cstring>
+#include <cpuid.h>
+
+/*
+ * Entered from the PLT header with the module and the image offset of
+ * the GOT slot pushed. The argument registers, %rax for varargs and
+ * %r10 for a static chain are kept around umko_lazy_resolve, the vector
+ * registers in full like _dl_runtime_resolve_xsave: arguments may be in
+ * ymm/zmm and the resolver path may use AVX. Without XSAVE only xmm
+ * exists, fxsave keeps it. %rbx holds the frame, the save area is 64
+ * byte aligned below it.
+ */
+#define LAZY_STR_(x) #x
+#define LAZY_STR(x) LAZY_STR_(x)
+/* SSE, AVX, MPX bounds, opmask, ZMM_Hi256, Hi16_ZMM; no AMX tiles, which
+   the kernel hands out on first use */
+#define LAZY_XSAVE_MASK 0xee
+#define LAZY_GPR_SIZE 64
+
+extern "C" {
+__attribute__((visibility("hidden"))) uint64_t umko_lazy_save_size = LAZY_GPR_SIZE + 512;
+__attribute__((visibility("hidden"))) uint32_t umko_lazy_xsave = 0;
+}
+
+asm(".text\n"
+    ".globl umko_lazy_entry\n"
+    ".hidden umko_lazy_entry\n"
+    ".type umko_lazy_entry, @function\n"
+    "umko_lazy_entry:\n"
+    "    push %rbx\n"
+    "    mov %rsp, %rbx\n"
+    "    and $-64, %rsp\n"
+    "    sub umko_lazy_save_size(%rip), %rsp\n"
+    "    mov %rax, 0(%rsp)\n"
+    "    mov %rcx, 8(%rsp)\n"
+    "    mov %rdx, 16(%rsp)\n"
+    "    mov %rdi, 24(%rsp)\n"
+    "    mov %rsi, 32(%rsp)\n"
+    "    mov %r8, 40(%rsp)\n"
+    "    mov %r9, 48(%rsp)\n"
+    "    mov %r10, 56(%rsp)\n"
+    "    cmpl $0, umko_lazy_xsave(%rip)\n"
+    "    je 1f\n"
+    "    mov $" LAZY_STR(LAZY_XSAVE_MASK) ", %eax\n"
+    "    xor %edx, %edx\n"
+    /* xsave leaves the header but XSTATE_BV alone, xrstor wants it clear */
+    "    mov %rdx, 576(%rsp)\n"
+    "    mov %rdx, 584(%rsp)\n"
+    "    mov %rdx, 592(%rsp)\n"
+    "    mov %rdx, 600(%rsp)\n"
+    "    mov %rdx, 608(%rsp)\n"
+    "    mov %rdx, 616(%rsp)\n"
+    "    mov %rdx, 624(%rsp)\n"
+    "    mov %rdx, 632(%rsp)\n"
+    "    xsave 64(%rsp)\n"
+    "    jmp 2f\n"
+    "1:  fxsave 64(%rsp)\n"
+    "2:  mov 8(%rbx), %rdi\n"
+    "    mov 16(%rbx), %rsi\n"
+    "    call umko_lazy_resolve\n"
+    "    mov %rax, %r11\n"
+    "    cmpl $0, umko_lazy_xsave(%rip)\n"
+    "    je 3f\n"
+    "    mov $" LAZY_STR(LAZY_XSAVE_MASK) ", %eax\n"
+    "    xor %edx, %edx\n"
+    "    xrstor 64(%rsp)\n"
+    "    jmp 4f\n"
+    "3:  fxrstor 64(%rsp)\n"
+    "4:  mov 0(%rsp), %rax\n"
+    "    mov 8(%rsp), %rcx\n"
+    "    mov 16(%rsp), %rdx\n"
+    "    mov 24(%rsp), %rdi\n"
+    "    mov 32(%rsp), %rsi\n"
+    "    mov 40(%rsp), %r8\n"
+    "    mov 48(%rsp), %r9\n"
+    "    mov 56(%rsp), %r10\n"
+    "    mov %rbx, %rsp\n"
+    "    pop %rbx\n"
+    "    add $16, %rsp\n"
+    "    jmp *%r11\n"
+    ".size umko_lazy_entry, .-umko_lazy_entry\n");
+
+/* the xsave area in the standard format ends with the last component of
+   the mask the OS enabled, CPUID leaf 0xd gives where each one lies */
+__attribute__((constructor)) static void lazy_save_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1U << 27)) || __get_cpuid_max(0, nullptr) < 0xd) {
+		return;
+	}
+	asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	uint32_t enabled = eax & LAZY_XSAVE_MASK;
+	uint64_t size = 512 + 64;
+	for (uint32_t i = 2; i < 8; i++) {
+		if (enabled & (1U << i) && __get_cpuid_count(0xd, i, &eax, &ebx, &ecx, &edx) && ebx + eax > size) {
+			size = ebx + eax;
+		}
+	}
+	umko_lazy_save_size = (LAZY_GPR_SIZE + size + 63) & ~63UL;
+	umko_lazy_xsave = 1;
+}
+
+/* pushq 1f(%rip); jmp *2f(%rip); int3 x4; 1: .quad ctx; 2: .quad umko_lazy_entry */
+void arch_lazy_plt_header(void *header, uint64_t ctx)
+{
+	uint8_t *p = (uint8_t *)header;
+	int32_t ctx_disp = 16 - 6;
+	int32_t entry_disp = 24 - 12;
+	uint64_t entry = (uint64_t)umko_lazy_entry;
+
+	memset(p, 0xcc, 16);
+	p[0] = 0xff;
+	p[1] = 0x35;
+	memcpy(p + 2, &ctx_disp, 4);
+	p[6] = 0xff;
+	p[7] = 0x25;
+	memcpy(p + 8, &entry_disp, 4);
+	memcpy(p + 16, &ctx, 8);
+	memcpy(p + 24, &entry, 8);
+}
+
+/* jmp *slot(%rip); 1: pushq $slot - base; jmp header; the slot starts at 1 */
+uint64_t arch_lazy_plt_entry(void *entry, uint64_t slot, uint64_t header, uint64_t base)
+{
+	uint8_t *p = (uint8_t *)entry;
+	int32_t slot_disp = (int32_t)(slot - ((uint64_t)entry + 6));
+	int32_t offset = (int32_t)(slot - base);
+	int32_t header_disp = (int32_t)(header - ((uint64_t)entry + 16));
+
+	p[0] = 0xff;
+	p[1] = 0x25;
+	memcpy(p + 2, &slot_disp, 4);
+	p[6] = 0x68;
+	memcpy(p + 7, &offset, 4);
+	p[11] = 0xe9;
+	memcpy(p + 12, &header_disp, 4);
+	return (uint64_t)entry + 6;
+}
@@ -0,0 +1,107 @@
+#include "patch.h"
+#include <csignal>
+#include <cstring>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include "logger.h"
+
+#define JMP_REL32_SIZE 5
+#define OPCODE_JMP_REL32 0xe9
+#define OPCODE_INT3 0xcc
+
+/* the patch in progress, read by the SIGTRAP handler */
+static volatile uint64_t bp_addr;
+static volatile uint64_t bp_target;
+static struct sigaction old_trap_action;
+
+/* make every thread of the process drop its prefetched instructions */
+static void sync_cores(void)
+{
+    static int registered = 0;
+    if (registered == 0) {
+        registered = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0 ? 1 : -1;
+    }
+    if (registered > 0) {
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+    } else {
+        __sync_synchronize();
+    }
+}
+
+/* a thread ran into the int3 while the jmp was written: it goes to the
+   new function directly, as it would once the patch is complete */
+static void trap_handler(int sig, siginfo_t *info, void *ctx)
+{
+    ucontext_t *uc = (ucontext_t *)ctx;
+    if ((uint64_t)uc->uc_mcontext.gregs[REG_RIP] - 1 == bp_addr) {
+        uc->uc_mcontext.gregs[REG_RIP] = bp_target;
+        return;
+    }
+    if (old_trap_action.sa_flags & SA_SIGINFO) {
+        old_trap_action.sa_sigaction(sig, info, ctx);
+    } else if (old_trap_action.sa_handler != SIG_DFL && old_trap_action.sa_handler != SIG_IGN) {
+        old_trap_action.sa_handler(sig);
+    } else {
+        signal(SIGTRAP, SIG_DFL);
+        raise(SIGTRAP);
+    }
+}
+
+/* int3 first, then the displacement, then the opcode, like text_poke_bp
+   of the kernel, for entries where the jmp straddles an 8-byte word */
+static void patch_with_breakpoint(uint8_t *from, const uint8_t *insn, uint64_t to)
+{
+    static bool installed = false;
+    if (!installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = trap_handler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGTRAP, &sa, &old_trap_action);
+        installed = true;
+    }
+    bp_target = to;
+    bp_addr = (uint64_t)from;
+    __atomic_store_n(from, (uint8_t)OPCODE_INT3, __ATOMIC_RELEASE);
+    sync_cores();
+    memcpy(from + 1, insn + 1, JMP_REL32_SIZE - 1);
+    sync_cores();
+    __atomic_store_n(from, insn[0], __ATOMIC_RELEASE);
+    sync_cores();
+    bp_addr = 0;
+}
+
+int arch_patch_jump(void *from, uint64_t size, void *to)
+{
+    uint8_t *pc = (uint8_t *)from;
+    int64_t rel = (int64_t)to - (int64_t)(pc + JMP_REL32_SIZE);
+    if (size < JMP_REL32_SIZE) {
+        log_error("patch: function at %p is too short for a jmp\n", from);
+        return -1;
+    }
+    if (rel != (int32_t)rel) {
+        log_error("patch: %p is out of jmp range from %p\n", to, from);
+        return -1;
+    }
+    uint8_t insn[JMP_REL32_SIZE];
+    int32_t rel32 = (int32_t)rel;
+    insn[0] = OPCODE_JMP_REL32;
+    memcpy(insn + 1, &rel32, sizeof(rel32));
+
+    uint64_t word_off = (uint64_t)pc & 7;
+    if (word_off + JMP_REL32_SIZE <= 8) {
+        /* the whole jmp sits in one aligned word, store it at once */
+        uint64_t *word = (uint64_t *)(pc - word_off);
+        uint64_t val = *word;
+        memcpy((uint8_t *)&val + word_off, insn, JMP_REL32_SIZE);
+        __atomic_store_n(word, val, __ATOMIC_RELEASE);
+        sync_cores();
+    } else {
+        patch_with_breakpoint(pc, insn, (uint64_t)to);
+    }
+    log_debug("patch: jmp from %p to %p\n", from, to);
+    return 0;
+}
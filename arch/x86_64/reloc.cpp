@@ -1,9 +1,15 @@
 #include <cstdint>
+#include <cstring>
 #include <elfio/elfio.hpp>
 #include "logger.h"
 #include "reloc.h"
 
 using namespace ELFIO;
+
+#ifndef R_X86_64_IRELATIVE
+#define R_X86_64_IRELATIVE 37
+#endif
+
 int do_relocate_add(uint32_t reloc_type, void *loc, uint64_t val)
 {
     switch (reloc_type) {
@@ -28,12 +34,38 @@ int do_relocate_add(uint32_t reloc_type, void *loc, uint64_t val)
 			if ((int64_t)val != *(int32_t *)loc)
 				goto overflow;
 			break;
+		case R_X86_64_TPOFF32:
+		case R_X86_64_DTPOFF32:
+			if (*(int32_t *)loc != 0)
+				goto invalid_relocation;
+			*(int32_t *)loc = val;
+			if ((int64_t)val != *(int32_t *)loc)
+				goto overflow;
+			break;
+		case R_X86_64_TPOFF64:
+		case R_X86_64_DTPOFF64:
+		case R_X86_64_IRELATIVE:
+			if (*(uint64_t *)loc != 0)
+				goto invalid_relocation;
+			*(uint64_t *)loc = val;
+			break;
+		case R_X86_64_TLSDESC_CALL:
+			break;
+		case R_X86_64_GOTPCREL:
+		case R_X86_64_GOTPCRELX:
+		case R_X86_64_REX_GOTPCRELX:
+		case R_X86_64_GOTTPOFF:
+		case R_X86_64_TLSGD:
+		case R_X86_64_TLSLD:
+		case R_X86_64_GOTPC32_TLSDESC:
 		case R_X86_64_PC32:
 		case R_X86_64_PLT32:
 			if (*(uint32_t *)loc != 0)
 				goto invalid_relocation;
 			val -= (uint64_t)loc;
 			*(uint32_t *)loc = val;
+			if ((int64_t)val != *(int32_t *)loc)
+				goto overflow;
 			break;
 		case R_X86_64_PC64:
 			if (*(uint64_t *)loc != 0)
@@ -57,3 +89,96 @@ overflow:
 	       reloc_type, loc, val);
 	return -ENOEXEC;
 }
+
+int reloc_class(uint32_t reloc_type)
+{
+	switch (reloc_type) {
+	case R_X86_64_DTPOFF32:
+	case R_X86_64_DTPOFF64:
+		return RELOC_CLASS_DTPOFF;
+	case R_X86_64_IRELATIVE:
+		return RELOC_CLASS_IRELATIVE;
+	case R_X86_64_GOTPCREL:
+	case R_X86_64_GOTPCRELX:
+	case R_X86_64_REX_GOTPCRELX:
+		return RELOC_CLASS_GOT;
+	case R_X86_64_GOTTPOFF:
+		return RELOC_CLASS_GOT_TPOFF;
+	case R_X86_64_TLSGD:
+		return RELOC_CLASS_GOT_TLSGD;
+	case R_X86_64_TLSLD:
+		return RELOC_CLASS_GOT_TLSLD;
+	case R_X86_64_GOTPC32_TLSDESC:
+		return RELOC_CLASS_GOT_TLSDESC;
+	default:
+		return RELOC_CLASS_PLAIN;
+	}
+}
+
+/* how a relocated field changes when the image moves, for instances */
+int reloc_addr_kind(uint32_t reloc_type)
+{
+	switch (reloc_type) {
+	case R_X86_64_64:
+	case R_X86_64_32:
+	case R_X86_64_32S:
+	case R_X86_64_IRELATIVE:
+		return RELOC_ADDR_ABS;
+	case R_X86_64_PC32:
+	case R_X86_64_PLT32:
+	case R_X86_64_PC64:
+	case R_X86_64_GOTPCREL:
+	case R_X86_64_GOTPCRELX:
+	case R_X86_64_REX_GOTPCRELX:
+	case R_X86_64_GOTTPOFF:
+	case R_X86_64_TLSGD:
+	case R_X86_64_TLSLD:
+	case R_X86_64_GOTPC32_TLSDESC:
+		return RELOC_ADDR_PCREL;
+	default:
+		return RELOC_ADDR_NONE;
+	}
+}
+
+bool reloc_is_call(uint32_t reloc_type)
+{
+	return reloc_type == R_X86_64_PLT32;
+}
+
+bool reloc_call_reaches(uint64_t loc, uint64_t val)
+{
+	int64_t disp = (int64_t)(val - loc);
+	return disp == (int32_t)disp;
+}
+
+/* jmp *slot(%rip), padded with int3 */
+void arch_plt_entry(void *entry, uint64_t slot)
+{
+	uint8_t *p = (uint8_t *)entry;
+	int32_t disp = (int32_t)(slot - ((uint64_t)entry + 6));
+	memset(p, 0xcc, PLT_ENTRY_SIZE);
+	p[0] = 0xff;
+	p[1] = 0x25;
+	memcpy(p + 2, &disp, 4);
+}
+
+/* movabs $ctx, %rdi/%rsi; movabs $target, %rax; jmp *%rax */
+void arch_ctx_stub(void *stub, uint32_t arg, uint64_t ctx, uint64_t target)
+{
+	uint8_t *p = (uint8_t *)stub;
+	memset(p, 0xcc, 32);
+	p[0] = 0x48;
+	p[1] = arg == 0 ? 0xbf : 0xbe;
+	memcpy(p + 2, &ctx, 8);
+	p[10] = 0x48;
+	p[11] = 0xb8;
+	memcpy(p + 12, &target, 8);
+	p[20] = 0xff;
+	p[21] = 0xe0;
+}
+
+/* resolvers take no arguments here, they read cpuid themselves */
+uint64_t arch_ifunc_resolve(uint64_t resolver)
+{
+	return ((uint64_t (*)(void))resolver)();
+}
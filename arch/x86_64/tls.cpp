@@ -0,0 +1,9 @@
+/* TLS descriptor resolver for blocks in static TLS: %rax points to the
+   descriptor, whose second word is the TP offset to return. */
+asm(".text\n"
+    ".globl umko_tlsdesc_return\n"
+    ".type umko_tlsdesc_return, @function\n"
+    "umko_tlsdesc_return:\n"
+    "    movq 8(%rax), %rax\n"
+    "    ret\n"
+    ".size umko_tlsdesc_return, .-umko_tlsdesc_return\n");
@@ -0,0 +1,10 @@
+/* the far end of the call path benchmark, APP_Root is the entry */
+int cb_leaf(int x)
+{
+    return x + 1;
+}
+
+int APP_Root(int x)
+{
+    return x + 1;
+}
@@ -0,0 +1,39 @@
+/*
+ * Loops of calls from a module, built once per way of reaching the
+ * callees: CB_PREFIX names the build, so that all of them can be loaded
+ * together. lat_* chains every call on the result of the one before,
+ * tput_* makes independent calls.
+ */
+#define CB_CAT2(a, b) a##_##b
+#define CB_CAT(a, b) CB_CAT2(a, b)
+#define CB_NAME(x) CB_CAT(CB_PREFIX, x)
+
+extern int cb_leaf(int x);
+extern int cb_host_leaf(int x);
+
+__attribute__((noipa)) static int local_leaf(int x)
+{
+    return x + 1;
+}
+
+#define CB_LOOPS(kind, f) \
+    unsigned long CB_NAME(lat_##kind)(unsigned long n) \
+    { \
+        int x = 0; \
+        for (unsigned long i = 0; i < n; i++) { \
+            x = f(x); \
+        } \
+        return x; \
+    } \
+    unsigned long CB_NAME(tput_##kind)(unsigned long n) \
+    { \
+        unsigned long sum = 0; \
+        for (unsigned long i = 0; i < n; i++) { \
+            sum += f((int)i); \
+        } \
+        return sum; \
+    }
+
+CB_LOOPS(local, local_leaf)
+CB_LOOPS(host, cb_host_leaf)
+CB_LOOPS(module, cb_leaf)
@@ -0,0 +1,37 @@
+/*
+ * One object of the benchmark corpus, built both as a relocatable object
+ * for umko and as a shared library for dlopen. BENCH_PAD sizes the
+ * read-only data, BENCH_FUNCS the number of functions to look up.
+ */
+#ifndef BENCH_PAD
+#define BENCH_PAD 1
+#endif
+#ifndef BENCH_FUNCS
+#define BENCH_FUNCS 10
+#endif
+
+const unsigned char bench_pad[BENCH_PAD] = {1};
+int bench_funcs = BENCH_FUNCS;
+
+#define F(i) int bench_fn_##i(int x) { return x * 3 + 1##i; }
+#define F10(i) F(i##0) F(i##1) F(i##2) F(i##3) F(i##4) F(i##5) F(i##6) F(i##7) F(i##8) F(i##9)
+#define F100(i) F10(i##0) F10(i##1) F10(i##2) F10(i##3) F10(i##4) \
+    F10(i##5) F10(i##6) F10(i##7) F10(i##8) F10(i##9)
+
+#if BENCH_FUNCS >= 1000
+F100(0) F100(1) F100(2) F100(3) F100(4) F100(5) F100(6) F100(7) F100(8) F100(9)
+#elif BENCH_FUNCS >= 100
+F100(0)
+#else
+F10(00)
+#endif
+
+/* reads a byte of every page of the data, returns their sum */
+unsigned long bench_touch(void)
+{
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < sizeof(bench_pad); i += 4096) {
+        sum += ((volatile const unsigned char *)bench_pad)[i];
+    }
+    return sum;
+}
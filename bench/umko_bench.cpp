@@ -0,0 +1,234 @@
+/*
+ * umko against dlopen on the same corpus. For each pair of a .o and a .so
+ * it measures, per loader:
+ *   cold_load_us   first load after dropping the file from the page cache
+ *   warm_load_us   average load, the file cached and the module unloaded
+ *   lookup_ns      average lookup of one of the bench_fn_* symbols
+ *   call_ns        average call of bench_fn_000 through its address
+ *   rss_kb/pss_kb  growth of the process with the module loaded, and
+ *                  again once bench_touch has read all of its data
+ * and writes one CSV line each.
+ */
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "umko.h"
+#include "logger.h"
+
+#define CALL_NUM 10000000
+
+typedef int (*BenchFunc)(int);
+typedef unsigned long (*TouchFunc)(void);
+
+struct Loader {
+    const char *name;
+    void *(*load)(const char *path);
+    void *(*sym)(void *handle, const char *name);
+    void (*unload)(void *handle);
+};
+
+struct Result {
+    double cold_load_us;
+    double warm_load_us;
+    double lookup_ns;
+    double call_ns;
+    long rss_kb;
+    long pss_kb;
+    long touched_rss_kb;
+    long touched_pss_kb;
+};
+
+static void *umko_open(const char *path)
+{
+    return umko_load(path);
+}
+
+static void *umko_lookup(void *handle, const char *name)
+{
+    return umko_sym((umko_module *)handle, name);
+}
+
+static void umko_close(void *handle)
+{
+    umko_unload((umko_module *)handle);
+}
+
+static void *dl_open(const char *path)
+{
+    return dlopen(path, RTLD_NOW | RTLD_LOCAL);
+}
+
+static void dl_close(void *handle)
+{
+    dlclose(handle);
+}
+
+static const Loader loaders[] = {
+    {"umko", umko_open, umko_lookup, umko_close},
+    {"dlopen", dl_open, dlsym, dl_close},
+};
+
+static inline double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Rss and Pss of the process in KiB */
+static void read_memory(long &rss, long &pss)
+{
+    rss = pss = 0;
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == nullptr) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        sscanf(line, "Rss: %ld kB", &rss);
+        sscanf(line, "Pss: %ld kB", &pss);
+    }
+    fclose(fp);
+}
+
+/* clean pages of the file leave the page cache, no privilege needed */
+static void drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static int run_loader(const Loader &loader, const char *path, int iterations, Result &res)
+{
+    drop_cache(path);
+    double start = now_ns();
+    void *handle = loader.load(path);
+    res.cold_load_us = (now_ns() - start) / 1e3;
+    if (handle == nullptr) {
+        fprintf(stderr, "%s: cannot load %s\n", loader.name, path);
+        return -1;
+    }
+    int *funcs = (int *)loader.sym(handle, "bench_funcs");
+    int func_num = funcs ? *funcs : 0;
+    loader.unload(handle);
+
+    double total = 0;
+    for (int i = 0; i < iterations; i++) {
+        start = now_ns();
+        handle = loader.load(path);
+        total += now_ns() - start;
+        loader.unload(handle);
+    }
+    res.warm_load_us = total / iterations / 1e3;
+
+    long rss0, pss0, rss1, pss1;
+    read_memory(rss0, pss0);
+    handle = loader.load(path);
+    read_memory(rss1, pss1);
+    res.rss_kb = rss1 - rss0;
+    res.pss_kb = pss1 - pss0;
+
+    std::vector<std::string> names;
+    char name[32];
+    for (int i = 0; i < func_num; i++) {
+        snprintf(name, sizeof(name), "bench_fn_%03d", i);
+        names.push_back(name);
+    }
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        for (auto &n : names) {
+            if (loader.sym(handle, n.c_str()) == nullptr) {
+                fprintf(stderr, "%s: %s not found in %s\n", loader.name, n.c_str(), path);
+                loader.unload(handle);
+                return -1;
+            }
+        }
+    }
+    res.lookup_ns = func_num ? (now_ns() - start) / iterations / func_num : 0;
+
+    BenchFunc fn = (BenchFunc)loader.sym(handle, "bench_fn_000");
+    TouchFunc touch = (TouchFunc)loader.sym(handle, "bench_touch");
+    if (fn == nullptr || touch == nullptr) {
+        fprintf(stderr, "%s: %s is not a bench corpus object\n", loader.name, path);
+        loader.unload(handle);
+        return -1;
+    }
+    volatile int sink = 0;
+    start = now_ns();
+    for (int i = 0; i < CALL_NUM; i++) {
+        sink = fn(sink);
+    }
+    res.call_ns = (now_ns() - start) / CALL_NUM;
+
+    touch();
+    read_memory(rss1, pss1);
+    res.touched_rss_kb = rss1 - rss0;
+    res.touched_pss_kb = pss1 - pss0;
+    loader.unload(handle);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n iterations] [-o file.csv] <corpus.o> <corpus.so> [...]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 20;
+    const char *out_path = "umko_bench.csv";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:")) != -1) {
+        if (opt == 'n') {
+            iterations = atoi(optarg);
+        } else if (opt == 'o') {
+            out_path = optarg;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc || (argc - optind) % 2 != 0 || iterations <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    /* the loader logs every relocation at DEBUG */
+    Logger::GetInstance().setLevel(Logger::ERROR);
+
+    FILE *out = fopen(out_path, "w");
+    if (out == nullptr) {
+        perror(out_path);
+        return 1;
+    }
+    fprintf(out, "loader,object,size_bytes,cold_load_us,warm_load_us,lookup_ns,call_ns,"
+        "rss_kb,pss_kb,touched_rss_kb,touched_pss_kb\n");
+    int ret = 0;
+    for (int i = optind; i < argc; i += 2) {
+        for (int l = 0; l < 2; l++) {
+            const char *path = argv[i + l];
+            struct stat st;
+            Result res;
+            if (stat(path, &st) != 0 || run_loader(loaders[l], path, iterations, res) != 0) {
+                ret = 1;
+                continue;
+            }
+            fprintf(out, "%s,%s,%ld,%.1f,%.1f,%.1f,%.2f,%ld,%ld,%ld,%ld\n", loaders[l].name, path,
+                (long)st.st_size, res.cold_load_us, res.warm_load_us, res.lookup_ns, res.call_ns,
+                res.rss_kb, res.pss_kb, res.touched_rss_kb, res.touched_pss_kb);
+            fflush(out);
+        }
+    }
+    fclose(out);
+    printf("results in %s\n", out_path);
+    return ret;
+}
@@ -0,0 +1,205 @@
+/*
+ * Cost of one call on each path into and out of module code:
+ *   host -> module     the entry from umko_entry, called by the host
+ *   local              a call inside a module, the direct baseline
+ *   module -> host     a function the host exports with RegFunc
+ *   module -> module   cb_leaf in the callee module
+ * the last two direct, through a GOT slot (caller built -fno-plt) and
+ * through the PLT stub of an instance template. Counts CPU cycles with
+ * perf_event_open, or the timestamp counter where there is no PMU (such
+ * as under qemu-user).
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include "umko.h"
+#include "register.h"
+#include "logger.h"
+
+#define REPEAT_NUM 5
+
+typedef unsigned long (*LoopFunc)(unsigned long n);
+
+struct Path {
+    std::string name;
+    LoopFunc lat;
+    LoopFunc tput;
+};
+
+static int cycles_fd = -1;
+static int (*volatile entry_func)(int);
+
+extern "C" int cb_host_leaf(int x)
+{
+    return x + 1;
+}
+RegFunc(cb_host_leaf);
+
+static void counter_open()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline uint64_t counter_read()
+{
+    uint64_t value;
+    if (cycles_fd >= 0 && read(cycles_fd, &value, sizeof(value)) == sizeof(value)) {
+        return value;
+    }
+#if defined(__x86_64__)
+    uint32_t lo, hi;
+    asm volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return 0;
+#endif
+}
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned long entry_lat(unsigned long n)
+{
+    int x = 0;
+    for (unsigned long i = 0; i < n; i++) {
+        x = entry_func(x);
+    }
+    return x;
+}
+
+static unsigned long entry_tput(unsigned long n)
+{
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < n; i++) {
+        sum += entry_func((int)i);
+    }
+    return sum;
+}
+
+/* best of REPEAT_NUM runs, in counter units and ns per call */
+static void measure(LoopFunc loop, unsigned long n, double &units, double &ns)
+{
+    units = ns = 1e30;
+    for (int r = 0; r < REPEAT_NUM; r++) {
+        uint64_t t0 = now_ns();
+        uint64_t c0 = counter_read();
+        loop(n);
+        uint64_t c1 = counter_read();
+        uint64_t t1 = now_ns();
+        units = std::min(units, (double)(c1 - c0) / n);
+        ns = std::min(ns, (double)(t1 - t0) / n);
+    }
+}
+
+static bool add_paths(std::vector<Path> &paths, const char *how, const std::string &prefix,
+    void *(*lookup)(void *, const char *), void *handle)
+{
+    static const char *const kinds[][2] = {
+        {"local", "local"}, {"module -> host", "host"}, {"module -> module", "module"},
+    };
+    for (auto &kind : kinds) {
+        std::string lat = prefix + "_lat_" + kind[1];
+        std::string tput = prefix + "_tput_" + kind[1];
+        Path path = {std::string(kind[0]) + " (" + how + ")",
+            (LoopFunc)lookup(handle, lat.c_str()), (LoopFunc)lookup(handle, tput.c_str())};
+        if (path.lat == nullptr || path.tput == nullptr) {
+            fprintf(stderr, "%s not found\n", lat.c_str());
+            return false;
+        }
+        paths.push_back(path);
+    }
+    return true;
+}
+
+static void *module_lookup(void *handle, const char *name)
+{
+    return umko_sym((umko_module *)handle, name);
+}
+
+static void *instance_lookup(void *handle, const char *name)
+{
+    return umko_instance_sym((umko_instance *)handle, name);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n calls] <callee.o> <caller_direct.o> <caller_got.o> <caller_plt.o>\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long calls = 1 << 22;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            usage(argv[0]);
+            return 1;
+        }
+        calls = strtoul(optarg, nullptr, 0);
+    }
+    if (argc - optind != 4 || calls == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    Logger::GetInstance().setLevel(Logger::ERROR);
+
+    umko_module *callee = umko_load(argv[optind]);
+    umko_module *direct = umko_load(argv[optind + 1]);
+    umko_module *got = umko_load(argv[optind + 2]);
+    umko_module *tmpl = umko_load_template(argv[optind + 3]);
+    umko_instance *inst = tmpl ? umko_instance_create(tmpl) : nullptr;
+    entry_func = (int (*)(int))umko_entry();
+    if (callee == nullptr || direct == nullptr || got == nullptr || inst == nullptr || entry_func == nullptr) {
+        fprintf(stderr, "cannot load the call path objects\n");
+        return 1;
+    }
+
+    std::vector<Path> paths = {{"host -> module (entry)", entry_lat, entry_tput}};
+    if (!add_paths(paths, "direct", "direct", module_lookup, direct)
+        || !add_paths(paths, "GOT", "got", module_lookup, got)
+        || !add_paths(paths, "PLT stub", "plt", instance_lookup, inst)) {
+        return 1;
+    }
+
+    counter_open();
+    const char *unit = cycles_fd >= 0 ? "cycles" : "ticks";
+    printf("%lu calls per run, best of %d, %s from %s\n", calls, REPEAT_NUM, unit,
+        cycles_fd >= 0 ? "perf_event_open" : "the timestamp counter");
+    printf("%-28s %12s %10s %12s %10s\n", "path", "latency", "ns", "throughput", "Mcalls/s");
+    for (auto &path : paths) {
+        double lat_units, lat_ns, tput_units, tput_ns;
+        measure(path.lat, calls, lat_units, lat_ns);
+        measure(path.tput, calls, tput_units, tput_ns);
+        printf("%-28s %12.2f %10.2f %12.2f %10.1f\n", path.name.c_str(), lat_units, lat_ns,
+            tput_units, 1e3 / tput_ns);
+    }
+
+    umko_instance_destroy(inst);
+    umko_unload(tmpl);
+    umko_unload(got);
+    umko_unload(direct);
+    umko_unload(callee);
+    return 0;
+}
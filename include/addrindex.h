@@ -0,0 +1,32 @@
+#ifndef __ADDRINDEX_H__
+#define __ADDRINDEX_H__
+
+#include <cstdint>
+
+class Module;
+
+/*
+ * Address ranges of the loaded modules and their functions. Each module
+ * gets a read-only image built at load: its function starts, sorted,
+ * with offsets into a string arena. The images hang off a sorted table
+ * which is replaced, never changed, so lookups take no lock, allocate
+ * nothing and are safe in signal handlers.
+ */
+#define ADDR_NAME_MAX 256
+
+struct AddrInfo {
+    uint64_t mod_base;
+    uint64_t sym_addr;      /* 0 when no function covers the address */
+    uint64_t offset;        /* from sym_addr, else from mod_base */
+    char mod_name[ADDR_NAME_MAX];
+    char sym_name[ADDR_NAME_MAX];
+};
+
+/* owner keys the entry, the module itself by default, delta moves the
+   module addresses to an instance of it */
+void addr_index_add(Module &mod, const void *owner = nullptr, int64_t delta = 0);
+void addr_index_remove(const void *owner);
+/* false when addr is not in a module, async-signal-safe, O(log n) */
+bool addr_index_lookup(uint64_t addr, AddrInfo &info);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef __BUNDLE_H__
+#define __BUNDLE_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * A bundle holds variants of one object built for different CPUs, each
+ * tagged with the features it needs, a comma separated list. Loading a
+ * bundle loads the variant needing the most features this CPU has, an
+ * untagged variant is the baseline. Names are the GCC -m options on
+ * x86_64 (avx2, avx512f, ...) with the levels x86-64-v2/v3/v4, and the
+ * HWCAP names of /proc/cpuinfo on aarch64 (asimd, sve, sve2, ...). A
+ * name this CPU does not know is a feature it does not have.
+ *
+ * Layout: BundleHeader, num BundleEntry, then the objects at page
+ * aligned offsets, so a variant is mapped from the file on its own.
+ */
+#define UMKO_BUNDLE_MAGIC "UMKOBNDL"
+#define UMKO_BUNDLE_VERSION 1
+#define BUNDLE_FEATURES_MAX 112
+#define BUNDLE_ALIGN 4096
+
+struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num;
+};
+
+struct BundleEntry {
+    uint64_t offset;
+    uint64_t size;
+    char features[BUNDLE_FEATURES_MAX];
+};
+
+bool bundle_is(const void *buf, uint64_t size);
+/* the variant this CPU runs best, -1 when none of them fits */
+uint32_t bundle_select(const void *buf, uint64_t size, const char *path, uint64_t &offset, uint64_t &obj_size);
+/* variants are "<features>=<object>" or "<object>" for the baseline */
+uint32_t bundle_write(const char *path, const std::vector<std::string> &variants);
+
+/* how many base features a feature list stands for, -1 when this CPU
+   lacks one of them */
+int32_t cpu_features_weight(const std::string &list);
+/* arch: the same for one name */
+int32_t arch_cpu_feature(const std::string &name);
+
+#endif
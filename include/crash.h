@@ -0,0 +1,20 @@
+#ifndef __CRASH_H__
+#define __CRASH_H__
+
+#include <cstdint>
+
+/*
+ * Crash report for faults in module code: SIGSEGV, SIGBUS, SIGILL and
+ * SIGFPE print the faulting module and function and the frame pointer
+ * chain to stderr, symbolized through the address index, then the
+ * previous disposition of the signal takes over.
+ */
+#define CRASH_MAX_DEPTH 32
+#define CRASH_ALT_STACK_SIZE (64 * 1024)
+
+uint32_t crash_report_enable();
+/* pcs of the frame pointer chain of a signal context, leaf first,
+   async-signal-safe */
+uint32_t context_frames(void *ctx, uint64_t *pcs, uint32_t max);
+
+#endif
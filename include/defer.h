@@ -0,0 +1,36 @@
+#ifndef __DEFER_H__
+#define __DEFER_H__
+
+#include <cstdint>
+#include <mutex>
+
+class Module;
+class SysEnv;
+
+/*
+ * Modules loaded on their first call. Only the symbol table of the
+ * object is read up front, each exported function gets a stub in env,
+ * built like an entry of the lazy PLT (see lazy.h) with a slot of its
+ * own. The first call through any stub loads, relocates and constructs
+ * the module in umko_lazy_resolve, which then points all slots at the
+ * real functions; stubs other modules have bound to keep working. An
+ * object exporting data cannot be deferred. A load failing at the first
+ * call is fatal, like an unbound lazy symbol.
+ */
+/* set in the ctx the stub header passes, tells umko_lazy_resolve the
+   slot is one of a deferred module */
+#define DEFER_CTX_TAG 1UL
+
+struct Deferred;
+
+/* stand in for the object at the path of mod, which is loaded into env
+   with lock held on the first call; -1 when it cannot be deferred */
+uint32_t defer_module(Module &mod, SysEnv &env, std::recursive_mutex &lock);
+/* target of the stub slot at slot, an offset in the stubs or an address */
+uint64_t defer_resolve(Module &mod, uint64_t slot);
+/* deferred and not loaded yet */
+bool defer_pending(Module &mod);
+/* unmap the stubs, at unload */
+void defer_release(Module &mod);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __GOT_H__
+#define __GOT_H__
+
+#include <cstdint>
+
+class Module;
+
+/* Per module GOT, placed at the end of the RW part of the image.
+   Slots are created for relocations whose class needs one. */
+uint32_t scan_got(Module &mod);
+uint32_t fill_got(Module &mod);
+/* set the address slot of one symbol again, once an ifunc is resolved */
+void fill_got_symbol(Module &mod, uint32_t sym_index, uint64_t value);
+uint64_t got_slot_addr(Module &mod, uint32_t sym_index, int reloc_cls);
+void fill_plt(Module &mod);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __HANDLE_H__
+#define __HANDLE_H__
+
+#include <cstdint>
+#include <utility>
+
+/*
+ * Typed handle on a module function. The address is resolved once by
+ * Module::find or umko::sym, calls go straight through the cached pointer.
+ */
+template <typename Sig> class FuncHandle;
+
+template <typename R, typename... Args>
+class FuncHandle<R(Args...)> {
+public:
+    using Fn = R (*)(Args...);
+
+    FuncHandle() = default;
+    explicit FuncHandle(uint64_t addr) : fn((Fn)addr) {}
+
+    explicit operator bool() const
+    {
+        return fn != nullptr;
+    }
+    R operator()(Args... args) const
+    {
+        return fn(std::forward<Args>(args)...);
+    }
+    Fn get() const
+    {
+        return fn;
+    }
+private:
+    Fn fn = nullptr;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+#include <cstdint>
+#include <string>
+
+class Module;
+
+/*
+ * Module heaps behind umko_heap.h. A module importing the allocator gets
+ * a heap, and its calls to umko_alloc, umko_alloc_class and
+ * umko_arena_reset are bound to stubs passing that heap in an argument
+ * register. Spans of HEAP_SPAN_SIZE are taken from one reserved range, a
+ * span header holds the arena owning it, so frees find it by masking
+ * the address. Other threads free into a lock-free list of the arena
+ * which its thread takes over on its next refill. Arenas of exited
+ * threads are adopted by new ones.
+ */
+#define HEAP_SPAN_SHIFT 16
+#define HEAP_SPAN_SIZE (1UL << HEAP_SPAN_SHIFT)
+#define HEAP_RESERVE (1UL << 35)
+#define HEAP_MAX 256            /* heaps alive at once */
+#define HEAP_STUB_SIZE 32
+
+struct HeapStats {
+    uint64_t used;          /* bytes in objects handed out */
+    uint64_t mapped;        /* bytes in spans */
+    uint64_t arenas;
+    uint64_t fallback_num;  /* allocations passed to malloc */
+};
+
+/* address of an allocator symbol for mod, -1 for other names */
+uint32_t heap_bind(Module &mod, const std::string &name, uint64_t &addr);
+/* release all memory of the heap of mod, at unload */
+void heap_destroy(Module &mod);
+bool heap_stats(Module &mod, HeapStats &stats);
+bool heap_in_use();
+
+#endif
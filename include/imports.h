@@ -0,0 +1,43 @@
+#ifndef __IMPORTS_H__
+#define __IMPORTS_H__
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Call counting for host functions imported by modules. Each import is
+ * bound to a stub which loads its index into a scratch register (r11,
+ * x16) and enters umko_import_entry, which bumps a counter of the CPU
+ * and tail-jumps to the host function. One call in 2^sample_shift per
+ * CPU is instead made from umko_import_entry, which passes on the first
+ * IMPORT_STACK_COPY bytes of stack arguments, and timed in rdtsc/cntvct
+ * ticks. Functions returning twice are not bound to a stub. The table
+ * is printed at exit.
+ */
+#define IMPORT_MAX_SHIFT 10
+#define IMPORT_MAX (1 << IMPORT_MAX_SHIFT)
+#define IMPORT_CPU_SLOTS 64     /* counters are per CPU modulo this */
+#define IMPORT_STUB_SIZE 24
+#define IMPORT_STACK_COPY 128   /* stack arguments of a timed call, bytes */
+
+#define IMPORT_STR(x) IMPORT_XSTR(x)
+#define IMPORT_XSTR(x) #x
+
+/* sample_shift < 0 only counts */
+uint32_t import_enable(int32_t sample_shift);
+bool import_enabled();
+/* address modules should call for the host function at target, target
+   itself for data and when the table is full */
+uint64_t import_bind(const std::string &name, uint64_t target);
+
+extern "C" {
+void umko_import_entry(void);
+}
+
+/* arch part */
+bool arch_import_supported();
+void arch_import_stub(char *stub, uint32_t index);
+/* timestamp of the trampolines, and the counter slot of the caller */
+uint64_t arch_import_clock(uint32_t *cpu_slot);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __INITWATCH_H__
+#define __INITWATCH_H__
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Timing of module constructors. Every .init_array entry and Construct
+ * call is timed and reported when it takes longer than the threshold.
+ * With a watchdog set, a constructor still running after that long gets
+ * its stack sampled once, through a signal to the loading thread.
+ */
+#define INIT_SLOW_MS_DEFAULT 100
+#define INIT_WATCH_DEPTH 32
+
+void init_watch_config(uint32_t slow_ms, uint32_t watchdog_ms);
+/* around one constructor call, begin returns the start time */
+uint64_t init_watch_begin(const std::string &name, const char *path);
+void init_watch_end(const std::string &name, const char *path, uint64_t start);
+
+#endif
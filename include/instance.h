@@ -0,0 +1,33 @@
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include <cstdint>
+#include <string>
+
+class Module;
+
+/*
+ * Instances of one object. The template is loaded once with its text and
+ * read-only data in a memfd, calls out of it go through a PLT into the
+ * GOT, which lives in the private part with the writable data. Text is
+ * then the same wherever it is mapped: an instance maps the memfd, takes
+ * a copy of the private part and replays the relocations recorded for
+ * it, with internal addresses moved by the distance to the template.
+ */
+struct Instance {
+    Module *tmpl;
+    char *base;
+    bool constructed;
+};
+
+/* back the shared part of a template being loaded with a memfd */
+uint32_t instance_map_shared(Module &tmpl);
+/* while relocating a template: refuse relocations the shared part cannot
+   take, route calls to PLT entries and record the private ones */
+int instance_check_reloc(Module &tmpl, void *loc, uint32_t type, uint32_t sym_index, uint64_t &val, int64_t addend);
+
+uint32_t instance_create(Module &tmpl, Instance &inst);
+uint32_t instance_destroy(Instance &inst);
+uint64_t instance_sym(Instance &inst, const std::string &name);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __LAZY_H__
+#define __LAZY_H__
+
+#include <cstdint>
+#include <mutex>
+
+class Module;
+class SysEnv;
+
+/*
+ * Lazy binding of calls to undefined functions. A symbol that a module
+ * only ever calls gets a PLT entry jumping through its GOT slot, which
+ * starts out at the lazy header of the PLT: that passes the module to
+ * umko_lazy_entry, which saves the argument registers, binds the symbol
+ * in umko_lazy_resolve, stores the target in the slot and jumps to it.
+ * Later calls go straight through the slot. A symbol that cannot be
+ * bound is fatal at its first call.
+ */
+#define LAZY_PLT_HEADER_SIZE 32
+
+/* symbols are looked up in env, with lock held */
+void lazy_enable(SysEnv &env, std::recursive_mutex &lock, bool on);
+bool lazy_enabled();
+/* symbols bound on a first call so far */
+uint64_t lazy_bind_num();
+
+extern "C" {
+void umko_lazy_entry(void);
+/* target for the GOT slot at slot, an image offset or an address */
+uint64_t umko_lazy_resolve(Module *mod, uint64_t slot);
+}
+
+/* arch part */
+/* the header passing ctx to umko_lazy_entry, LAZY_PLT_HEADER_SIZE bytes */
+void arch_lazy_plt_header(void *header, uint64_t ctx);
+/* an entry jumping through slot, returns the first value of slot, which
+   enters header */
+uint64_t arch_lazy_plt_entry(void *entry, uint64_t slot, uint64_t header, uint64_t base);
+
+#endif
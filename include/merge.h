@@ -0,0 +1,67 @@
+#ifndef __MERGE_H__
+#define __MERGE_H__
+
+#include <cstdint>
+#include <vector>
+
+/* one entry of a SHF_MERGE section, after it was interned in the pool */
+struct MergeEntry {
+    uint64_t offset;    /* offset of the entry in the input section */
+    uint64_t addr;      /* address of the shared copy in the pool */
+};
+
+/*
+ * Global pool of SHF_MERGE/SHF_STRINGS entries shared by all modules.
+ * Identical strings and constants are stored once, whatever module
+ * they come from. Pool memory is read-only except while interning.
+ */
+class MergePool {
+public:
+    static MergePool &GetInstance();
+
+    /* return the address of a pooled copy of data, adding it if needed */
+    uint64_t intern(const void *data, uint64_t size, uint64_t align);
+    /* make every chunk touched since the last seal read-only again */
+    void seal();
+
+    uint64_t get_input_size() const
+    {
+        return input_size;
+    }
+    uint64_t get_pool_size() const
+    {
+        return pool_size;
+    }
+
+private:
+    struct Chunk {
+        char *base;
+        uint64_t size;
+        uint64_t used;
+        bool writable;
+    };
+    struct Slot {
+        uint64_t hash;
+        uint64_t addr;
+        uint64_t size;
+    };
+
+    MergePool() = default;
+    char *alloc(uint64_t size, uint64_t align);
+    void grow();
+
+    std::vector<Chunk> chunks;
+    std::vector<Slot> slots;
+    uint64_t slot_used = 0;
+    uint64_t input_size = 0;
+    uint64_t pool_size = 0;
+};
+
+class Module;
+
+uint64_t merge_hash(const void *data, uint64_t size);
+bool is_mergeable_section(Module &mod, uint32_t sec_idx);
+uint32_t merge_sections(Module &mod);
+uint64_t merge_lookup(Module &mod, uint32_t sec_idx, uint64_t offset);
+
+#endif
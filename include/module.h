@@ -5,60 +5,176 @@
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <elfio/elfio.hpp>
+#include "merge.h"
+#include "handle.h"
 
 struct Layout {
     uint64_t total_size;
     uint64_t text_size;
     uint64_t ro_size;
     uint64_t ro_after_init_size;
+    uint64_t got_offset;
+    uint64_t got_size;
+    uint64_t plt_offset;    /* PLT, in the text */
+    uint64_t plt_size;
+    uint64_t tls_size;
+    uint64_t tls_align;
+    uint64_t tls_tpoff;     /* offset of the TLS block from the thread pointer */
+    uint32_t tls_id;
+    uint64_t shared_size;   /* leading part mapped from a shared file */
     void *base;
 };
 struct SectionLayout {
     uint64_t offset;
+    uint64_t tls_offset;            /* offset in the TLS block for SHF_TLS */
+    bool merged;                    /* SHF_MERGE section moved to the MergePool */
+    std::vector<MergeEntry> merge;  /* entries sorted by input offset */
+};
+
+/* a relocation of the private part of an instance template, applied
+   again for every instance; word is a GOT slot */
+struct RelocReplay {
+    uint64_t offset;        /* in the image */
+    uint64_t val;           /* for the template */
+    uint32_t type;
+    bool internal;          /* val is in the image, moves with it */
+    bool word;
 };
 
 struct FuncAddr {
     uint64_t consruct_func;
+    uint64_t destruct_func;
     uint64_t app_root_func;
 };
-using SymMap = std::unordered_map<std::string, uint64_t>;
 
+class Module;
+struct Heap;
+struct Deferred;
+struct SymTable;
+
+/* a symbol known to SysEnv, owner is null for host symbols */
+struct SymEntry {
+    uint64_t addr;
+    Module *owner;
+};
+using SymMap = std::unordered_map<std::string, SymEntry>;
+
+/* an undefined global of a module, bound by link_symbols */
+struct UndefSym {
+    uint32_t index;
+    std::string name;
+};
+
+/* a global symbol defined by a module */
+struct ExportSym {
+    std::string name;
+    uint64_t addr;
+    uint64_t size;
+    uint8_t type;
+};
+
+/*
+ * Global symbols. The loader writes to its own map, with the loader lock
+ * held, and reads it back while linking. publish() turns the map into an
+ * immutable table which replaces the last one at once, so lookup() takes
+ * no lock, allocates nothing and sees the exports of a module all or not
+ * at all. Only the names changed since the last full table go into a
+ * small one stacked on it, the full one is rebuilt once those outgrow the
+ * square root of its size. A reader bumps a counter of its own thread on
+ * the way in and out, publish() waits for the readers it saw inside
+ * before unmapping what it replaced.
+ */
 class SysEnv {
 public:
-    uint32_t add_symbol(const char *name, uint64_t addr) 
+    uint32_t add_symbol(const char *name, uint64_t addr, Module *owner = nullptr) 
+    {
+        return add_symbol(std::string(name), addr, owner);
+    }
+    /* host symbols wait for the next publish, see host_pending */
+    uint32_t add_symbol(const std::string &name, uint64_t addr, Module *owner = nullptr) 
     {
-        map.emplace(name, addr);
+        if (map.emplace(name, SymEntry{addr, owner}).second) {
+            changed.insert(name);
+        }
+        if (owner == nullptr) {
+            __atomic_store_n(&host_unpublished, true, __ATOMIC_RELEASE);
+        }
         return 0;
     }
-    uint32_t add_symbol(const std::string &name, uint64_t addr) 
+    /* drop name, unless it was taken over by another definition */
+    uint32_t remove_symbol(const std::string &name, uint64_t addr)
     {
-        map.emplace(name, addr);
+        auto iter = map.find(name);
+        if (iter == map.end() || iter->second.addr != addr) {
+            return -1;
+        }
+        map.erase(iter);
+        changed.insert(name);
         return 0;
     }
-    uint32_t get_symbol(const std::string &name, uint64_t &addr) const
+    /* bind name to another definition, for hot-patching */
+    void replace_symbol(const std::string &name, uint64_t addr, Module *owner)
+    {
+        map[name] = SymEntry{addr, owner};
+        changed.insert(name);
+    }
+    /* where relocated read-only parts are shared, empty to keep them private */
+    void set_share_dir(const std::string &dir)
+    {
+        share_dir = dir;
+    }
+    const std::string &get_share_dir() const
+    {
+        return share_dir;
+    }
+    uint64_t get_symbol_num() const
+    {
+        return map.size();
+    }
+    /* make the writes so far visible to lookup, waits out the readers of
+       the table it replaces */
+    void publish();
+    /* host symbols were added since the last publish, which registrations
+       leave to the next load or lookup so that they are published once */
+    bool host_pending() const
+    {
+        return __atomic_load_n(&host_unpublished, __ATOMIC_ACQUIRE);
+    }
+    /* the published symbols, takes no lock and writes only to a line of
+       the calling thread */
+    uint32_t lookup(const char *name, uint64_t &addr) const;
+    /* as written so far, with the loader lock held */
+    uint32_t get_symbol(const std::string &name, uint64_t &addr, Module **owner = nullptr) const
     {
         auto iter = map.find(name);
         if (iter != map.end()) {
-            addr = iter->second;
+            addr = iter->second.addr;
+            if (owner) {
+                *owner = iter->second.owner;
+            }
             return 0;
         }
         return -1;
     }
+    /* published, like lookup */
     uint64_t get_entry() const
     {
-        auto iter = map.find("_start");
-        if (iter != map.end()) {
-            return iter->second;
-        }
-        iter = map.find("APP_Root");
-        if (iter != map.end()) {
-            return iter->second;
+        uint64_t addr;
+        if (lookup("_start", addr) == 0 || lookup("APP_Root", addr) == 0) {
+            return addr;
         }
         return 0;
     }
 private:
     SymMap map;
+    std::string share_dir;
+    /* names added, removed or rebound since base was built */
+    std::unordered_set<std::string> changed;
+    SymTable *base = nullptr;
+    SymTable *table = nullptr;  /* base, or the changes stacked on it */
+    bool host_unpublished = false;
 };
 
 class Module {
@@ -77,21 +193,128 @@ public:
     }
     const char *get_obj_path()
     {
-        return path;
+        return path.c_str();
     }
     void set_obj_path(const char * path_str)
     {
         path = path_str;
     }
+    /* load from memory instead of the file at path, buf must stay valid
+       until load_module returns */
+    void set_obj_buffer(const void *buf, uint64_t size)
+    {
+        obj_buf = buf;
+        obj_size = size;
+    }
+    const void *get_obj_buffer()
+    {
+        return obj_buf;
+    }
+    uint64_t get_obj_size()
+    {
+        return obj_size;
+    }
     FuncAddr &get_func_addr()
     {
         return func;
     }
+    /* GOT slot offset by (symbol index, reloc class) key */
+    std::unordered_map<uint64_t, uint64_t> &get_got()
+    {
+        return got;
+    }
+    /* PLT entry offset by symbol index, instance templates only */
+    std::unordered_map<uint32_t, uint64_t> &get_plt()
+    {
+        return plt;
+    }
     uint32_t sym_sec_index = 0;
+    /* modules importing from this one and instances of it, it cannot be
+       unloaded before them */
+    uint32_t refcnt = 0;
+    /* loaded together by load_modules, 0 for none; imports between the
+       members do not count in refcnt, they are unloaded together */
+    uint32_t group = 0;
+    /* the version this one hot-patches, its exported data of the same
+       size is bound instead of ours, see patch.h */
+    Module *replaces = nullptr;
+    /* an instance template: text and read-only data are in memfd, shared
+       by the instances, exports are not global and nothing is run */
+    bool instanced = false;
+    int memfd = -1;
+    /* the shared file the read-only part is mapped from, see share.h */
+    int share_fd = -1;
+    /* share_key of the module once linked, see share_attach */
+    uint64_t share_hash = 0;
+    /* the private part as copied in, before any relocation */
+    std::vector<char> &get_pristine()
+    {
+        return pristine;
+    }
+    std::vector<RelocReplay> &get_replay()
+    {
+        return replay;
+    }
+    /* STT_GNU_IFUNC symbols defined here, by index, their resolvers run
+       once everything else is relocated; also those imported from the
+       group, undefined, bound once the group's resolvers ran */
+    std::vector<uint32_t> &get_ifuncs()
+    {
+        return ifuncs;
+    }
+    /* allocator of the module code, see heap.h */
+    Heap *heap = nullptr;
+    /* exports are stubs until the first call loads it, see defer.h */
+    Deferred *defer = nullptr;
+    /* init_array and Construct have run */
+    bool constructed = false;
+
+    /* calls to undefined functions go through the PLT, bound on their
+       first call, see lazy.h */
+    bool lazy = false;
+    /* image offset of a GOT slot still to bind -> symbol index, ~0U once
+       bound */
+    std::unordered_map<uint64_t, uint32_t> &get_lazy_slots()
+    {
+        return lazy_slots;
+    }
+    /* undefined globals waiting for the link pass */
+    std::vector<UndefSym> &get_undefs()
+    {
+        return undefs;
+    }
 
-    void set_elf_addr(void *base_addr)
+    /* modules this one imports from, pinned while it is loaded */
+    std::vector<Module *> &get_deps()
+    {
+        return deps;
+    }
+
+    /* exports sorted by name, filled by layout_symbol_addr */
+    std::vector<ExportSym> &get_exports()
+    {
+        return exports;
+    }
+    const ExportSym *find_export(const std::string &name) const;
+    /* resolve names in one pass over the exports, missing ones get 0,
+       return the number of names found */
+    uint32_t find_batch(const std::vector<std::string> &names, std::vector<uint64_t> &addrs) const;
+
+    template <typename Sig>
+    FuncHandle<Sig> find(const std::string &name) const
+    {
+        const ExportSym *sym = find_export(name);
+        return sym ? FuncHandle<Sig>(sym->addr) : FuncHandle<Sig>();
+    }
+
+    void set_elf_addr(void *base_addr, uint64_t size)
     {
         elf_addr = base_addr;
+        elf_size = size;
+    }
+    uint64_t get_elf_size()
+    {
+        return elf_size;
     }
     void *get_elf_addr()
     {
@@ -102,10 +325,45 @@ private:
     ELFIO::elfio elf;
     std::vector<SectionLayout> sec_layout;
     FuncAddr func = {0};
-    const char *path = nullptr;
+    std::unordered_map<uint64_t, uint64_t> got;
+    std::unordered_map<uint32_t, uint64_t> plt;
+    std::vector<char> pristine;
+    std::vector<RelocReplay> replay;
+    std::vector<uint32_t> ifuncs;
+    std::vector<ExportSym> exports;
+    std::vector<UndefSym> undefs;
+    std::unordered_map<uint64_t, uint32_t> lazy_slots;
+    std::vector<Module *> deps;
+    std::string path;
+    const void *obj_buf = nullptr;
+    uint64_t obj_size = 0;
     void *elf_addr = nullptr;
+    uint64_t elf_size = 0;
 };
 
 uint32_t load_module(Module &mod, SysEnv &env);
+uint32_t unload_module(Module &mod, SysEnv &env);
+/* address of an import of a module, from env or the compiler runtime;
+   host functions go through a counting stub when enabled */
+uint32_t module_find_import(SysEnv &env, const std::string &name, uint64_t &addr, Module **owner);
+/* mod imports from owner, pin owner unless they are loaded together */
+void module_add_dep(Module &mod, Module *owner);
+/* load mods as one group: all exports go into env before any import is
+   bound, so they may import from each other in any order, cycles
+   included; constructors run in the order of mods */
+uint32_t load_modules(std::vector<Module *> &mods, SysEnv &env);
+/* a group id no module has yet */
+uint32_t module_new_group();
+/* unload a group, all its destructors run before anything is unmapped */
+uint32_t unload_modules(std::vector<Module *> &mods, SysEnv &env);
+/* delta moves the template addresses to an instance */
+uint32_t mod_init_and_construct(Module &mod, int64_t delta = 0);
+uint32_t mod_fini_and_destruct(Module &mod, int64_t delta = 0);
+void cxa_add_module(void *dso);
+void cxa_finalize_module(void *dso);
+void cxa_remove_module(void *dso);
+void *module_area_hint(uint64_t size);
+void module_area_range(uint64_t &start, uint64_t &end);
+void module_area_claim(uint64_t addr, uint64_t size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,32 @@
+#ifndef __PATCH_H__
+#define __PATCH_H__
+
+#include <cstdint>
+
+class Module;
+class SysEnv;
+
+/*
+ * Hot-patching: a new version of a module is loaded next to the running
+ * one, then the functions exported by the old version are redirected to
+ * the new ones by patching a jump over their first instruction.
+ *
+ * Exported data of the same size stays where it is: the new version is
+ * loaded with its own definitions bound to those of the old one, so the
+ * importers of the old version and the new code share the state. The
+ * constructors of the new version do not run, the state is the one the
+ * old version constructed. Data that changed size is handed to the
+ * "Migrate" hook of the new version, importers keep the old copy:
+ *   void Migrate(const char *name, void *old_addr, void *new_addr, uint64_t old_size);
+ * Both versions are one group from then on, unloaded together, and the
+ * destructors of the old version run.
+ */
+typedef void (*MigrateFunc)(const char *name, void *old_addr, void *new_addr, uint64_t old_size);
+
+uint32_t patch_module(Module &old_mod, Module &new_mod, SysEnv &env);
+
+/* write a jump to to over the function at from, which is size bytes long
+   and must already be writable; implemented per arch */
+int arch_patch_jump(void *from, uint64_t size, void *to);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __PERFMAP_H__
+#define __PERFMAP_H__
+
+#include <cstdint>
+
+class Module;
+
+/*
+ * Symbols of module code for perf, which only sees anonymous mappings:
+ * /tmp/perf-<pid>.map lists the live functions and is rewritten when
+ * code goes away, jit-<pid>.dump gets a code load record with the code
+ * bytes for every function, for `perf inject --jit`.
+ */
+#define PERF_FLAG_MAP     0x1
+#define PERF_FLAG_JITDUMP 0x2
+
+uint32_t perf_enable(uint32_t flags);
+void perf_module_load(Module &mod);
+void perf_module_unload(Module &mod);
+/* the function at addr of mod now jumps elsewhere */
+void perf_code_patched(Module &mod, uint64_t addr);
+
+#endif
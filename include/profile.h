@@ -0,0 +1,21 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <cstdint>
+
+/*
+ * Sampling profiler: SIGPROF from ITIMER_PROF records the PC and the
+ * frame pointer chain of the running thread into a buffer owned by that
+ * thread. Samples are symbolized through the address index when the
+ * profile is written: <prefix>.txt has the flat profile, <prefix>.folded
+ * the stacks in the folded format of flamegraph.pl.
+ */
+#define PROFILE_HZ_DEFAULT 997
+#define PROFILE_MAX_THREADS 64
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_BUF_SAMPLES 8192
+
+uint32_t profile_start(const char *prefix, uint32_t hz);
+uint32_t profile_stop();
+
+#endif
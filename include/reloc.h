@@ -1,9 +1,47 @@
-
 #ifndef __RELOC_H__
 #define __RELOC_H__
 
 #include <stdint.h>
+#include <string>
+
+/* how the value handed to do_relocate_add is computed for a reloc type */
+enum RelocClass {
+    RELOC_CLASS_PLAIN = 0,      /* S + A, also TP offsets of local-exec */
+    RELOC_CLASS_DTPOFF,         /* offset inside the module TLS block */
+    RELOC_CLASS_IRELATIVE,      /* what the resolver at S + A returns */
+    RELOC_CLASS_GOT,            /* GOT slot with the symbol address */
+    RELOC_CLASS_GOT_TPOFF,      /* GOT slot with the TP offset (initial-exec) */
+    RELOC_CLASS_GOT_TLSGD,      /* GOT tls_index pair (general-dynamic) */
+    RELOC_CLASS_GOT_TLSLD,      /* GOT tls_index pair of the block (local-dynamic) */
+    RELOC_CLASS_GOT_TLSDESC,    /* GOT TLS descriptor */
+    RELOC_CLASS_NUM
+};
+
+/* how the relocated field depends on where the image is, for instances */
+enum RelocAddrKind {
+    RELOC_ADDR_NONE = 0,        /* not at all, or by the offset in a page */
+    RELOC_ADDR_ABS,             /* moves with the symbol */
+    RELOC_ADDR_PCREL,           /* moves with the distance to the symbol */
+};
+
+#define PLT_ENTRY_SIZE 16
 
 int do_relocate_add(uint32_t reloc_type, void *loc, uint64_t val);
+int reloc_class(uint32_t reloc_type);
+int reloc_addr_kind(uint32_t reloc_type);
+/* branches that may go through a PLT entry */
+bool reloc_is_call(uint32_t reloc_type);
+/* a call at loc can branch to val directly */
+bool reloc_call_reaches(uint64_t loc, uint64_t val);
+/* an entry jumping through the GOT slot at slot */
+void arch_plt_entry(void *entry, uint64_t slot);
+/* an entry loading ctx into argument register arg, then jumping to
+   target, HEAP_STUB_SIZE bytes */
+void arch_ctx_stub(void *stub, uint32_t arg, uint64_t ctx, uint64_t target);
+/* call an ifunc resolver the way the dynamic linker would */
+uint64_t arch_ifunc_resolve(uint64_t resolver);
+/* the CPU model of the compiler runtime, which target_clones resolvers
+   read, -1 for other names */
+int arch_cpu_symbol(const std::string &name, uint64_t &addr);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,33 @@
+#ifndef __SHARE_H__
+#define __SHARE_H__
+
+#include <cstdint>
+#include <string>
+
+class Module;
+
+/*
+ * The read-only part of a module image, [0, ro_after_init_size), is the
+ * same in every process loading the same object at the same address
+ * against the same symbol values. It is kept in a file named after a
+ * hash of all of these, and mapped MAP_SHARED by every process, so the
+ * pages are in memory once. A process finding the file skips copying
+ * and relocating that part. The files are in umko-<euid> of the shared
+ * directory (/dev/shm by default), which must be owned by the user and
+ * closed to others, as must the files; they go away with the last
+ * process mapping them.
+ */
+#define UMKO_SHARE_DIR_DEFAULT "/dev/shm"
+
+uint64_t share_key(Module &mod);
+/* map the shared part from an existing file, -1 when there is none; the
+   key is taken here, share_publish uses the same */
+uint32_t share_attach(Module &mod, const std::string &dir);
+/* write the relocated shared part for the next processes and map it */
+uint32_t share_publish(Module &mod, const std::string &dir);
+/* replace the shared pages by a private copy, before patching them */
+uint32_t share_detach(Module &mod);
+/* done with the file, removed when no other process maps it */
+void share_release(Module &mod);
+
+#endif
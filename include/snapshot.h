@@ -0,0 +1,30 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <cstdint>
+#include <list>
+
+class Module;
+class SysEnv;
+
+/*
+ * A snapshot is the module area of a process after loading and
+ * construction, written as one file: a header page with the region,
+ * TLS and export tables, then the page aligned contents of each region.
+ * Restoring maps the regions back at the same addresses, so it is only
+ * valid for the same host binary, loaded at the same address.
+ *
+ * Not captured: host heap memory allocated by constructors and the
+ * destructors they registered with __cxa_atexit.
+ */
+#define UMKO_SNAPSHOT_MAGIC "UMKOSNAP"
+#define UMKO_SNAPSHOT_VERSION 1
+#define UMKO_BUILD_ID_MAX 32
+
+uint32_t snapshot_save(const char *path, std::list<Module> &mods, SysEnv &env);
+uint32_t snapshot_restore(const char *path, SysEnv &env);
+
+/* GNU build id of the host executable, returns its size, 0 if none */
+uint32_t host_build_id(uint8_t *buf, uint32_t size);
+
+#endif
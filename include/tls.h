@@ -0,0 +1,52 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <cstdint>
+#include <vector>
+
+class Module;
+
+/* size of the static TLS area reserved in the host for module blocks */
+#ifndef UMKO_TLS_RESERVE
+#define UMKO_TLS_RESERVE (16 * 1024)
+#endif
+#define UMKO_TLS_MAX_MODULES 256
+
+/* argument of __tls_get_addr, same layout as the one of glibc */
+struct TlsIndex {
+    uint64_t module;
+    uint64_t offset;
+};
+
+struct TlsInit {
+    uint64_t offset;        /* offset in the block */
+    const void *image;      /* .tdata copy in the module image */
+    uint64_t size;
+};
+
+/* a live block, as saved in a snapshot */
+struct TlsBlock {
+    uint32_t id;
+    uint64_t tpoff;
+    uint64_t size;
+    std::vector<TlsInit> init;
+};
+
+uint32_t tls_register_module(Module &mod);
+void tls_unregister_module(Module &mod);
+uint32_t tls_find_module(uint64_t tpoff);
+uint64_t tls_block_tpoff(uint32_t tls_id);
+/* TP offset of the reserve, the same in every thread of a host build */
+uint64_t tls_reserve_tpoff();
+void tls_get_blocks(std::vector<TlsBlock> &blocks);
+uint32_t tls_restore_block(const TlsBlock &block);
+
+extern "C" {
+void *umko_tls_get_addr(TlsIndex *ti);
+void umko_tls_thread_init(void);
+/* static TLS descriptor resolver, returns the TP offset kept in the
+   descriptor, implemented per arch */
+void umko_tlsdesc_return(void);
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Timeline of module loads in the Chrome Trace Event Format, for
+ * Perfetto or chrome://tracing: a span per load, per load_module phase,
+ * per .init_array entry and per Construct call, on the thread that ran
+ * it. Spans are kept in memory and the file is written at exit.
+ */
+uint32_t trace_enable(const char *path);
+/* write the file now and stop recording */
+uint32_t trace_flush();
+bool trace_enabled();
+uint64_t trace_now();
+void trace_span(const std::string &name, const char *cat, uint64_t start, uint64_t end);
+
+/* a span from construction to destruction */
+class TraceScope {
+public:
+    TraceScope(const std::string &name, const char *cat)
+        : on(trace_enabled()), cat(cat)
+    {
+        if (on) {
+            this->name = name;
+            start = trace_now();
+        }
+    }
+    ~TraceScope()
+    {
+        if (on) {
+            trace_span(name, cat, start, trace_now());
+        }
+    }
+
+private:
+    bool on;
+    const char *cat;
+    std::string name;
+    uint64_t start = 0;
+};
+
+/* back to back spans for the phases of one load */
+class TracePhases {
+public:
+    TracePhases() : on(trace_enabled()) {}
+    ~TracePhases()
+    {
+        next(nullptr);
+    }
+    void next(const char *phase)
+    {
+        if (!on) {
+            return;
+        }
+        uint64_t now = trace_now();
+        if (name) {
+            trace_span(name, "phase", start, now);
+        }
+        name = phase;
+        start = now;
+    }
+
+private:
+    bool on;
+    const char *name = nullptr;
+    uint64_t start = 0;
+};
+
+#endif
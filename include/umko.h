@@ -0,0 +1,148 @@
+#ifndef __UMKO_H__
+#define __UMKO_H__
+
+/*
+ * Embedding API of libumko. All calls are thread safe, loads, lookups
+ * and unloads are serialized on one loader lock, except the lookups of
+ * global symbols: umko_sym(NULL, ...) and umko_entry() take no lock and
+ * run alongside a load, which they see only once it is constructed.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct umko_module umko_module;
+typedef struct umko_instance umko_instance;
+
+typedef struct umko_stats_s {
+    uint64_t module_num;        /* modules loaded now */
+    uint64_t instance_num;      /* instances of templates alive now */
+    uint64_t load_num;          /* successful loads since start */
+    uint64_t unload_num;
+    uint64_t upgrade_num;       /* hot-patches applied */
+    uint64_t image_bytes;       /* module images mapped now */
+    uint64_t shared_bytes;      /* of which mapped from shared files */
+    uint64_t symbol_num;        /* global symbols, host and modules */
+    uint64_t merge_input_bytes; /* SHF_MERGE input seen by the pool */
+    uint64_t merge_pool_bytes;  /* what the pool keeps of it */
+    uint64_t heap_bytes;        /* in use in the heaps of modules */
+    uint64_t lazy_bind_num;     /* imports bound on their first call */
+    uint64_t deferred_num;      /* deferred modules not called yet */
+} umko_stats_t;
+
+typedef struct umko_heap_stats_s {
+    uint64_t used;              /* handed out, frees of other threads count once taken back */
+    uint64_t mapped;            /* bytes of the spans holding them */
+    uint64_t arenas;            /* one per thread that allocated */
+    uint64_t fallback_num;      /* allocations passed to malloc */
+} umko_heap_stats_t;
+
+/* load, relocate and construct a relocatable object, NULL on failure */
+umko_module *umko_load(const char *path);
+/* load the objects at paths together: they may import from each other
+   in any order, cycles included, and are constructed in the order given;
+   fills mods when not NULL, returns -1 and loads none on failure.
+   Unloading one of them unloads all */
+int umko_load_group(const char *const *paths, size_t num, umko_module **mods);
+/* read only the exported functions of path and bind stubs for them; the
+   first call of one loads and constructs the module, see defer.h. An
+   object exporting data is loaded now */
+umko_module *umko_defer(const char *path);
+/* umko_defer for each of paths, the objects exporting data are then
+   loaded together as by umko_load_group; the stubs are bound before, so
+   the order of paths does not matter. -1 and none kept on failure */
+int umko_defer_group(const char *const *paths, size_t num, umko_module **mods);
+/* same from memory, name is used in logs only, buf may be freed after */
+umko_module *umko_load_buffer(const void *buf, size_t size, const char *name);
+/* address of a global symbol of mod, or of any module or host export
+   when mod is NULL, wait-free then */
+void *umko_sym(umko_module *mod, const char *name);
+/* resolve num names of mod in one pass, return how many were found */
+size_t umko_sym_batch(umko_module *mod, const char *const *names, size_t num, void **addrs);
+/* load path as a template for instances: relocated, its text and
+   read-only data kept in memory shared by the instances, but nothing is
+   exported or constructed; the object must be built with -fPIC */
+umko_module *umko_load_template(const char *path);
+/* a new copy of the data of tmpl next to the shared text, relocated and
+   constructed, NULL on failure */
+umko_instance *umko_instance_create(umko_module *tmpl);
+/* address of a global symbol of tmpl in inst */
+void *umko_instance_sym(umko_instance *inst, const char *name);
+/* run the destructors of inst and unmap it, tmpl is unloaded only once
+   it has no instances left */
+int umko_instance_destroy(umko_instance *inst);
+/* entry of the loaded modules, _start or APP_Root */
+void *umko_entry(void);
+/* run the destructors of mod and unmap it, -1 while other modules
+   still import from it */
+int umko_unload(umko_module *mod);
+/* load a new version of mod from path and redirect the functions of mod
+   to it, exported data is kept or goes through its Migrate hook; mod
+   stays loaded for its importers, unloading either unloads both, the new
+   module is returned */
+umko_module *umko_upgrade(umko_module *mod, const char *path);
+/* share the relocated read-only part of modules loaded from now on with
+   other processes, through files in dir (e.g. /dev/shm); NULL stops it */
+int umko_share(const char *dir);
+/* write num variants of an object, "<features>=<object>" or "<object>"
+   for the baseline, to a bundle at path; loading the bundle loads the
+   variant this CPU runs best, see bundle.h */
+int umko_bundle(const char *path, const char *const *variants, size_t num);
+/* write the loaded and constructed modules to path, see snapshot.h */
+int umko_snapshot(const char *path);
+/* map a snapshot back in place of loading, before any other load; the
+   restored modules are reached through umko_sym(NULL, ...) and
+   umko_entry() only */
+int umko_restore(const char *path);
+#define UMKO_PERF_MAP     0x1   /* /tmp/perf-<pid>.map */
+#define UMKO_PERF_JITDUMP 0x2   /* jit-<pid>.dump for perf inject --jit */
+/* describe the code of modules loaded from now on to perf */
+int umko_perf(unsigned flags);
+/* sample the process at hz (0 for the default) until umko_profile_stop,
+   which writes <prefix>.txt (flat) and <prefix>.folded (flamegraph) */
+int umko_profile_start(const char *prefix, unsigned hz);
+int umko_profile_stop(void);
+/* count the host function calls of modules loaded from now on, and time
+   one call in 2^sample_shift per CPU unless sample_shift is negative;
+   the counts are printed to stderr at exit */
+int umko_count_imports(int sample_shift);
+/* record loads, their phases and constructors in the Chrome trace format,
+   written to path at exit or on umko_trace(NULL) */
+int umko_trace(const char *path);
+/* warn about constructors taking slow_ms or longer (100 by default), and
+   log a stack sample of one still running after watchdog_ms (0: off) */
+int umko_init_timing(unsigned slow_ms, unsigned watchdog_ms);
+/* on a fault print the module function and the frames to stderr, then
+   let the signal take its previous course */
+int umko_crash_report(void);
+/* bind calls to undefined functions on their first call in the modules
+   loaded from now on, instead of at load, see lazy.h; address-taken
+   functions and data are still bound at load */
+int umko_lazy_bind(int on);
+int umko_stats(umko_stats_t *stats);
+/* memory of the heap of mod, see umko_heap.h; -1 when it has none */
+int umko_heap_stats(umko_module *mod, umko_heap_stats_t *stats);
+/* export a host symbol to modules loaded afterwards */
+int umko_register(const char *name, void *addr);
+
+#ifdef __cplusplus
+}
+
+#include "handle.h"
+
+namespace umko {
+
+template <typename Sig>
+inline FuncHandle<Sig> sym(umko_module *mod, const char *name)
+{
+    return FuncHandle<Sig>((uint64_t)umko_sym(mod, name));
+}
+
+}
+#endif
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __UMKO_HEAP_H__
+#define __UMKO_HEAP_H__
+
+/*
+ * Allocator of module code, resolved by the loader. Each module gets its
+ * own heap with an arena per thread, memory is carved from spans of a
+ * reserved range in size classes, and all of it is released when the
+ * module is unloaded. Sizes above the classes take whole spans, and what
+ * the heap cannot serve comes from the host malloc.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UMKO_HEAP_CLASSES 36    /* 16 bytes to 16 KiB */
+
+void *umko_alloc(size_t size);
+/* any thread may free, also memory of the host malloc */
+void umko_free(void *ptr);
+/* class of size, UMKO_HEAP_CLASSES when it is above all of them */
+unsigned umko_size_class(size_t size);
+/* an object of class cls, skips the size lookup of umko_alloc */
+void *umko_alloc_class(unsigned cls);
+/* release everything the calling thread has allocated from the heap of
+   the module, none of it may still be in use */
+void umko_arena_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,528 @@
+#include "umko.h"
+#include <list>
+#include <mutex>
+#include "module.h"
+#include "patch.h"
+#include "snapshot.h"
+#include "perfmap.h"
+#include "profile.h"
+#include "imports.h"
+#include "crash.h"
+#include "trace.h"
+#include "initwatch.h"
+#include "instance.h"
+#include "bundle.h"
+#include "heap.h"
+#include "lazy.h"
+#include "defer.h"
+#include "logger.h"
+
+struct Env {
+    SysEnv sys_env;
+    std::list<Module> mods;
+    std::list<Instance> instances;
+    /* recursive, constructors of a module may call back into the API */
+    std::recursive_mutex lock;
+    uint64_t load_num;
+    uint64_t unload_num;
+    uint64_t upgrade_num;
+};
+
+Env &GetEnv()
+{
+    static Env env;
+    return env;
+}
+
+void RegisterFunc(const char *funcname, void *func)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    env.sys_env.add_symbol(funcname, (uint64_t)func);
+}
+
+/* Global lookups read the published table without the lock. Only a miss
+   while host registrations are unpublished takes it, to publish them in
+   one go. */
+static uint64_t lookup_global(Env &env, const char *name)
+{
+    uint64_t addr = 0;
+    if (env.sys_env.lookup(name, addr) == 0 || !env.sys_env.host_pending()) {
+        return addr;
+    }
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    if (env.sys_env.host_pending()) {
+        env.sys_env.publish();
+    }
+    env.sys_env.lookup(name, addr);
+    return addr;
+}
+
+static Module *find_module(Env &env, umko_module *handle)
+{
+    for (auto &mod : env.mods) {
+        if ((umko_module *)&mod == handle) {
+            return &mod;
+        }
+    }
+    return nullptr;
+}
+
+static umko_module *load(const char *path, const void *buf, size_t size, bool instanced = false,
+    Module *replaces = nullptr)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    env.mods.emplace_back();
+    auto &mod = env.mods.back();
+    mod.set_obj_path(path ? path : "<buffer>");
+    if (buf) {
+        mod.set_obj_buffer(buf, size);
+    }
+    mod.instanced = instanced;
+    if (replaces) {
+        /* the versions pin each other, they go together, see patch.h */
+        if (replaces->group == 0) {
+            replaces->group = module_new_group();
+        }
+        mod.group = replaces->group;
+        mod.replaces = replaces;
+    }
+    if (load_module(mod, env.sys_env) != 0) {
+        log_error("umko_load: cannot load %s\n", mod.get_obj_path());
+        env.mods.pop_back();
+        return nullptr;
+    }
+    env.load_num++;
+    return (umko_module *)&mod;
+}
+
+umko_module *umko_load(const char *path)
+{
+    if (path == nullptr) {
+        return nullptr;
+    }
+    return load(path, nullptr, 0);
+}
+
+int umko_load_group(const char *const *paths, size_t num, umko_module **handles)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    if (paths == nullptr || num == 0) {
+        return -1;
+    }
+    std::vector<Module *> group;
+    for (size_t i = 0; i < num; i++) {
+        env.mods.emplace_back();
+        env.mods.back().set_obj_path(paths[i]);
+        group.push_back(&env.mods.back());
+    }
+    if (load_modules(group, env.sys_env) != 0) {
+        log_error("umko_load_group: cannot load the %zu objects\n", num);
+        for (size_t i = 0; i < num; i++) {
+            env.mods.pop_back();
+        }
+        return -1;
+    }
+    env.load_num += num;
+    for (size_t i = 0; handles && i < num; i++) {
+        handles[i] = (umko_module *)group[i];
+    }
+    return 0;
+}
+
+umko_module *umko_defer(const char *path)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    if (path == nullptr) {
+        return nullptr;
+    }
+    env.mods.emplace_back();
+    auto &mod = env.mods.back();
+    mod.set_obj_path(path);
+    if (defer_module(mod, env.sys_env, env.lock) != 0) {
+        env.mods.pop_back();
+        return load(path, nullptr, 0);
+    }
+    env.load_num++;
+    return (umko_module *)&mod;
+}
+
+int umko_defer_group(const char *const *paths, size_t num, umko_module **handles)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    if (paths == nullptr || num == 0) {
+        return -1;
+    }
+    /* the stubs go into env first, the objects loaded now may bind them
+       whatever the order of the paths */
+    std::vector<umko_module *> mods(num, nullptr);
+    std::vector<const char *> rest;
+    std::vector<size_t> rest_idx;
+    for (size_t i = 0; i < num; i++) {
+        env.mods.emplace_back();
+        auto &mod = env.mods.back();
+        mod.set_obj_path(paths[i]);
+        if (defer_module(mod, env.sys_env, env.lock) != 0) {
+            env.mods.pop_back();
+            rest.push_back(paths[i]);
+            rest_idx.push_back(i);
+            continue;
+        }
+        env.load_num++;
+        mods[i] = (umko_module *)&mod;
+    }
+    std::vector<umko_module *> loaded(rest.size(), nullptr);
+    if (!rest.empty() && umko_load_group(rest.data(), rest.size(), loaded.data()) != 0) {
+        for (auto mod : mods) {
+            if (mod) {
+                umko_unload(mod);
+            }
+        }
+        return -1;
+    }
+    for (size_t i = 0; i < rest.size(); i++) {
+        mods[rest_idx[i]] = loaded[i];
+    }
+    for (size_t i = 0; handles && i < num; i++) {
+        handles[i] = mods[i];
+    }
+    return 0;
+}
+
+umko_module *umko_load_buffer(const void *buf, size_t size, const char *name)
+{
+    if (buf == nullptr || size == 0) {
+        return nullptr;
+    }
+    return load(name, buf, size);
+}
+
+umko_module *umko_load_template(const char *path)
+{
+    if (path == nullptr) {
+        return nullptr;
+    }
+    return load(path, nullptr, 0, true);
+}
+
+umko_instance *umko_instance_create(umko_module *handle)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    Module *mod = find_module(env, handle);
+    if (mod == nullptr || !mod->instanced) {
+        return nullptr;
+    }
+    env.instances.emplace_back();
+    if (instance_create(*mod, env.instances.back()) != 0) {
+        env.instances.pop_back();
+        return nullptr;
+    }
+    return (umko_instance *)&env.instances.back();
+}
+
+static Instance *find_instance(Env &env, umko_instance *handle)
+{
+    for (auto &inst : env.instances) {
+        if ((umko_instance *)&inst == handle) {
+            return &inst;
+        }
+    }
+    return nullptr;
+}
+
+void *umko_instance_sym(umko_instance *handle, const char *name)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    Instance *inst = find_instance(env, handle);
+    return inst ? (void *)instance_sym(*inst, name) : nullptr;
+}
+
+int umko_instance_destroy(umko_instance *handle)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    for (auto iter = env.instances.begin(); iter != env.instances.end(); ++iter) {
+        if ((umko_instance *)&*iter != handle) {
+            continue;
+        }
+        instance_destroy(*iter);
+        env.instances.erase(iter);
+        return 0;
+    }
+    return -1;
+}
+
+void *umko_sym(umko_module *handle, const char *name)
+{
+    auto &env = GetEnv();
+    if (handle == nullptr) {
+        return (void *)lookup_global(env, name);
+    }
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    Module *mod = find_module(env, handle);
+    const ExportSym *sym = mod ? mod->find_export(name) : nullptr;
+    return sym ? (void *)sym->addr : nullptr;
+}
+
+size_t umko_sym_batch(umko_module *handle, const char *const *names, size_t num, void **addrs)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    Module *mod = find_module(env, handle);
+    if (mod == nullptr) {
+        return 0;
+    }
+    std::vector<std::string> list(names, names + num);
+    std::vector<uint64_t> found;
+    size_t ret = mod->find_batch(list, found);
+    for (size_t i = 0; i < num; i++) {
+        addrs[i] = (void *)found[i];
+    }
+    return ret;
+}
+
+void *umko_entry(void)
+{
+    auto &env = GetEnv();
+    uint64_t addr = env.sys_env.get_entry();
+    if (addr == 0 && env.sys_env.host_pending()) {
+        std::lock_guard<std::recursive_mutex> guard(env.lock);
+        env.sys_env.publish();
+        addr = env.sys_env.get_entry();
+    }
+    return (void *)addr;
+}
+
+static int unload_group(Env &env, uint32_t group)
+{
+    std::vector<Module *> mods;
+    for (auto &mod : env.mods) {
+        if (mod.group == group) {
+            mods.push_back(&mod);
+        }
+    }
+    if (unload_modules(mods, env.sys_env) != 0) {
+        return -1;
+    }
+    env.mods.remove_if([group](const Module &mod) { return mod.group == group; });
+    env.unload_num += mods.size();
+    return 0;
+}
+
+int umko_unload(umko_module *handle)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    Module *mod = find_module(env, handle);
+    if (mod && mod->group) {
+        return unload_group(env, mod->group);
+    }
+    for (auto iter = env.mods.begin(); iter != env.mods.end(); ++iter) {
+        if ((umko_module *)&*iter != handle) {
+            continue;
+        }
+        if (unload_module(*iter, env.sys_env) != 0) {
+            return -1;
+        }
+        env.mods.erase(iter);
+        env.unload_num++;
+        return 0;
+    }
+    return -1;
+}
+
+umko_module *umko_upgrade(umko_module *handle, const char *path)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    Module *old_mod = find_module(env, handle);
+    if (old_mod == nullptr || path == nullptr) {
+        return nullptr;
+    }
+    umko_module *new_handle = load(path, nullptr, 0, false, old_mod);
+    if (new_handle == nullptr) {
+        return nullptr;
+    }
+    Module *new_mod = (Module *)new_handle;
+    if (patch_module(*old_mod, *new_mod, env.sys_env) != 0) {
+        /* left out of the group when nothing was patched */
+        if (new_mod->group == 0) {
+            umko_unload(new_handle);
+        }
+        return nullptr;
+    }
+    env.upgrade_num++;
+    return new_handle;
+}
+
+int umko_snapshot(const char *path)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    if (path == nullptr) {
+        return -1;
+    }
+    return snapshot_save(path, env.mods, env.sys_env) == 0 ? 0 : -1;
+}
+
+int umko_bundle(const char *path, const char *const *variants, size_t num)
+{
+    if (path == nullptr || variants == nullptr || num == 0) {
+        return -1;
+    }
+    std::vector<std::string> list(variants, variants + num);
+    return bundle_write(path, list) == 0 ? 0 : -1;
+}
+
+int umko_restore(const char *path)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    if (path == nullptr) {
+        return -1;
+    }
+    return snapshot_restore(path, env.sys_env) == 0 ? 0 : -1;
+}
+
+int umko_share(const char *dir)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    env.sys_env.set_share_dir(dir ? dir : "");
+    return 0;
+}
+
+int umko_perf(unsigned flags)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    return perf_enable(flags) == 0 ? 0 : -1;
+}
+
+int umko_count_imports(int sample_shift)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    return import_enable(sample_shift) == 0 ? 0 : -1;
+}
+
+int umko_profile_start(const char *prefix, unsigned hz)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    if (prefix == nullptr) {
+        return -1;
+    }
+    return profile_start(prefix, hz) == 0 ? 0 : -1;
+}
+
+int umko_profile_stop(void)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    return profile_stop() == 0 ? 0 : -1;
+}
+
+int umko_trace(const char *path)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    if (path == nullptr) {
+        return trace_flush() == 0 ? 0 : -1;
+    }
+    return trace_enable(path) == 0 ? 0 : -1;
+}
+
+int umko_init_timing(unsigned slow_ms, unsigned watchdog_ms)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    init_watch_config(slow_ms, watchdog_ms);
+    return 0;
+}
+
+int umko_crash_report(void)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    return crash_report_enable() == 0 ? 0 : -1;
+}
+
+int umko_stats(umko_stats_t *stats)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    if (stats == nullptr) {
+        return -1;
+    }
+    *stats = umko_stats_t{};
+    stats->module_num = env.mods.size();
+    stats->instance_num = env.instances.size();
+    stats->load_num = env.load_num;
+    stats->unload_num = env.unload_num;
+    stats->upgrade_num = env.upgrade_num;
+    stats->lazy_bind_num = lazy_bind_num();
+    for (auto &mod : env.mods) {
+        HeapStats heap;
+        stats->image_bytes += mod.get_layout().total_size;
+        stats->deferred_num += defer_pending(mod) ? 1 : 0;
+        stats->shared_bytes += mod.get_layout().shared_size;
+        if (heap_stats(mod, heap)) {
+            stats->heap_bytes += heap.used;
+        }
+    }
+    stats->symbol_num = env.sys_env.get_symbol_num();
+    stats->merge_input_bytes = MergePool::GetInstance().get_input_size();
+    stats->merge_pool_bytes = MergePool::GetInstance().get_pool_size();
+    return 0;
+}
+
+int umko_lazy_bind(int on)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+    lazy_enable(env.sys_env, env.lock, on != 0);
+    return 0;
+}
+
+int umko_heap_stats(umko_module *handle, umko_heap_stats_t *stats)
+{
+    auto &env = GetEnv();
+    std::lock_guard<std::recursive_mutex> guard(env.lock);
+
+    Module *mod = find_module(env, handle);
+    HeapStats heap;
+    if (mod == nullptr || stats == nullptr || !heap_stats(*mod, heap)) {
+        return -1;
+    }
+    *stats = umko_heap_stats_t{heap.used, heap.mapped, heap.arenas, heap.fallback_num};
+    return 0;
+}
+
+int umko_register(const char *name, void *addr)
+{
+    if (name == nullptr) {
+        return -1;
+    }
+    RegisterFunc(name, addr);
+    return 0;
+}
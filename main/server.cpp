@@ -0,0 +1,232 @@
+#include "server.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "logger.h"
+
+/* a request is one seqpacket: argc, then the args NUL terminated, with
+   the stdio descriptors of the client attached; the reply is the status */
+#define REQUEST_MAX (64 * 1024)
+#define STDIO_NUM 3
+
+static int unix_socket(const char *path, struct sockaddr_un &addr)
+{
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("socket path %s is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    return socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+}
+
+static int exit_status(int wstatus)
+{
+    if (WIFEXITED(wstatus)) {
+        return WEXITSTATUS(wstatus);
+    }
+    return 128 + WTERMSIG(wstatus);
+}
+
+/* read one request, fill args and fds, return -1 on a bad one */
+static int recv_request(int conn, std::vector<char> &buf, std::vector<char *> &args, int *fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * STDIO_NUM)];
+    struct iovec iov = {buf.data(), buf.size()};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (len < (ssize_t)sizeof(uint32_t) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || cmsg == nullptr
+        || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * STDIO_NUM)) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * STDIO_NUM);
+
+    uint32_t argc;
+    memcpy(&argc, buf.data(), sizeof(argc));
+    char *p = buf.data() + sizeof(argc);
+    char *end = buf.data() + len;
+    for (uint32_t i = 0; i < argc; i++) {
+        char *arg_end = (char *)memchr(p, '\0', end - p);
+        if (arg_end == nullptr) {
+            return -1;
+        }
+        args.push_back(p);
+        p = arg_end + 1;
+    }
+    return 0;
+}
+
+static void run_child(int conn, int listen_fd, int sig_fd, RunEntry run)
+{
+    std::vector<char> buf(REQUEST_MAX);
+    std::vector<char *> args;
+    int fds[STDIO_NUM];
+
+    close(listen_fd);
+    close(sig_fd);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+
+    if (recv_request(conn, buf, args, fds) != 0) {
+        log_error("bad request\n");
+        _exit(127);
+    }
+    for (int i = 0; i < STDIO_NUM; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    close(conn);
+    int status = run(args);
+    /* the atexit handlers belong to the server: they would finalize its
+       modules, release its shared files and rewrite its trace */
+    fflush(nullptr);
+    _exit(status);
+}
+
+int serve(const char *path, RunEntry run)
+{
+    struct sockaddr_un addr;
+    int listen_fd = unix_socket(path, addr);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 128) != 0) {
+        log_error("cannot listen on %s: %s\n", path, strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    /* children are reaped from the poll loop, not from a handler */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sig_fd < 0) {
+        close(listen_fd);
+        return -1;
+    }
+    log_info("fork server listening on %s\n", path);
+
+    std::map<pid_t, int> jobs;
+    struct pollfd pfd[2] = {{listen_fd, POLLIN, 0}, {sig_fd, POLLIN, 0}};
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            read(sig_fd, &si, sizeof(si));
+            /* signals coalesce, reap everything that is done */
+            int wstatus;
+            pid_t pid;
+            while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+                auto iter = jobs.find(pid);
+                if (iter == jobs.end()) {
+                    continue;
+                }
+                int32_t status = exit_status(wstatus);
+                send(iter->second, &status, sizeof(status), MSG_NOSIGNAL);
+                close(iter->second);
+                jobs.erase(iter);
+            }
+        }
+        if (pfd[0].revents & POLLIN) {
+            int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0) {
+                continue;
+            }
+            /* the child reads the request, a slow client only holds it;
+               flush first, the child must not repeat buffered output */
+            fflush(stdout);
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid == 0) {
+                run_child(conn, listen_fd, sig_fd, run);
+            }
+            if (pid < 0) {
+                log_error("fork failed: %s\n", strerror(errno));
+                close(conn);
+                continue;
+            }
+            jobs.emplace(pid, conn);
+        }
+    }
+    close(sig_fd);
+    close(listen_fd);
+    return -1;
+}
+
+int request(const char *path, std::vector<char *> &args)
+{
+    struct sockaddr_un addr;
+    int fd = unix_socket(path, addr);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        log_error("cannot connect to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    std::vector<char> buf(sizeof(uint32_t));
+    uint32_t argc = args.size();
+    memcpy(buf.data(), &argc, sizeof(argc));
+    for (auto arg : args) {
+        buf.insert(buf.end(), arg, arg + strlen(arg) + 1);
+    }
+    if (buf.size() > REQUEST_MAX) {
+        log_error("request args are too long\n");
+        close(fd);
+        return -1;
+    }
+
+    int fds[STDIO_NUM] = {0, 1, 2};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {buf.data(), buf.size()};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t status = -1;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 || recv(fd, &status, sizeof(status), MSG_WAITALL) != sizeof(status)) {
+        log_error("request to %s failed\n", path);
+        status = -1;
+    }
+    close(fd);
+    return status;
+}
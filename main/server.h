@@ -0,0 +1,19 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <vector>
+
+/* runs the entry of the loaded modules with args, returns the exit status */
+typedef int (*RunEntry)(std::vector<char *> &args);
+
+/*
+ * Fork server: the modules are loaded and constructed once, then every
+ * request on the unix socket at path forks a copy-on-write child which
+ * runs the entry with the args of the request, on the stdin, stdout and
+ * stderr of the client, and the exit status is sent back.
+ */
+int serve(const char *path, RunEntry run);
+/* send args to the server at path and return the exit status of the job */
+int request(const char *path, std::vector<char *> &args);
+
+#endif
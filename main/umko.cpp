@@ -1,40 +1,57 @@
-
 #include <stddef.h>
 #include <stdint.h>
-#include "module.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "umko.h"
+#include "share.h"
+#include "server.h"
 #include "logger.h"
 
-using namespace ELFIO;
-
 struct args {
     bool flag_quiet;
     bool flag_break;
     std::vector<char *> args;
     std::vector<char *> rel_objs;
+    char *snapshot = nullptr;
+    char *bundle = nullptr;
+    char *restore = nullptr;
+    const char *share_dir = nullptr;
+    bool flag_perf = false;
+    char *profile = nullptr;
+    char *trace = nullptr;
+    int init_slow = -1;
+    unsigned init_watchdog = 0;
+    bool flag_imports = false;
+    bool flag_lazy = false;
+    bool flag_defer = false;
+    int import_sample = -1;
+    char *server = nullptr;
+    char *client = nullptr;
 };
 
-struct Env {
-    SysEnv sys_env;
-    std::vector<Module> mods;
-    void (*root)(void);
-};
-
-Env &GetEnv()
-{
-    static Env env;
-    return env;
-}
-
-void RegisterFunc(const char *funcname, void *func)
-{
-    GetEnv().sys_env.add_symbol(funcname, (uint64_t)func);
-}
-
 
 static void print_usage(char **argv)
 {
 	printf("usage: %s <elf_rel_file> [<elf_rel_file>] ..\n"
-	       "\t--args <string>   : args for rel file(to be done)\n"
+	       "\t--args <string>   : arg for the main of rel files\n"
+	       "\t--snapshot <file> : save the loaded modules to file and exit\n"
+	       "\t--restore <file>  : run from a snapshot instead of rel files\n"
+	       "\t--bundle <file>   : write the rel files, [<features>=]<file>, to a\n"
+	       "\t                    bundle loading the best one for the cpu, and exit\n"
+	       "\t--share           : share relocated text with other umko processes\n"
+	       "\t--lazy            : bind called functions on their first call\n"
+	       "\t--defer           : load each rel file on the first call into it\n"
+	       "\t--perf            : write perf map and jitdump for module code\n"
+	       "\t--profile <prefix>: sample module code, write <prefix>.txt/.folded\n"
+	       "\t--trace <file>    : write a Chrome trace of the loads to file\n"
+	       "\t--init-slow <ms>  : warn about constructors running that long\n"
+	       "\t--init-watchdog <ms>: sample the stack of a constructor that long\n"
+	       "\t--imports         : count module calls into the host, print at exit\n"
+	       "\t--imports-time <n>: also time one host call in 2^n\n"
+	       "\t--server <socket> : load once, then fork a run per request\n"
+	       "\t--client <socket> : run on a server with the given --args\n"
 	       "\t--help            : this message\n", argv[0]);
 }
 
@@ -60,6 +77,121 @@ uint32_t parser_args(int argc, char **argv, args &arg)
             arg.args.push_back(argv[i]);
 			continue;
 		}
+		if (!strcmp(argv[i], "--snapshot")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.snapshot = argv[i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--bundle")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.bundle = argv[i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--share")) {
+			arg.share_dir = UMKO_SHARE_DIR_DEFAULT;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--lazy")) {
+			arg.flag_lazy = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--defer")) {
+			arg.flag_defer = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--perf")) {
+			arg.flag_perf = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--profile")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.profile = argv[i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--trace")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.trace = argv[i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--init-slow")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.init_slow = atoi(argv[i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--init-watchdog")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.init_watchdog = atoi(argv[i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--imports")) {
+			arg.flag_imports = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--imports-time")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.flag_imports = true;
+			arg.import_sample = atoi(argv[i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--server")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.server = argv[i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--client")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.client = argv[i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--restore")) {
+			if (++i == argc) {
+				print_usage(argv);
+				return -1;
+			}
+			arg.restore = argv[i];
+			continue;
+		}
 		arg.rel_objs.push_back(argv[i]);
 	}
     return 0;
@@ -67,6 +199,34 @@ uint32_t parser_args(int argc, char **argv, args &arg)
 
 
 typedef void (*Entry)(void);
+typedef int (*MainEntry)(int argc, char **argv);
+
+/* a module main gets the --args, else the entry runs without any */
+static int run_entry(std::vector<char *> &args)
+{
+    uint64_t main_addr = (uint64_t)umko_sym(NULL, "main");
+    if (main_addr) {
+        std::vector<char *> argv;
+        argv.push_back((char *)"umko");
+        argv.insert(argv.end(), args.begin(), args.end());
+        argv.push_back(nullptr);
+        log_info("execute main at 0x%lx\n", main_addr);
+        return ((MainEntry)main_addr)(argv.size() - 1, argv.data());
+    }
+    uint64_t entry_addr = (uint64_t)umko_entry();
+    if (entry_addr) {
+        log_info("execute entry_func at 0x%lx\n", entry_addr);
+        Entry entry_func = (Entry)entry_addr;
+        entry_func();
+    }
+    return 0;
+}
+
+static void stop_profile(void)
+{
+    umko_profile_stop();
+}
+
 int main(int argc, char **argv)
 {
     args arg;
@@ -74,24 +234,58 @@ int main(int argc, char **argv)
     if (ret != 0) {
         return -1;
     } 
+    if (arg.client) {
+        return request(arg.client, arg.args);
+    }
     uint32_t obj_num = arg.rel_objs.size();
-    if (obj_num == 0) {
-        return -1;
+    if (arg.bundle) {
+        return umko_bundle(arg.bundle, arg.rel_objs.data(), obj_num) == 0 ? 0 : -1;
     }
-    auto &env = GetEnv();
-    env.mods.resize(obj_num);
-    
-    for (int i = 0; i < obj_num; i++) {
-        auto &mod = env.mods[i];
-        mod.set_obj_path(arg.rel_objs[i]);
-        load_module(mod, env.sys_env);
+    umko_crash_report();
+    if (arg.share_dir) {
+        umko_share(arg.share_dir);
     }
-    uint64_t entry_addr = env.sys_env.get_entry();
-    if (entry_addr) {
-        log_info("execute entry_func at 0x%lx\n", entry_addr);
-        Entry entry_func = (Entry)entry_addr;
-        entry_func();
+    if (arg.flag_lazy) {
+        umko_lazy_bind(1);
+    }
+    if (arg.flag_perf) {
+        umko_perf(UMKO_PERF_MAP | UMKO_PERF_JITDUMP);
+    }
+    if (arg.trace) {
+        umko_trace(arg.trace);
+    }
+    if (arg.init_slow >= 0 || arg.init_watchdog) {
+        umko_init_timing(arg.init_slow >= 0 ? arg.init_slow : 100, arg.init_watchdog);
+    }
+    if (arg.flag_imports) {
+        umko_count_imports(arg.import_sample);
+    }
+    /* constructors are sampled too, the profile is written at exit */
+    if (arg.profile && umko_profile_start(arg.profile, 0) == 0) {
+        atexit(stop_profile);
+    }
+    if (arg.restore) {
+        if (umko_restore(arg.restore) != 0) {
+            return -1;
+        }
+    } else if (obj_num == 0) {
+        return -1;
     }
 
-    return 0;
-}
\ No newline at end of file
+    /* one group, the objects may import from each other in any order;
+       deferred, each one is loaded by the first call into it */
+    if (arg.flag_defer) {
+        if (obj_num && umko_defer_group(arg.rel_objs.data(), obj_num, nullptr) != 0) {
+            return -1;
+        }
+    } else if (obj_num && umko_load_group(arg.rel_objs.data(), obj_num, nullptr) != 0) {
+        return -1;
+    }
+    if (arg.snapshot) {
+        return umko_snapshot(arg.snapshot) == 0 ? 0 : -1;
+    }
+    if (arg.server) {
+        return serve(arg.server, run_entry);
+    }
+    return run_entry(arg.args);
+}
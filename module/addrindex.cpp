@@ -0,0 +1,227 @@
+#include "addrindex.h"
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sched.h>
+#include <sys/mman.h>
+#include "module.h"
+
+using namespace ELFIO;
+
+struct IndexSym {
+    uint64_t addr;
+    uint32_t size;
+    uint32_t name;      /* offset in the arena */
+};
+
+/* one mapping per module: header, syms sorted by addr, then the arena */
+struct IndexImage {
+    uint64_t map_size;
+    uint32_t sym_num;
+    uint32_t name;
+    IndexSym syms[];
+};
+
+struct IndexEntry {
+    uint64_t start;
+    uint64_t end;
+    const IndexImage *image;
+    const void *owner;
+};
+
+struct IndexTable {
+    uint64_t map_size;
+    uint64_t num;
+    IndexEntry entries[];   /* sorted by start */
+};
+
+/* writers are serialized, readers only count themselves in one of two
+   epochs so that a writer knows when a table it replaced is unused */
+static std::mutex index_lock;
+static IndexTable *index_table;
+static uint32_t index_epoch;
+static uint64_t index_readers[2];
+
+static inline const char *image_arena(const IndexImage *image)
+{
+    return (const char *)&image->syms[image->sym_num];
+}
+
+static void *index_map(uint64_t size)
+{
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+static IndexImage *build_image(Module &mod, int64_t delta)
+{
+    elfio &elf = mod.get_elf();
+    symbol_section_accessor symbols(elf, elf.sections[mod.sym_sec_index]);
+    auto &vsec = mod.get_sec();
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
+
+    std::vector<IndexSym> syms;
+    std::string arena(mod.get_obj_path());
+    arena.push_back('\0');
+    for (Elf_Xword i = 0; i < symbols.get_symbols_num(); i++) {
+        symbols.get_symbol(i, name, value, size, bind, type, section_index, other);
+        if (type == STT_FUNC && section_index < vsec.size() && vsec[section_index].offset != ~0UL) {
+            syms.push_back({value + delta, (uint32_t)size, (uint32_t)arena.size()});
+            arena.append(name);
+            arena.push_back('\0');
+        }
+    }
+    std::sort(syms.begin(), syms.end(), [](const IndexSym &a, const IndexSym &b) { return a.addr < b.addr; });
+
+    uint64_t map_size = (sizeof(IndexImage) + syms.size() * sizeof(IndexSym) + arena.size() + 4095) & ~4095UL;
+    IndexImage *image = (IndexImage *)index_map(map_size);
+    if (image == nullptr) {
+        return nullptr;
+    }
+    image->map_size = map_size;
+    image->sym_num = syms.size();
+    image->name = 0;
+    std::copy(syms.begin(), syms.end(), image->syms);
+    std::copy(arena.begin(), arena.end(), (char *)image_arena(image));
+    mprotect(image, map_size, PROT_READ);
+    return image;
+}
+
+static IndexTable *alloc_table(uint64_t num)
+{
+    uint64_t map_size = (sizeof(IndexTable) + num * sizeof(IndexEntry) + 4095) & ~4095UL;
+    IndexTable *table = (IndexTable *)index_map(map_size);
+    if (table) {
+        table->map_size = map_size;
+        table->num = num;
+    }
+    return table;
+}
+
+/* Swap in the new table and wait out the readers of the old one. Two
+   flips are needed, a reader may have picked its epoch before the first
+   one but counted itself only after the writer looked. */
+static void publish_table(IndexTable *table)
+{
+    IndexTable *old = index_table;
+    __atomic_store_n(&index_table, table, __ATOMIC_SEQ_CST);
+    for (int flip = 0; flip < 2; flip++) {
+        uint32_t epoch = __atomic_fetch_add(&index_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&index_readers[epoch], __ATOMIC_SEQ_CST) != 0) {
+            sched_yield();
+        }
+    }
+    if (old) {
+        munmap(old, old->map_size);
+    }
+}
+
+void addr_index_add(Module &mod, const void *owner, int64_t delta)
+{
+    IndexImage *image = build_image(mod, delta);
+    if (image == nullptr) {
+        return;
+    }
+    auto &layout = mod.get_layout();
+    uint64_t start = (uint64_t)layout.base + delta;
+    IndexEntry entry = {start, start + layout.total_size, image, owner ? owner : &mod};
+
+    std::lock_guard<std::mutex> guard(index_lock);
+    uint64_t num = index_table ? index_table->num : 0;
+    IndexTable *table = alloc_table(num + 1);
+    if (table == nullptr) {
+        munmap(image, image->map_size);
+        return;
+    }
+    uint64_t j = 0;
+    for (uint64_t i = 0; i < num; i++) {
+        if (j == i && index_table->entries[i].start > entry.start) {
+            table->entries[j++] = entry;
+        }
+        table->entries[j++] = index_table->entries[i];
+    }
+    if (j == num) {
+        table->entries[j] = entry;
+    }
+    mprotect(table, table->map_size, PROT_READ);
+    publish_table(table);
+}
+
+void addr_index_remove(const void *owner)
+{
+    std::lock_guard<std::mutex> guard(index_lock);
+    if (index_table == nullptr) {
+        return;
+    }
+    const IndexImage *image = nullptr;
+    uint64_t num = index_table->num;
+    IndexTable *table = alloc_table(num);
+    if (table == nullptr) {
+        return;
+    }
+    uint64_t j = 0;
+    for (uint64_t i = 0; i < num; i++) {
+        if (index_table->entries[i].owner == owner) {
+            image = index_table->entries[i].image;
+        } else {
+            table->entries[j++] = index_table->entries[i];
+        }
+    }
+    table->num = j;
+    mprotect(table, table->map_size, PROT_READ);
+    publish_table(table);
+    if (image) {
+        munmap((void *)image, image->map_size);
+    }
+}
+
+static void copy_name(char *dest, const char *src)
+{
+    uint32_t i = 0;
+    for (; i < ADDR_NAME_MAX - 1 && src[i]; i++) {
+        dest[i] = src[i];
+    }
+    dest[i] = '\0';
+}
+
+bool addr_index_lookup(uint64_t addr, AddrInfo &info)
+{
+    uint32_t epoch = __atomic_load_n(&index_epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&index_readers[epoch], 1, __ATOMIC_SEQ_CST);
+    const IndexTable *table = __atomic_load_n(&index_table, __ATOMIC_SEQ_CST);
+    bool found = false;
+
+    if (table) {
+        const IndexEntry *entries = table->entries;
+        auto m = std::upper_bound(entries, entries + table->num, addr,
+            [](uint64_t a, const IndexEntry &e) { return a < e.start; });
+        if (m != entries && addr < (--m)->end) {
+            const IndexImage *image = m->image;
+            const char *arena = image_arena(image);
+            auto s = std::upper_bound(image->syms, image->syms + image->sym_num, addr,
+                [](uint64_t a, const IndexSym &is) { return a < is.addr; });
+            const IndexSym *sym = s != image->syms ? s - 1 : nullptr;
+            info.mod_base = m->start;
+            copy_name(info.mod_name, arena + image->name);
+            if (sym && addr - sym->addr < sym->size) {
+                info.sym_addr = sym->addr;
+                info.offset = addr - sym->addr;
+                copy_name(info.sym_name, arena + sym->name);
+            } else {
+                info.sym_addr = 0;
+                info.offset = addr - m->start;
+                info.sym_name[0] = '\0';
+            }
+            found = true;
+        }
+    }
+    __atomic_fetch_sub(&index_readers[epoch], 1, __ATOMIC_RELEASE);
+    return found;
+}
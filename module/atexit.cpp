@@ -0,0 +1,91 @@
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "module.h"
+#include "logger.h"
+#include "register.h"
+
+/*
+ * C++ modules register the destructors of their globals with
+ * __cxa_atexit(func, obj, &__dso_handle). Each module gets its own
+ * __dso_handle, its image base, so the destructors can run when the
+ * module is unloaded, like __cxa_finalize does for dlclose.
+ */
+extern "C" int __cxa_atexit(void (*func)(void *), void *arg, void *dso);
+
+struct AtExitEntry {
+    void (*func)(void *);
+    void *arg;
+};
+
+static std::mutex atexit_lock;
+static std::unordered_map<void *, std::vector<AtExitEntry>> atexit_map;
+static bool atexit_hooked = false;
+
+/* modules still loaded when the process exits */
+static void cxa_finalize_all(void)
+{
+    std::unique_lock<std::mutex> guard(atexit_lock);
+    while (!atexit_map.empty()) {
+        auto iter = atexit_map.begin();
+        std::vector<AtExitEntry> entries;
+        entries.swap(iter->second);
+        atexit_map.erase(iter);
+        guard.unlock();
+        for (auto e = entries.rbegin(); e != entries.rend(); ++e) {
+            e->func(e->arg);
+        }
+        guard.lock();
+    }
+}
+
+void cxa_add_module(void *dso)
+{
+    std::lock_guard<std::mutex> guard(atexit_lock);
+    atexit_map.emplace(dso, std::vector<AtExitEntry>());
+    if (!atexit_hooked) {
+        atexit(cxa_finalize_all);
+        atexit_hooked = true;
+    }
+}
+
+/* run the destructors registered with dso, in reverse order */
+void cxa_finalize_module(void *dso)
+{
+    std::vector<AtExitEntry> entries;
+    {
+        std::lock_guard<std::mutex> guard(atexit_lock);
+        auto iter = atexit_map.find(dso);
+        if (iter == atexit_map.end()) {
+            return;
+        }
+        entries.swap(iter->second);
+        atexit_map.erase(iter);
+    }
+    for (auto e = entries.rbegin(); e != entries.rend(); ++e) {
+        e->func(e->arg);
+    }
+}
+
+/* drop the destructors registered with dso without running them */
+void cxa_remove_module(void *dso)
+{
+    std::lock_guard<std::mutex> guard(atexit_lock);
+    atexit_map.erase(dso);
+}
+
+static int umko_cxa_atexit(void (*func)(void *), void *arg, void *dso)
+{
+    {
+        std::lock_guard<std::mutex> guard(atexit_lock);
+        auto iter = atexit_map.find(dso);
+        if (iter != atexit_map.end()) {
+            iter->second.push_back({func, arg});
+            return 0;
+        }
+    }
+    return __cxa_atexit(func, arg, dso);
+}
+
+RegFuncName("__cxa_atexit", umko_cxa_atexit);
@@ -0,0 +1,44 @@
+#include <cstring>
+#include <link.h>
+#include "snapshot.h"
+
+/* kept apart from the loader, the macros of <elf.h> clash with ELFIO */
+
+struct BuildIdArg {
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t found;
+};
+
+static int find_build_id(struct dl_phdr_info *info, size_t, void *data)
+{
+    BuildIdArg *arg = (BuildIdArg *)data;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE) {
+            continue;
+        }
+        const char *p = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+        const char *end = p + phdr->p_memsz;
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *note = (const ElfW(Nhdr) *)p;
+            const char *name = p + sizeof(ElfW(Nhdr));
+            const char *desc = name + ((note->n_namesz + 3) & ~3);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                arg->found = note->n_descsz < arg->size ? note->n_descsz : arg->size;
+                memcpy(arg->buf, desc, arg->found);
+                return 1;
+            }
+            p = desc + ((note->n_descsz + 3) & ~3);
+        }
+    }
+    /* the executable comes first, do not look at shared objects */
+    return 1;
+}
+
+uint32_t host_build_id(uint8_t *buf, uint32_t size)
+{
+    BuildIdArg arg = {buf, size, 0};
+    dl_iterate_phdr(find_build_id, &arg);
+    return arg.found;
+}
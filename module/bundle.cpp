@@ -0,0 +1,188 @@
+#include "bundle.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logger.h"
+
+#if defined(__x86_64__)
+#define BUNDLE_ELF_MACH 62      /* EM_X86_64 */
+#elif defined(__aarch64__)
+#define BUNDLE_ELF_MACH 183     /* EM_AARCH64 */
+#endif
+
+static inline uint64_t bundle_align(uint64_t v)
+{
+    return (v + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+}
+
+/* a relocatable object of this machine */
+static bool is_host_object(const char *obj, uint64_t size)
+{
+    uint16_t machine;
+    if (size < 64 || memcmp(obj, "\177ELF", 4) != 0) {
+        return false;
+    }
+    memcpy(&machine, obj + 18, sizeof(machine));
+    return machine == BUNDLE_ELF_MACH;
+}
+
+int32_t cpu_features_weight(const std::string &list)
+{
+    int32_t weight = 0;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (end > start) {
+            int32_t w = arch_cpu_feature(list.substr(start, end - start));
+            if (w < 0) {
+                return -1;
+            }
+            weight += w;
+        }
+        start = end + 1;
+    }
+    return weight;
+}
+
+bool bundle_is(const void *buf, uint64_t size)
+{
+    return size >= sizeof(BundleHeader) && memcmp(buf, UMKO_BUNDLE_MAGIC, 8) == 0;
+}
+
+uint32_t bundle_select(const void *buf, uint64_t size, const char *path, uint64_t &offset, uint64_t &obj_size)
+{
+    auto *header = (const BundleHeader *)buf;
+    auto *entries = (const BundleEntry *)(header + 1);
+    if (header->version != UMKO_BUNDLE_VERSION
+        || header->num > (size - sizeof(BundleHeader)) / sizeof(BundleEntry)) {
+        log_error("bundle: %s is corrupt or of another version\n", path);
+        return -1;
+    }
+    int32_t best = -1;
+    int32_t best_weight = -1;
+    for (uint32_t i = 0; i < header->num; i++) {
+        auto &e = entries[i];
+        std::string features(e.features, strnlen(e.features, BUNDLE_FEATURES_MAX));
+        if (e.offset % BUNDLE_ALIGN || e.offset > size || e.size > size - e.offset) {
+            log_error("bundle: variant %u of %s is out of the file\n", i, path);
+            return -1;
+        }
+        if (!is_host_object((const char *)buf + e.offset, e.size)) {
+            log_debug("bundle: variant %u [%s] of %s is for another machine\n", i, features.c_str(), path);
+            continue;
+        }
+        int32_t weight = cpu_features_weight(features);
+        log_debug("bundle: variant %u [%s] of %s, weight %d\n", i, features.c_str(), path, weight);
+        if (weight > best_weight) {
+            best = i;
+            best_weight = weight;
+        }
+    }
+    if (best < 0) {
+        log_error("bundle: no variant of %s runs on this cpu\n", path);
+        return -1;
+    }
+    offset = entries[best].offset;
+    obj_size = entries[best].size;
+    log_info("bundle: variant %d [%.*s] of %s\n", best, BUNDLE_FEATURES_MAX, entries[best].features, path);
+    return 0;
+}
+
+static bool write_all(int fd, const void *data, uint64_t size)
+{
+    const char *p = (const char *)data;
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+struct BundleInput {
+    void *map;
+    uint64_t size;
+};
+
+uint32_t bundle_write(const char *path, const std::vector<std::string> &variants)
+{
+    std::vector<BundleEntry> entries(variants.size());
+    std::vector<BundleInput> inputs;
+    uint64_t offset = bundle_align(sizeof(BundleHeader) + entries.size() * sizeof(BundleEntry));
+    uint32_t ret = 0;
+
+    for (uint32_t i = 0; i < variants.size(); i++) {
+        auto eq = variants[i].find('=');
+        std::string features = eq == std::string::npos ? "" : variants[i].substr(0, eq);
+        std::string obj = eq == std::string::npos ? variants[i] : variants[i].substr(eq + 1);
+        if (features.size() >= BUNDLE_FEATURES_MAX) {
+            log_error("bundle: features of %s are too long\n", obj.c_str());
+            ret = -1;
+            break;
+        }
+        int fd = open(obj.c_str(), O_RDONLY);
+        struct stat sb;
+        if (fd < 0 || fstat(fd, &sb) != 0 || sb.st_size < 4) {
+            log_error("bundle: cannot read %s\n", obj.c_str());
+            if (fd >= 0) {
+                close(fd);
+            }
+            ret = -1;
+            break;
+        }
+        void *p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED || memcmp(p, "\177ELF", 4) != 0) {
+            log_error("bundle: %s is not an object\n", obj.c_str());
+            if (p != MAP_FAILED) {
+                munmap(p, sb.st_size);
+            }
+            ret = -1;
+            break;
+        }
+        inputs.push_back({p, (uint64_t)sb.st_size});
+        memcpy(entries[i].features, features.c_str(), features.size() + 1);
+        entries[i].offset = offset;
+        entries[i].size = sb.st_size;
+        offset = bundle_align(offset + sb.st_size);
+    }
+
+    int fd = ret == 0 ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (ret == 0 && fd < 0) {
+        log_error("bundle: cannot create %s\n", path);
+        ret = -1;
+    }
+    if (ret == 0) {
+        BundleHeader header = {};
+        memcpy(header.magic, UMKO_BUNDLE_MAGIC, 8);
+        header.version = UMKO_BUNDLE_VERSION;
+        header.num = entries.size();
+        /* the gaps are holes, ftruncate gives the file its full size */
+        bool ok = write_all(fd, &header, sizeof(header))
+            && write_all(fd, entries.data(), entries.size() * sizeof(BundleEntry));
+        for (uint32_t i = 0; ok && i < inputs.size(); i++) {
+            ok = lseek(fd, entries[i].offset, SEEK_SET) >= 0 && write_all(fd, inputs[i].map, inputs[i].size);
+        }
+        ok = ok && ftruncate(fd, offset) == 0;
+        close(fd);
+        if (!ok) {
+            log_error("bundle: cannot write %s\n", path);
+            unlink(path);
+            ret = -1;
+        } else {
+            log_info("bundle: %zu variants, 0x%lx bytes to %s\n", entries.size(), offset, path);
+        }
+    }
+    for (auto &in : inputs) {
+        munmap(in.map, in.size);
+    }
+    return ret;
+}
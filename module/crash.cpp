@@ -0,0 +1,182 @@
+#include "crash.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "addrindex.h"
+#include "logger.h"
+
+static const int crash_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE};
+#define CRASH_SIGNAL_NUM (sizeof(crash_signals) / sizeof(crash_signals[0]))
+
+static struct sigaction crash_old_actions[CRASH_SIGNAL_NUM];
+static bool crash_enabled = false;
+
+/* a line is put together in a buffer and written at once, nothing here
+   may allocate or take a lock */
+struct CrashLine {
+    char buf[2 * ADDR_NAME_MAX + 128];
+    uint32_t len;
+
+    void put(const char *s)
+    {
+        while (*s && len < sizeof(buf)) {
+            buf[len++] = *s++;
+        }
+    }
+    void put_hex(uint64_t v)
+    {
+        char tmp[19] = "0x";
+        int n = 0;
+        char digits[16];
+        do {
+            digits[n++] = "0123456789abcdef"[v & 0xf];
+            v >>= 4;
+        } while (v);
+        for (int i = 0; i < n; i++) {
+            tmp[2 + i] = digits[n - 1 - i];
+        }
+        tmp[2 + n] = '\0';
+        put(tmp);
+    }
+    void put_dec(uint64_t v)
+    {
+        char tmp[21];
+        int n = sizeof(tmp) - 1;
+        tmp[n] = '\0';
+        do {
+            tmp[--n] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        put(tmp + n);
+    }
+    void flush()
+    {
+        put("\n");
+        ssize_t ret = write(STDERR_FILENO, buf, len);
+        (void)ret;
+        len = 0;
+    }
+};
+
+/* frames are {previous fp, return address}, read through the kernel so
+   that a broken chain ends the walk instead of faulting again */
+static bool read_frame(uint64_t fp, uint64_t frame[2])
+{
+    struct iovec local = {frame, 16};
+    struct iovec remote = {(void *)fp, 16};
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == 16;
+}
+
+uint32_t context_frames(void *ctx, uint64_t *pcs, uint32_t max)
+{
+    ucontext_t *uc = (ucontext_t *)ctx;
+    uint64_t fp;
+#if defined(__x86_64__)
+    pcs[0] = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    pcs[0] = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+#else
+#error "stack walks are not supported on this arch"
+#endif
+    uint32_t depth = 1;
+    uint64_t frame[2];
+    while (depth < max && fp && (fp & 7) == 0) {
+        if (!read_frame(fp, frame) || frame[1] == 0) {
+            break;
+        }
+        pcs[depth++] = frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+    return depth;
+}
+
+static void crash_frame(CrashLine &line, uint32_t depth, uint64_t pc, bool leaf)
+{
+    AddrInfo info;
+    line.put("  #");
+    line.put_dec(depth);
+    line.put(" ");
+    line.put_hex(pc);
+    /* return addresses point after the call */
+    if (addr_index_lookup(leaf ? pc : pc - 1, info)) {
+        line.put(" ");
+        line.put(info.mod_name);
+        if (info.sym_addr) {
+            line.put("`");
+            line.put(info.sym_name);
+        }
+        line.put("+");
+        line.put_hex(info.offset + (leaf ? 0 : 1));
+    } else {
+        line.put(" [host]");
+    }
+    line.flush();
+}
+
+static void crash_handler(int sig, siginfo_t *info, void *ctx)
+{
+    int saved_errno = errno;
+    uint64_t pcs[CRASH_MAX_DEPTH];
+    uint32_t depth = context_frames(ctx, pcs, CRASH_MAX_DEPTH);
+
+    CrashLine line;
+    line.len = 0;
+    line.put("umko: signal ");
+    line.put_dec(sig);
+    line.put(" fault address ");
+    line.put_hex((uint64_t)info->si_addr);
+    line.flush();
+    for (uint32_t i = 0; i < depth; i++) {
+        crash_frame(line, i, pcs[i], i == 0);
+    }
+
+    /* hand over to what was there before: a fault comes back when the
+       instruction is retried, a sent signal is sent again */
+    for (uint32_t i = 0; i < CRASH_SIGNAL_NUM; i++) {
+        if (crash_signals[i] == sig) {
+            sigaction(sig, &crash_old_actions[i], nullptr);
+        }
+    }
+    if (info->si_code <= 0) {
+        raise(sig);
+    }
+    errno = saved_errno;
+}
+
+uint32_t crash_report_enable()
+{
+    if (crash_enabled) {
+        return 0;
+    }
+    /* an overflowed stack of the loading thread can still be reported */
+    void *alt = mmap(nullptr, CRASH_ALT_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (alt != MAP_FAILED) {
+        stack_t ss;
+        ss.ss_sp = alt;
+        ss.ss_size = CRASH_ALT_STACK_SIZE;
+        ss.ss_flags = 0;
+        sigaltstack(&ss, nullptr);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = crash_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    for (uint32_t i = 0; i < CRASH_SIGNAL_NUM; i++) {
+        if (sigaction(crash_signals[i], &sa, &crash_old_actions[i]) != 0) {
+            log_error("crash: cannot handle signal %d\n", crash_signals[i]);
+            return -1;
+        }
+    }
+    crash_enabled = true;
+    return 0;
+}
@@ -0,0 +1,234 @@
+#include "defer.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "module.h"
+#include "lazy.h"
+#include "reloc.h"
+#include "bundle.h"
+#include "logger.h"
+
+using namespace ELFIO;
+
+/* one mapping: the header and the entries, then the slots on pages of
+   their own, which stay writable */
+struct Deferred {
+    SysEnv *env;
+    std::recursive_mutex *lock;
+    char *base;
+    uint64_t map_size;
+    uint64_t *slots;
+    std::vector<std::string> names;
+    bool loaded;
+    bool loading;
+};
+
+/* exported functions of the object at p, -1 when it exports anything else */
+static uint32_t scan_exports(const char *p, uint64_t size, const char *path, std::vector<std::string> &names)
+{
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)p;
+    if (size < sizeof(*ehdr) || ehdr->e_ident[EI_MAG0] != ELFMAG0 ||
+        ehdr->e_ident[EI_MAG1] != ELFMAG1 || ehdr->e_ident[EI_MAG2] != ELFMAG2 ||
+        ehdr->e_ident[EI_MAG3] != ELFMAG3 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_type != ET_REL ||
+        ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr) > size) {
+        log_error("defer: %s is not a relocatable object\n", path);
+        return -1;
+    }
+    const Elf64_Shdr *shdr = (const Elf64_Shdr *)(p + ehdr->e_shoff);
+    for (uint32_t i = 0; i < ehdr->e_shnum; i++) {
+        if (shdr[i].sh_type != SHT_SYMTAB) {
+            continue;
+        }
+        const Elf64_Shdr &strtab = shdr[shdr[i].sh_link < ehdr->e_shnum ? shdr[i].sh_link : 0];
+        if (shdr[i].sh_offset + shdr[i].sh_size > size || strtab.sh_offset + strtab.sh_size > size) {
+            log_error("defer: bad symbol table in %s\n", path);
+            return -1;
+        }
+        const Elf64_Sym *syms = (const Elf64_Sym *)(p + shdr[i].sh_offset);
+        const char *strs = p + strtab.sh_offset;
+        uint64_t sym_num = shdr[i].sh_size / sizeof(Elf64_Sym);
+        for (uint64_t j = 1; j < sym_num; j++) {
+            const Elf64_Sym &sym = syms[j];
+            if (ELF_ST_BIND(sym.st_info) != STB_GLOBAL || sym.st_shndx == SHN_UNDEF) {
+                continue;
+            }
+            if (sym.st_name >= strtab.sh_size) {
+                log_error("defer: bad symbol name in %s\n", path);
+                return -1;
+            }
+            const char *name = strs + sym.st_name;
+            if (sym.st_shndx >= SHN_LORESERVE || sym.st_shndx >= ehdr->e_shnum ||
+                !(shdr[sym.st_shndx].sh_flags & SHF_EXECINSTR)) {
+                log_info("defer: %s exports data '%s'\n", path, name);
+                return -1;
+            }
+            names.push_back(name);
+        }
+        return 0;
+    }
+    log_error("defer: no symbol table in %s\n", path);
+    return -1;
+}
+
+static uint32_t read_exports(const char *path, std::vector<std::string> &names)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("defer: cannot open file %s\n", path);
+        return -1;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        log_error("defer: cannot stat file %s\n", path);
+        return -1;
+    }
+    void *map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error("defer: cannot mmap file %s\n", path);
+        return -1;
+    }
+    const char *p = (const char *)map;
+    uint64_t size = sb.st_size;
+    uint32_t ret = -1;
+    uint64_t offset;
+    if (!bundle_is(p, size)) {
+        ret = scan_exports(p, size, path, names);
+    } else if (bundle_select(p, size, path, offset, size) == 0) {
+        ret = scan_exports(p + offset, size, path, names);
+    }
+    munmap(map, sb.st_size);
+    return ret;
+}
+
+static Deferred *build_stubs(Module &mod, std::vector<std::string> &names)
+{
+    uint64_t code_size = (LAZY_PLT_HEADER_SIZE + names.size() * PLT_ENTRY_SIZE + 4095) & ~4095UL;
+    uint64_t map_size = code_size + ((names.size() * sizeof(uint64_t) + 4095) & ~4095UL);
+    /* near the modules, for their 32-bit calls */
+    void *p = mmap(module_area_hint(map_size), map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        log_error("defer: cannot map the stubs of %s\n", mod.get_obj_path());
+        return nullptr;
+    }
+    Deferred *d = new Deferred{};
+    d->base = (char *)p;
+    d->map_size = map_size;
+    d->slots = (uint64_t *)(d->base + code_size);
+    d->names.swap(names);
+
+    arch_lazy_plt_header(d->base, (uint64_t)&mod | DEFER_CTX_TAG);
+    for (uint64_t i = 0; i < d->names.size(); i++) {
+        char *entry = d->base + LAZY_PLT_HEADER_SIZE + i * PLT_ENTRY_SIZE;
+        d->slots[i] = arch_lazy_plt_entry(entry, (uint64_t)&d->slots[i], (uint64_t)d->base, (uint64_t)d->base);
+    }
+    mprotect(d->base, code_size, PROT_READ | PROT_EXEC);
+    __builtin___clear_cache(d->base, d->base + code_size);
+    return d;
+}
+
+uint32_t defer_module(Module &mod, SysEnv &env, std::recursive_mutex &lock)
+{
+    std::vector<std::string> names;
+    if (read_exports(mod.get_obj_path(), names) != 0) {
+        return -1;
+    }
+    Deferred *d = build_stubs(mod, names);
+    if (d == nullptr) {
+        return -1;
+    }
+    d->env = &env;
+    d->lock = &lock;
+    mod.defer = d;
+
+    auto &exports = mod.get_exports();
+    for (uint64_t i = 0; i < d->names.size(); i++) {
+        uint64_t stub = (uint64_t)d->base + LAZY_PLT_HEADER_SIZE + i * PLT_ENTRY_SIZE;
+        env.add_symbol(d->names[i], stub, &mod);
+        exports.push_back({d->names[i], stub, PLT_ENTRY_SIZE, STT_FUNC});
+    }
+    std::sort(exports.begin(), exports.end(),
+        [](const ExportSym &a, const ExportSym &b) { return a.name < b.name; });
+    env.publish();
+    log_info("defer: %zu stubs for %s\n", d->names.size(), mod.get_obj_path());
+    return 0;
+}
+
+/* like a symbol lookup error of ld.so, the log goes through stdio */
+static void defer_fail()
+{
+    fflush(nullptr);
+    abort();
+}
+
+/* the stubs make way for the real exports, then the slots follow them */
+static void defer_load(Module &mod, Deferred *d)
+{
+    for (auto &sym : mod.get_exports()) {
+        d->env->remove_symbol(sym.name, sym.addr);
+    }
+    mod.get_exports().clear();
+    d->loading = true;
+    log_info("defer: first call, loading %s\n", mod.get_obj_path());
+    if (load_module(mod, *d->env) != 0) {
+        log_fatal("defer: cannot load %s\n", mod.get_obj_path());
+        defer_fail();
+    }
+    d->loading = false;
+    for (uint64_t i = 0; i < d->names.size(); i++) {
+        const ExportSym *sym = mod.find_export(d->names[i]);
+        if (sym == nullptr) {
+            log_fatal("defer: '%s' is gone from %s\n", d->names[i].c_str(), mod.get_obj_path());
+            defer_fail();
+        }
+        __atomic_store_n(&d->slots[i], sym->addr, __ATOMIC_RELEASE);
+    }
+    d->loaded = true;
+}
+
+uint64_t defer_resolve(Module &mod, uint64_t slot)
+{
+    Deferred *d = mod.defer;
+    std::lock_guard<std::recursive_mutex> guard(*d->lock);
+    uint64_t offset = slot < d->map_size ? slot : slot - (uint64_t)d->base;
+    uint64_t index = (offset - ((char *)d->slots - d->base)) / sizeof(uint64_t);
+
+    if (index >= d->names.size()) {
+        log_fatal("defer: no stub for slot 0x%lx in %s\n", offset, mod.get_obj_path());
+        defer_fail();
+    }
+    if (d->loading) {
+        /* a constructor run by the load called back into a stub */
+        log_fatal("defer: '%s' called while %s is loading\n", d->names[index].c_str(), mod.get_obj_path());
+        defer_fail();
+    }
+    if (!d->loaded) {
+        defer_load(mod, d);
+    }
+    return d->slots[index];
+}
+
+bool defer_pending(Module &mod)
+{
+    return mod.defer && !mod.defer->loaded;
+}
+
+void defer_release(Module &mod)
+{
+    Deferred *d = mod.defer;
+    if (d == nullptr) {
+        return;
+    }
+    munmap(d->base, d->map_size);
+    delete d;
+    mod.defer = nullptr;
+}
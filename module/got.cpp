@@ -0,0 +1,272 @@
+#include "got.h"
+#include "module.h"
+#include "logger.h"
+#include "reloc.h"
+#include "tls.h"
+#include "lazy.h"
+#include <unordered_set>
+
+using namespace ELFIO;
+
+static inline uint64_t got_key(uint32_t sym_index, int reloc_cls)
+{
+    return ((uint64_t)sym_index << 8) | (uint64_t)reloc_cls;
+}
+
+static inline uint64_t got_slot_size(int reloc_cls)
+{
+    /* tls_index and TLS descriptors take a pair of words */
+    return (reloc_cls == RELOC_CLASS_GOT || reloc_cls == RELOC_CLASS_GOT_TPOFF) ? 8 : 16;
+}
+
+static bool is_undef_symbol(symbol_section_accessor &symbols, uint32_t sym_index)
+{
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
+    return symbols.get_symbol(sym_index, name, value, size, bind, type, section_index, other)
+        && section_index == SHN_UNDEF && name != "_GLOBAL_OFFSET_TABLE_";
+}
+
+/* undefined symbols a lazy module only calls, their address is never
+   taken so they can stay unbound until the first call */
+static std::unordered_set<uint32_t> lazy_symbols(Module &mod)
+{
+    elfio &elf = mod.get_elf();
+    uint32_t sec_num = elf.sections.size();
+    std::unordered_set<uint32_t> called, other;
+
+    Elf64_Addr offset;
+    Elf_Word   symbol_index;
+    unsigned   rel_type;
+    Elf_Sxword addend;
+
+    for (uint32_t i = 0; i < sec_num; i++) {
+        auto sec = elf.sections[i];
+        if (sec->get_type() != SHT_RELA || sec->get_info() >= sec_num
+            || !(elf.sections[sec->get_info()]->get_flags() & SHF_ALLOC)) {
+            continue;
+        }
+        const_relocation_section_accessor relsec(elf, sec);
+        symbol_section_accessor symbols(elf, elf.sections[sec->get_link()]);
+        for (uint32_t j = 0; j < relsec.get_entries_num(); j++) {
+            if (!relsec.get_entry(j, offset, symbol_index, rel_type, addend)
+                || !is_undef_symbol(symbols, symbol_index)) {
+                continue;
+            }
+            if (reloc_class(rel_type) == RELOC_CLASS_PLAIN && reloc_is_call(rel_type)) {
+                called.insert(symbol_index);
+            } else {
+                other.insert(symbol_index);
+            }
+        }
+    }
+    for (uint32_t sym_index : other) {
+        called.erase(sym_index);
+    }
+    return called;
+}
+
+/* Count the slots before layout so the GOT can be placed in the image */
+uint32_t scan_got(Module &mod)
+{
+    elfio &elf = mod.get_elf();
+    uint32_t sec_num = elf.sections.size();
+    auto &got = mod.get_got();
+    uint64_t size = 0;
+
+    Elf64_Addr offset;
+    Elf_Word   symbol_index;
+    unsigned   rel_type;
+    Elf_Sxword addend;
+
+    auto &plt = mod.get_plt();
+    std::unordered_set<uint32_t> lazy;
+    uint64_t plt_start = 0;
+    if (mod.lazy) {
+        lazy = lazy_symbols(mod);
+        plt_start = lazy.empty() ? 0 : LAZY_PLT_HEADER_SIZE;
+    }
+
+    for (uint32_t i = 0; i < sec_num; i++) {
+        auto sec = elf.sections[i];
+        if (sec->get_type() != SHT_RELA || sec->get_info() >= sec_num) {
+            continue;
+        }
+        auto target_flags = elf.sections[sec->get_info()]->get_flags();
+        if (!(target_flags & SHF_ALLOC)) {
+            continue;
+        }
+        const_relocation_section_accessor relsec(elf, sec);
+        /* symbols are not laid out yet, take the table from the link */
+        symbol_section_accessor symbols(elf, elf.sections[sec->get_link()]);
+        auto reloc_num = relsec.get_entries_num();
+        for (uint32_t j = 0; j < reloc_num; j++) {
+            if (!relsec.get_entry(j, offset, symbol_index, rel_type, addend)) {
+                continue;
+            }
+            int cls = reloc_class(rel_type);
+            if (mod.instanced && cls > RELOC_CLASS_GOT) {
+                log_error("got: %s uses TLS, it cannot have instances\n", mod.get_obj_path());
+                return -1;
+            }
+            /* calls out of the shared text of instances go through a PLT
+               entry, the slot it jumps through is private */
+            if (mod.instanced && cls == RELOC_CLASS_PLAIN && reloc_is_call(rel_type)
+                && !(target_flags & SHF_WRITE) && plt.find(symbol_index) == plt.end()
+                && is_undef_symbol(symbols, symbol_index)) {
+                plt.emplace(symbol_index, plt.size() * PLT_ENTRY_SIZE);
+                cls = RELOC_CLASS_GOT;
+            }
+            /* calls to imports get an entry too, taken when the target
+               is out of reach, like libc seen from a PIE host */
+            if (!mod.instanced && !mod.lazy && cls == RELOC_CLASS_PLAIN && reloc_is_call(rel_type)
+                && is_undef_symbol(symbols, symbol_index)) {
+                if (plt.find(symbol_index) == plt.end()) {
+                    plt.emplace(symbol_index, plt.size() * PLT_ENTRY_SIZE);
+                }
+                cls = RELOC_CLASS_GOT;
+            }
+            if (lazy.count(symbol_index)) {
+                if (plt.find(symbol_index) == plt.end()) {
+                    plt.emplace(symbol_index, plt_start + plt.size() * PLT_ENTRY_SIZE);
+                }
+                cls = RELOC_CLASS_GOT;
+            }
+            if (cls < RELOC_CLASS_GOT) {
+                continue;
+            }
+            /* one local-dynamic pair serves the whole module */
+            uint64_t key = got_key(cls == RELOC_CLASS_GOT_TLSLD ? 0 : symbol_index, cls);
+            if (got.find(key) != got.end()) {
+                continue;
+            }
+            got.emplace(key, size);
+            size += got_slot_size(cls);
+        }
+    }
+    mod.get_layout().got_size = size;
+    mod.get_layout().plt_size = plt.empty() ? 0 : plt_start + plt.size() * PLT_ENTRY_SIZE;
+    if (size) {
+        log_debug("got scan: %ld slots, size 0x%lx for %s\n", got.size(), size, mod.get_obj_path());
+    }
+    return 0;
+}
+
+uint64_t got_slot_addr(Module &mod, uint32_t sym_index, int reloc_cls)
+{
+    auto &got = mod.get_got();
+    auto iter = got.find(got_key(reloc_cls == RELOC_CLASS_GOT_TLSLD ? 0 : sym_index, reloc_cls));
+    if (iter == got.end()) {
+        return 0;
+    }
+    auto &layout = mod.get_layout();
+    return (uint64_t)layout.base + layout.got_offset + iter->second;
+}
+
+static void set_slot(Module &mod, uint64_t *entry, uint64_t value)
+{
+    auto &layout = mod.get_layout();
+    entry[0] = value;
+    if (mod.instanced) {
+        uint64_t off = (uint64_t)entry - (uint64_t)layout.base;
+        mod.get_replay().push_back({off, value, 0, value - (uint64_t)layout.base < layout.total_size, true});
+    }
+}
+
+/* Fill the slots once the symbol values are final */
+uint32_t fill_got(Module &mod)
+{
+    auto &got = mod.get_got();
+    if (got.empty()) {
+        return 0;
+    }
+    elfio &elf = mod.get_elf();
+    symbol_section_accessor symbols(elf, elf.sections[mod.sym_sec_index]);
+    auto &layout = mod.get_layout();
+
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
+
+    for (auto &slot : got) {
+        uint32_t sym_index = slot.first >> 8;
+        int cls = slot.first & 0xff;
+        uint64_t *entry = (uint64_t *)((char *)layout.base + layout.got_offset + slot.second);
+
+        value = 0;
+        if (cls != RELOC_CLASS_GOT_TLSLD
+            && !symbols.get_symbol(sym_index, name, value, size, bind, type, section_index, other)) {
+            log_error("got: bad symbol index %u in %s\n", sym_index, mod.get_obj_path());
+            continue;
+        }
+        switch (cls) {
+        case RELOC_CLASS_GOT:
+        case RELOC_CLASS_GOT_TPOFF:
+            set_slot(mod, entry, value);
+            break;
+        case RELOC_CLASS_GOT_TLSGD: {
+            uint32_t id = tls_find_module(value);
+            if (id == 0) {
+                log_error("got: no TLS block holds symbol '%s'\n", name.c_str());
+            }
+            entry[0] = id;
+            entry[1] = value - tls_block_tpoff(id);
+            break;
+        }
+        case RELOC_CLASS_GOT_TLSLD:
+            entry[0] = layout.tls_id;
+            entry[1] = 0;
+            break;
+        case RELOC_CLASS_GOT_TLSDESC:
+            entry[0] = (uint64_t)umko_tlsdesc_return;
+            entry[1] = value;
+            break;
+        }
+    }
+    return 0;
+}
+
+void fill_got_symbol(Module &mod, uint32_t sym_index, uint64_t value)
+{
+    uint64_t slot = got_slot_addr(mod, sym_index, RELOC_CLASS_GOT);
+    if (slot) {
+        set_slot(mod, (uint64_t *)slot, value);
+    }
+}
+
+/* PLT entries, of an instance template, a lazy module or for the far
+   imports, once the GOT is filled */
+void fill_plt(Module &mod)
+{
+    auto &layout = mod.get_layout();
+    char *plt = (char *)layout.base + layout.plt_offset;
+    if (mod.lazy && !mod.get_plt().empty()) {
+        arch_lazy_plt_header(plt, (uint64_t)&mod);
+    }
+    for (auto &entry : mod.get_plt()) {
+        char *addr = plt + entry.second;
+        uint64_t slot = got_slot_addr(mod, entry.first, RELOC_CLASS_GOT);
+        if (!mod.lazy) {
+            arch_plt_entry(addr, slot);
+            continue;
+        }
+        uint64_t first = arch_lazy_plt_entry(addr, slot, (uint64_t)plt, (uint64_t)layout.base);
+        /* names the loader binds itself, like the heap, keep their slot */
+        if (mod.get_lazy_slots().count(slot - (uint64_t)layout.base)) {
+            *(uint64_t *)slot = first;
+        }
+    }
+    if (!mod.get_lazy_slots().empty()) {
+        log_info("lazy: %zu of %zu calls bound on first use in %s\n", mod.get_lazy_slots().size(),
+            mod.get_plt().size(), mod.get_obj_path());
+    }
+}
@@ -0,0 +1,463 @@
+#include "heap.h"
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include "umko_heap.h"
+#include "module.h"
+#include "reloc.h"
+#include "logger.h"
+
+#define HEAP_CLASS_MAX 16384
+#define HEAP_HEADER 64
+
+struct HeapArena;
+
+/* at the start of every span, a large object takes a run of spans */
+struct HeapSpan {
+    HeapArena *arena;
+    uint32_t cls;           /* UMKO_HEAP_CLASSES for a large object */
+    uint32_t spans;
+    char *bump;             /* next object never handed out */
+    HeapSpan *prev;
+    HeapSpan *next;
+};
+
+struct Heap;
+
+struct HeapArena {
+    Heap *heap;
+    void *free[UMKO_HEAP_CLASSES];
+    void *remote;           /* freed by other threads, next in the object */
+    HeapSpan *current[UMKO_HEAP_CLASSES];
+    HeapSpan *spans;
+    uint64_t used;
+    uint64_t mapped;
+    bool orphan;
+    HeapArena *next;
+};
+
+struct Heap {
+    uint32_t id;
+    uint64_t gen;
+    std::string name;
+    HeapArena *arenas;
+    char *stubs;
+    uint64_t fallback_num;
+};
+
+struct HeapSlot {
+    uint64_t gen;
+    HeapArena *arena;
+};
+
+/* heaps, arenas and spans are created and released under heap_lock */
+static std::mutex heap_lock;
+static Heap *heaps[HEAP_MAX];
+static uint64_t heap_gen;
+static char *span_base;
+static char *span_top;
+static std::multimap<uint32_t, char *> span_free;
+static thread_local HeapSlot heap_slots[HEAP_MAX] __attribute__((tls_model("initial-exec")));
+
+static inline uint32_t size_class(uint64_t size)
+{
+    if (size <= 128) {
+        return size ? (size - 1) >> 4 : 0;
+    }
+    uint64_t s = size - 1;
+    uint32_t shift = 63 - __builtin_clzl(s);
+    return 8 + (shift - 7) * 4 + ((s >> (shift - 2)) & 3);
+}
+
+static inline uint64_t class_size(uint32_t cls)
+{
+    if (cls < 8) {
+        return (cls + 1) * 16;
+    }
+    uint32_t group = (cls - 8) / 4 + 1;
+    return (1UL << (group + 6)) + ((cls - 8) % 4 + 1) * (1UL << (group + 4));
+}
+
+static inline bool in_reserve(const void *p)
+{
+    return span_base && (uint64_t)((const char *)p - span_base) < HEAP_RESERVE;
+}
+
+static inline HeapSpan *span_of(const void *p)
+{
+    return (HeapSpan *)((uint64_t)p & ~(HEAP_SPAN_SIZE - 1));
+}
+
+static inline void set_counter(uint64_t &counter, uint64_t value)
+{
+    __atomic_store_n(&counter, value, __ATOMIC_RELAXED);
+}
+
+/* a run of n spans, under heap_lock */
+static HeapSpan *span_alloc(uint32_t n)
+{
+    if (span_base == nullptr) {
+        void *p = mmap(nullptr, HEAP_RESERVE + HEAP_SPAN_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            return nullptr;
+        }
+        span_base = (char *)(((uint64_t)p + HEAP_SPAN_SIZE - 1) & ~(HEAP_SPAN_SIZE - 1));
+        span_top = span_base;
+    }
+    char *run = nullptr;
+    auto iter = span_free.lower_bound(n);
+    if (iter != span_free.end()) {
+        run = iter->second;
+        if (iter->first > n) {
+            span_free.emplace(iter->first - n, run + ((uint64_t)n << HEAP_SPAN_SHIFT));
+        }
+        span_free.erase(iter);
+    } else if ((uint64_t)(span_top - span_base) + ((uint64_t)n << HEAP_SPAN_SHIFT) <= HEAP_RESERVE) {
+        run = span_top;
+        span_top += (uint64_t)n << HEAP_SPAN_SHIFT;
+    }
+    return (HeapSpan *)run;
+}
+
+/* give the pages back, the range stays reserved for later spans */
+static void span_release(HeapSpan *span)
+{
+    uint32_t n = span->spans;
+    madvise(span, (uint64_t)n << HEAP_SPAN_SHIFT, MADV_DONTNEED);
+    span_free.emplace(n, (char *)span);
+}
+
+static HeapSpan *span_take(HeapArena *a, uint32_t cls, uint32_t n)
+{
+    std::lock_guard<std::mutex> guard(heap_lock);
+    HeapSpan *span = span_alloc(n);
+    if (span == nullptr) {
+        return nullptr;
+    }
+    span->arena = a;
+    span->cls = cls;
+    span->spans = n;
+    span->bump = (char *)span + HEAP_HEADER;
+    span->prev = nullptr;
+    span->next = a->spans;
+    if (a->spans) {
+        a->spans->prev = span;
+    }
+    a->spans = span;
+    set_counter(a->mapped, a->mapped + ((uint64_t)n << HEAP_SPAN_SHIFT));
+    return span;
+}
+
+static void span_drop(HeapArena *a, HeapSpan *span)
+{
+    std::lock_guard<std::mutex> guard(heap_lock);
+    if (span->prev) {
+        span->prev->next = span->next;
+    } else {
+        a->spans = span->next;
+    }
+    if (span->next) {
+        span->next->prev = span->prev;
+    }
+    set_counter(a->mapped, a->mapped - ((uint64_t)span->spans << HEAP_SPAN_SHIFT));
+    span_release(span);
+}
+
+static void *fallback_alloc(HeapArena *a, uint64_t size)
+{
+    __atomic_fetch_add(&a->heap->fallback_num, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+/* the arena of this thread in heap, an orphan or a new one */
+static HeapArena *arena_attach(Heap *heap)
+{
+    std::lock_guard<std::mutex> guard(heap_lock);
+    HeapArena *a = heap->arenas;
+    while (a && !a->orphan) {
+        a = a->next;
+    }
+    if (a == nullptr) {
+        a = new HeapArena();
+        a->heap = heap;
+        a->next = heap->arenas;
+        heap->arenas = a;
+    }
+    a->orphan = false;
+    heap_slots[heap->id] = {heap->gen, a};
+
+    /* orphan the arenas of this thread when it exits */
+    static thread_local struct HeapThread {
+        ~HeapThread()
+        {
+            std::lock_guard<std::mutex> guard(heap_lock);
+            for (uint32_t id = 0; id < HEAP_MAX; id++) {
+                auto &slot = heap_slots[id];
+                if (slot.arena && heaps[id] && heaps[id]->gen == slot.gen) {
+                    slot.arena->orphan = true;
+                }
+                slot = {0, nullptr};
+            }
+        }
+    } heap_thread;
+    (void)heap_thread;
+    return a;
+}
+
+static inline HeapArena *heap_arena(Heap *heap)
+{
+    auto &slot = heap_slots[heap->id];
+    return slot.gen == heap->gen ? slot.arena : arena_attach(heap);
+}
+
+static inline bool is_local(HeapArena *a)
+{
+    auto &slot = heap_slots[a->heap->id];
+    return slot.arena == a && slot.gen == a->heap->gen;
+}
+
+static void local_free(HeapArena *a, void *p)
+{
+    HeapSpan *span = span_of(p);
+    if (span->cls == UMKO_HEAP_CLASSES) {
+        set_counter(a->used, a->used - (((uint64_t)span->spans << HEAP_SPAN_SHIFT) - HEAP_HEADER));
+        span_drop(a, span);
+        return;
+    }
+    *(void **)p = a->free[span->cls];
+    a->free[span->cls] = p;
+    set_counter(a->used, a->used - class_size(span->cls));
+}
+
+/* take over what other threads freed */
+static void drain_remote(HeapArena *a)
+{
+    void *p = __atomic_exchange_n(&a->remote, nullptr, __ATOMIC_ACQUIRE);
+    while (p) {
+        void *next = *(void **)p;
+        local_free(a, p);
+        p = next;
+    }
+}
+
+static void *class_refill(HeapArena *a, uint32_t cls)
+{
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED)) {
+        drain_remote(a);
+        void *p = a->free[cls];
+        if (p) {
+            a->free[cls] = *(void **)p;
+            set_counter(a->used, a->used + class_size(cls));
+            return p;
+        }
+    }
+    uint64_t size = class_size(cls);
+    HeapSpan *span = a->current[cls];
+    if (span == nullptr || span->bump + size > (char *)span + HEAP_SPAN_SIZE) {
+        span = span_take(a, cls, 1);
+        if (span == nullptr) {
+            return fallback_alloc(a, size);
+        }
+        a->current[cls] = span;
+    }
+    void *p = span->bump;
+    span->bump += size;
+    set_counter(a->used, a->used + size);
+    return p;
+}
+
+static inline void *class_alloc(HeapArena *a, uint32_t cls)
+{
+    void *p = a->free[cls];
+    if (p == nullptr) {
+        return class_refill(a, cls);
+    }
+    a->free[cls] = *(void **)p;
+    set_counter(a->used, a->used + class_size(cls));
+    return p;
+}
+
+static void *large_alloc(HeapArena *a, uint64_t size)
+{
+    uint32_t n = (size + HEAP_HEADER + HEAP_SPAN_SIZE - 1) >> HEAP_SPAN_SHIFT;
+    HeapSpan *span = span_take(a, UMKO_HEAP_CLASSES, n);
+    if (span == nullptr) {
+        return fallback_alloc(a, size);
+    }
+    set_counter(a->used, a->used + ((uint64_t)n << HEAP_SPAN_SHIFT) - HEAP_HEADER);
+    return (char *)span + HEAP_HEADER;
+}
+
+/* the stubs of a module pass its heap as the last argument */
+static void *heap_alloc(size_t size, Heap *heap)
+{
+    HeapArena *a = heap_arena(heap);
+    if (size > HEAP_CLASS_MAX) {
+        return large_alloc(a, size);
+    }
+    return class_alloc(a, size_class(size));
+}
+
+static void *heap_alloc_class(unsigned cls, Heap *heap)
+{
+    HeapArena *a = heap_arena(heap);
+    return cls < UMKO_HEAP_CLASSES ? class_alloc(a, cls) : nullptr;
+}
+
+static void arena_clear(HeapArena *a)
+{
+    std::lock_guard<std::mutex> guard(heap_lock);
+    while (a->spans) {
+        HeapSpan *next = a->spans->next;
+        span_release(a->spans);
+        a->spans = next;
+    }
+    memset(a->free, 0, sizeof(a->free));
+    memset(a->current, 0, sizeof(a->current));
+    a->remote = nullptr;
+    set_counter(a->used, 0);
+    set_counter(a->mapped, 0);
+}
+
+static void heap_arena_reset(Heap *heap)
+{
+    arena_clear(heap_arena(heap));
+}
+
+extern "C" void umko_free(void *ptr)
+{
+    if (ptr == nullptr) {
+        return;
+    }
+    if (!in_reserve(ptr)) {
+        free(ptr);
+        return;
+    }
+    HeapArena *a = span_of(ptr)->arena;
+    if (is_local(a)) {
+        local_free(a, ptr);
+        return;
+    }
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+extern "C" unsigned umko_size_class(size_t size)
+{
+    return size > HEAP_CLASS_MAX ? UMKO_HEAP_CLASSES : size_class(size);
+}
+
+static Heap *heap_create(Module &mod)
+{
+    std::lock_guard<std::mutex> guard(heap_lock);
+    uint32_t id = 0;
+    while (id < HEAP_MAX && heaps[id]) {
+        id++;
+    }
+    if (id == HEAP_MAX) {
+        log_error("heap: more than %d module heaps\n", HEAP_MAX);
+        return nullptr;
+    }
+    /* near the modules, for their 32-bit calls */
+    void *stubs = mmap(module_area_hint(4096), 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stubs == MAP_FAILED) {
+        log_error("heap: cannot map the stubs of %s\n", mod.get_obj_path());
+        return nullptr;
+    }
+    Heap *heap = new Heap();
+    heap->id = id;
+    heap->gen = ++heap_gen;
+    heap->name = mod.get_obj_path();
+    heap->stubs = (char *)stubs;
+    arch_ctx_stub(heap->stubs, 1, (uint64_t)heap, (uint64_t)heap_alloc);
+    arch_ctx_stub(heap->stubs + HEAP_STUB_SIZE, 1, (uint64_t)heap, (uint64_t)heap_alloc_class);
+    arch_ctx_stub(heap->stubs + HEAP_STUB_SIZE * 2, 0, (uint64_t)heap, (uint64_t)heap_arena_reset);
+    mprotect(stubs, 4096, PROT_READ | PROT_EXEC);
+    __builtin___clear_cache(heap->stubs, heap->stubs + 4096);
+    heaps[id] = heap;
+    mod.heap = heap;
+    log_info("heap: %u for %s\n", id, mod.get_obj_path());
+    return heap;
+}
+
+uint32_t heap_bind(Module &mod, const std::string &name, uint64_t &addr)
+{
+    static const char *const stub_names[] = {"umko_alloc", "umko_alloc_class", "umko_arena_reset"};
+    if (name == "umko_free") {
+        addr = (uint64_t)umko_free;
+        return 0;
+    }
+    if (name == "umko_size_class") {
+        addr = (uint64_t)umko_size_class;
+        return 0;
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        if (name != stub_names[i]) {
+            continue;
+        }
+        Heap *heap = mod.heap ? mod.heap : heap_create(mod);
+        if (heap == nullptr) {
+            return -1;
+        }
+        addr = (uint64_t)heap->stubs + i * HEAP_STUB_SIZE;
+        return 0;
+    }
+    return -1;
+}
+
+bool heap_stats(Module &mod, HeapStats &stats)
+{
+    stats = HeapStats{};
+    Heap *heap = mod.heap;
+    if (heap == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(heap_lock);
+    for (HeapArena *a = heap->arenas; a; a = a->next) {
+        stats.used += __atomic_load_n(&a->used, __ATOMIC_RELAXED);
+        stats.mapped += __atomic_load_n(&a->mapped, __ATOMIC_RELAXED);
+        stats.arenas++;
+    }
+    stats.fallback_num = __atomic_load_n(&heap->fallback_num, __ATOMIC_RELAXED);
+    return true;
+}
+
+void heap_destroy(Module &mod)
+{
+    Heap *heap = mod.heap;
+    if (heap == nullptr) {
+        return;
+    }
+    HeapStats stats;
+    heap_stats(mod, stats);
+    log_info("heap: %s leaves 0x%lx bytes in use, 0x%lx mapped by %lu arenas, %lu fallback allocations\n",
+        heap->name.c_str(), stats.used, stats.mapped, stats.arenas, stats.fallback_num);
+
+    while (heap->arenas) {
+        HeapArena *a = heap->arenas;
+        heap->arenas = a->next;
+        arena_clear(a);
+        delete a;
+    }
+    std::lock_guard<std::mutex> guard(heap_lock);
+    heaps[heap->id] = nullptr;
+    munmap(heap->stubs, 4096);
+    delete heap;
+    mod.heap = nullptr;
+}
+
+bool heap_in_use()
+{
+    std::lock_guard<std::mutex> guard(heap_lock);
+    for (auto heap : heaps) {
+        if (heap) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,195 @@
+#include "imports.h"
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <sys/mman.h>
+#include "module.h"
+#include "logger.h"
+
+/* read by the trampolines, which reach them pc-relative */
+extern "C" {
+__attribute__((visibility("hidden"))) uint64_t umko_import_targets[IMPORT_MAX];
+__attribute__((visibility("hidden"))) uint64_t *umko_import_counts;
+__attribute__((visibility("hidden"))) uint32_t umko_import_sampling;
+__attribute__((visibility("hidden"))) uint64_t umko_import_sample_mask;
+}
+
+/* [IMPORT_CPU_SLOTS][IMPORT_MAX] each, a CPU only writes its own rows */
+static uint64_t *import_samples = nullptr;
+static uint64_t *import_ticks = nullptr;
+static char *import_stubs = nullptr;
+static uint64_t import_stubs_size = 0;
+static std::vector<std::string> import_names;
+static std::map<std::pair<std::string, uint64_t>, uint32_t> import_index;
+static std::vector<std::pair<uint64_t, uint64_t>> import_code;
+static bool import_on = false;
+
+static inline uint64_t import_slot(uint32_t cpu, uint64_t index)
+{
+    return ((uint64_t)(cpu % IMPORT_CPU_SLOTS) << IMPORT_MAX_SHIFT) | index;
+}
+
+/* a sampled call to import index, which umko_import_entry made at start,
+   has returned */
+extern "C" __attribute__((visibility("hidden")))
+void umko_import_leave(uint64_t index, uint64_t start)
+{
+    uint32_t cpu;
+    uint64_t now = arch_import_clock(&cpu);
+    uint64_t slot = import_slot(cpu, index);
+    __atomic_fetch_add(&import_samples[slot], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&import_ticks[slot], now - start, __ATOMIC_RELAXED);
+}
+
+static void import_dump()
+{
+    struct Line {
+        uint64_t calls;
+        uint64_t samples;
+        uint64_t ticks;
+        uint32_t index;
+    };
+    std::vector<Line> lines;
+    for (uint32_t i = 0; i < import_names.size(); i++) {
+        Line l = {0, 0, 0, i};
+        for (uint32_t cpu = 0; cpu < IMPORT_CPU_SLOTS; cpu++) {
+            uint64_t slot = import_slot(cpu, i);
+            l.calls += __atomic_load_n(&umko_import_counts[slot], __ATOMIC_RELAXED);
+            l.samples += __atomic_load_n(&import_samples[slot], __ATOMIC_RELAXED);
+            l.ticks += __atomic_load_n(&import_ticks[slot], __ATOMIC_RELAXED);
+        }
+        if (l.calls) {
+            lines.push_back(l);
+        }
+    }
+    std::sort(lines.begin(), lines.end(), [](const Line &a, const Line &b) { return a.calls > b.calls; });
+    fprintf(stderr, "umko host imports: %zu bound, %zu called\n", import_names.size(), lines.size());
+    fprintf(stderr, "%14s %10s %10s  %s\n", "calls", "sampled", "avg ticks", "name");
+    for (auto &l : lines) {
+        fprintf(stderr, "%14lu %10lu %10lu  %s\n", l.calls, l.samples,
+            l.samples ? l.ticks / l.samples : 0, import_names[l.index].c_str());
+    }
+}
+
+static void import_read_code()
+{
+    import_code.clear();
+    FILE *fp = fopen("/proc/self/maps", "r");
+    if (fp == nullptr) {
+        return;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        uint64_t start, end;
+        char perms[8];
+        if (sscanf(line, "%lx-%lx %7s", &start, &end, perms) == 3 && perms[2] == 'x') {
+            import_code.emplace_back(start, end);
+        }
+    }
+    fclose(fp);
+}
+
+/* only functions go through a stub, data of the host keeps its address */
+static bool import_is_code(uint64_t addr)
+{
+    for (int pass = 0; pass < 2; pass++) {
+        for (auto &r : import_code) {
+            if (addr >= r.first && addr < r.second) {
+                return true;
+            }
+        }
+        import_read_code();
+    }
+    return false;
+}
+
+uint32_t import_enable(int32_t sample_shift)
+{
+    if (!arch_import_supported()) {
+        log_error("imports: the trampolines are not supported on this cpu\n");
+        return -1;
+    }
+    if (!import_on) {
+        uint64_t table = (uint64_t)IMPORT_CPU_SLOTS * IMPORT_MAX * sizeof(uint64_t);
+        import_stubs_size = ((uint64_t)IMPORT_MAX * IMPORT_STUB_SIZE + 4095) & ~4095UL;
+        void *p = mmap(nullptr, table * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        /* near the modules, for their 32-bit calls */
+        void *s = mmap(module_area_hint(import_stubs_size), import_stubs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED || s == MAP_FAILED) {
+            log_error("imports: cannot map the counters\n");
+            if (p != MAP_FAILED) {
+                munmap(p, table * 3);
+            }
+            if (s != MAP_FAILED) {
+                munmap(s, import_stubs_size);
+            }
+            return -1;
+        }
+        umko_import_counts = (uint64_t *)p;
+        import_samples = (uint64_t *)((char *)p + table);
+        import_ticks = (uint64_t *)((char *)p + table * 2);
+        import_stubs = (char *)s;
+        /* a stub only depends on its index, write them all up front so
+           that binding never touches code other threads may run */
+        for (uint32_t i = 0; i < IMPORT_MAX; i++) {
+            arch_import_stub(import_stubs + (uint64_t)i * IMPORT_STUB_SIZE, i);
+        }
+        mprotect(s, import_stubs_size, PROT_READ | PROT_EXEC);
+        __builtin___clear_cache(import_stubs, import_stubs + import_stubs_size);
+        import_on = true;
+        atexit(import_dump);
+    }
+    if (sample_shift >= 0 && sample_shift < 64) {
+        umko_import_sample_mask = (1UL << sample_shift) - 1;
+        __atomic_store_n(&umko_import_sampling, 1, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&umko_import_sampling, 0, __ATOMIC_RELEASE);
+    }
+    log_info("imports: counting host calls, latency %s\n", umko_import_sampling ? "sampled" : "off");
+    return 0;
+}
+
+bool import_enabled()
+{
+    return import_on;
+}
+
+/* a timed call would return to a frame that is gone on the second
+   return, like the names gcc gives returns_twice */
+static bool import_returns_twice(const std::string &name)
+{
+    static const char *const names[] = {
+        "setjmp", "_setjmp", "sigsetjmp", "__sigsetjmp", "savectx", "vfork", "__vfork", "getcontext",
+    };
+    for (auto n : names) {
+        if (name == n) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t import_bind(const std::string &name, uint64_t target)
+{
+    if (!import_on || import_returns_twice(name) || !import_is_code(target)) {
+        return target;
+    }
+    auto key = std::make_pair(name, target);
+    auto iter = import_index.find(key);
+    if (iter != import_index.end()) {
+        return (uint64_t)import_stubs + (uint64_t)iter->second * IMPORT_STUB_SIZE;
+    }
+    uint32_t index = import_names.size();
+    if (index >= IMPORT_MAX) {
+        log_warn("imports: table full, '%s' is not counted\n", name.c_str());
+        return target;
+    }
+    char *stub = import_stubs + (uint64_t)index * IMPORT_STUB_SIZE;
+    umko_import_targets[index] = target;
+    import_names.push_back(name);
+    import_index.emplace(key, index);
+    log_debug("imports: [%u] %s at 0x%lx via 0x%lx\n", index, name.c_str(), target, (uint64_t)stub);
+    return (uint64_t)stub;
+}
@@ -0,0 +1,154 @@
+#include "initwatch.h"
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "addrindex.h"
+#include "crash.h"
+#include "trace.h"
+#include "logger.h"
+
+/* read without the lock by loading threads and the watchdog */
+static uint32_t init_slow_ms = INIT_SLOW_MS_DEFAULT;
+static uint32_t init_watchdog_ms = 0;
+static bool init_watchdog_running = false;
+static struct sigaction init_old_action;
+
+/* the constructor being watched, under init_watch_lock; start is 0 when
+   none is */
+static std::mutex init_watch_lock;
+static uint64_t init_watch_start;
+static pid_t init_watch_tid;
+static const std::string *init_watch_name;
+static const char *init_watch_path;
+static bool init_watch_sampled;
+
+/* filled by the signal handler on the loading thread */
+static uint64_t init_sample_pcs[INIT_WATCH_DEPTH];
+static uint32_t init_sample_depth;
+static uint32_t init_sample_ready;
+/* set by the watchdog before its signal */
+static uint32_t init_sample_wanted;
+
+/* A SIGURG is ours when the watchdog asked for it and sent it from this
+   process, any other goes on to the action the host had installed. */
+static void init_sample_handler(int sig, siginfo_t *info, void *ctx)
+{
+    if (info->si_code == SI_TKILL && info->si_pid == getpid() &&
+        __atomic_exchange_n(&init_sample_wanted, 0, __ATOMIC_ACQ_REL)) {
+        init_sample_depth = context_frames(ctx, init_sample_pcs, INIT_WATCH_DEPTH);
+        __atomic_store_n(&init_sample_ready, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    if (init_old_action.sa_flags & SA_SIGINFO) {
+        init_old_action.sa_sigaction(sig, info, ctx);
+    } else if (init_old_action.sa_handler != SIG_DFL && init_old_action.sa_handler != SIG_IGN) {
+        init_old_action.sa_handler(sig);
+    }
+}
+
+static void init_log_sample(uint64_t ms)
+{
+    log_warn("constructor %s of %s is running for %lu ms:\n", init_watch_name->c_str(), init_watch_path, ms);
+    for (uint32_t i = 0; i < init_sample_depth; i++) {
+        AddrInfo info;
+        uint64_t pc = init_sample_pcs[i];
+        if (addr_index_lookup(i ? pc - 1 : pc, info)) {
+            log_warn("  #%u 0x%lx %s`%s+0x%lx\n", i, pc, info.mod_name,
+                info.sym_name, info.offset + (i ? 1 : 0));
+        } else {
+            log_warn("  #%u 0x%lx [host]\n", i, pc);
+        }
+    }
+}
+
+static void init_watchdog()
+{
+    for (;;) {
+        uint32_t watchdog_ms = __atomic_load_n(&init_watchdog_ms, __ATOMIC_RELAXED);
+        uint32_t period = std::max(1U, std::min(watchdog_ms / 4, 100U));
+        usleep(period * 1000);
+
+        std::lock_guard<std::mutex> guard(init_watch_lock);
+        if (init_watch_start == 0 || init_watch_sampled) {
+            continue;
+        }
+        uint64_t ms = (trace_now() - init_watch_start) / 1000000;
+        if (watchdog_ms == 0 || ms < watchdog_ms) {
+            continue;
+        }
+        init_watch_sampled = true;
+        __atomic_store_n(&init_sample_ready, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&init_sample_wanted, 1, __ATOMIC_RELEASE);
+        if (syscall(SYS_tgkill, getpid(), init_watch_tid, SIGURG) != 0) {
+            __atomic_store_n(&init_sample_wanted, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        for (int i = 0; i < 100 && !__atomic_load_n(&init_sample_ready, __ATOMIC_ACQUIRE); i++) {
+            usleep(1000);
+        }
+        if (__atomic_load_n(&init_sample_ready, __ATOMIC_ACQUIRE)) {
+            init_log_sample(ms);
+        }
+    }
+}
+
+void init_watch_config(uint32_t slow_ms, uint32_t watchdog_ms)
+{
+    std::lock_guard<std::mutex> guard(init_watch_lock);
+    __atomic_store_n(&init_slow_ms, slow_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&init_watchdog_ms, watchdog_ms, __ATOMIC_RELAXED);
+    if (watchdog_ms == 0 || init_watchdog_running) {
+        return;
+    }
+    /* SIGURG is ignored by default, the handler only reads the stack and
+       chains to the previous action */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = init_sample_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGURG, &sa, &init_old_action);
+    std::thread(init_watchdog).detach();
+    init_watchdog_running = true;
+}
+
+uint64_t init_watch_begin(const std::string &name, const char *path)
+{
+    uint64_t start = trace_now();
+    if (__atomic_load_n(&init_watchdog_ms, __ATOMIC_RELAXED) == 0) {
+        return start;
+    }
+    std::lock_guard<std::mutex> guard(init_watch_lock);
+    /* a constructor loading modules is watched as a whole */
+    if (init_watch_start == 0) {
+        init_watch_start = start;
+        init_watch_tid = syscall(SYS_gettid);
+        init_watch_name = &name;
+        init_watch_path = path;
+        init_watch_sampled = false;
+    }
+    return start;
+}
+
+void init_watch_end(const std::string &name, const char *path, uint64_t start)
+{
+    uint64_t us = (trace_now() - start) / 1000;
+    {
+        /* the watchdog may have been turned off since begin */
+        std::lock_guard<std::mutex> guard(init_watch_lock);
+        if (init_watch_name == &name) {
+            init_watch_start = 0;
+            init_watch_name = nullptr;
+        }
+    }
+    if (us >= (uint64_t)__atomic_load_n(&init_slow_ms, __ATOMIC_RELAXED) * 1000) {
+        log_warn("slow constructor %s of %s: %lu.%03lu ms\n", name.c_str(), path, us / 1000, us % 1000);
+    } else {
+        log_debug("constructor %s of %s: %lu us\n", name.c_str(), path, us);
+    }
+}
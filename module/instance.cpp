@@ -0,0 +1,138 @@
+#include "instance.h"
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "module.h"
+#include "reloc.h"
+#include "addrindex.h"
+#include "logger.h"
+
+static inline bool in_image(Layout &layout, uint64_t addr)
+{
+    return addr - (uint64_t)layout.base < layout.total_size;
+}
+
+uint32_t instance_map_shared(Module &tmpl)
+{
+    auto &layout = tmpl.get_layout();
+    if (layout.ro_size == 0) {
+        return 0;
+    }
+    std::string name = std::string("umko-inst:") + tmpl.get_obj_path();
+    int fd = memfd_create(name.c_str(), MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, layout.ro_size) != 0) {
+        log_error("instance: cannot create memfd for %s\n", tmpl.get_obj_path());
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (mmap(layout.base, layout.ro_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        log_error("instance: cannot map memfd for %s\n", tmpl.get_obj_path());
+        close(fd);
+        return -1;
+    }
+    tmpl.memfd = fd;
+    return 0;
+}
+
+int instance_check_reloc(Module &tmpl, void *loc, uint32_t type, uint32_t sym_index, uint64_t &val, int64_t addend)
+{
+    auto &layout = tmpl.get_layout();
+    uint64_t offset = (uint64_t)loc - (uint64_t)layout.base;
+    bool internal = in_image(layout, val - addend);
+
+    if (offset >= layout.ro_size) {
+        tmpl.get_replay().push_back({offset, val, type, internal, false});
+        return 0;
+    }
+    auto &plt = tmpl.get_plt();
+    auto iter = plt.find(sym_index);
+    if (iter != plt.end() && reloc_is_call(type)) {
+        val = (uint64_t)layout.base + layout.plt_offset + iter->second + addend;
+        return 0;
+    }
+    int kind = reloc_addr_kind(type);
+    if ((kind == RELOC_ADDR_ABS && internal) || (kind == RELOC_ADDR_PCREL && !internal)) {
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t instance_create(Module &tmpl, Instance &inst)
+{
+    auto &layout = tmpl.get_layout();
+    uint64_t priv_size = layout.total_size - layout.ro_size;
+
+    char *base = (char *)mmap(module_area_hint(layout.total_size), layout.total_size, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        log_error("instance: mmap fail %ld\n", layout.total_size);
+        return -1;
+    }
+    if ((layout.ro_size && mmap(base, layout.ro_size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED,
+            tmpl.memfd, 0) == MAP_FAILED)
+        || (priv_size && mmap(base + layout.ro_size, priv_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)) {
+        log_error("instance: cannot map an instance of %s\n", tmpl.get_obj_path());
+        munmap(base, layout.total_size);
+        return -1;
+    }
+
+    int64_t delta = base - (char *)layout.base;
+    auto &pristine = tmpl.get_pristine();
+    memcpy(base + layout.ro_size, pristine.data(), pristine.size());
+    for (auto &r : tmpl.get_replay()) {
+        void *loc = base + r.offset;
+        uint64_t val = r.val + (r.internal ? delta : 0);
+        if (r.word) {
+            *(uint64_t *)loc = val;
+        } else {
+            do_relocate_add(r.type, loc, val);
+        }
+    }
+    if (layout.ro_after_init_size > layout.ro_size) {
+        mprotect(base + layout.ro_size, layout.ro_after_init_size - layout.ro_size, PROT_READ | PROT_EXEC);
+    }
+    log_info("instance of %s at [%p], private 0x%lx bytes, %zu relocations replayed\n",
+        tmpl.get_obj_path(), base, priv_size, tmpl.get_replay().size());
+
+    inst.tmpl = &tmpl;
+    inst.base = base;
+    inst.constructed = false;
+    tmpl.refcnt++;
+    cxa_add_module(base);
+    addr_index_add(tmpl, &inst, delta);
+
+    mod_init_and_construct(tmpl, delta);
+    inst.constructed = true;
+    return 0;
+}
+
+uint32_t instance_destroy(Instance &inst)
+{
+    auto &tmpl = *inst.tmpl;
+    auto &layout = tmpl.get_layout();
+    int64_t delta = inst.base - (char *)layout.base;
+    if (inst.constructed) {
+        mod_fini_and_destruct(tmpl, delta);
+        inst.constructed = false;
+    }
+    addr_index_remove(&inst);
+    cxa_remove_module(inst.base);
+    munmap(inst.base, layout.total_size);
+    log_info("instance of %s at [%p] destroyed\n", tmpl.get_obj_path(), inst.base);
+    inst.base = nullptr;
+    tmpl.refcnt--;
+    return 0;
+}
+
+uint64_t instance_sym(Instance &inst, const std::string &name)
+{
+    auto &layout = inst.tmpl->get_layout();
+    const ExportSym *sym = inst.tmpl->find_export(name);
+    if (sym == nullptr) {
+        return 0;
+    }
+    return sym->addr + (in_image(layout, sym->addr) ? inst.base - (char *)layout.base : 0);
+}
@@ -0,0 +1,87 @@
+#include "lazy.h"
+#include <cstdio>
+#include <cstdlib>
+#include "module.h"
+#include "defer.h"
+#include "logger.h"
+
+using namespace ELFIO;
+
+static SysEnv *lazy_env = nullptr;
+static std::recursive_mutex *lazy_lock = nullptr;
+static bool lazy_on = false;
+static uint64_t lazy_binds = 0;
+
+void lazy_enable(SysEnv &env, std::recursive_mutex &lock, bool on)
+{
+    lazy_env = &env;
+    lazy_lock = &lock;
+    lazy_on = on;
+    log_info("lazy: calls to undefined functions are bound %s\n", on ? "on first use" : "at load");
+}
+
+bool lazy_enabled()
+{
+    return lazy_on;
+}
+
+uint64_t lazy_bind_num()
+{
+    return __atomic_load_n(&lazy_binds, __ATOMIC_RELAXED);
+}
+
+/* like a symbol lookup error of ld.so, the log goes through stdio */
+static void lazy_fail()
+{
+    fflush(nullptr);
+    abort();
+}
+
+extern "C" uint64_t umko_lazy_resolve(Module *mod, uint64_t slot)
+{
+    if ((uint64_t)mod & DEFER_CTX_TAG) {
+        return defer_resolve(*(Module *)((uint64_t)mod & ~DEFER_CTX_TAG), slot);
+    }
+    std::lock_guard<std::recursive_mutex> guard(*lazy_lock);
+    auto &layout = mod->get_layout();
+    uint64_t offset = slot < layout.total_size ? slot : slot - (uint64_t)layout.base;
+    uint64_t *entry = (uint64_t *)((char *)layout.base + offset);
+
+    auto &slots = mod->get_lazy_slots();
+    auto iter = slots.find(offset);
+    if (iter == slots.end()) {
+        log_fatal("lazy: no symbol for GOT slot 0x%lx in %s\n", offset, mod->get_obj_path());
+        lazy_fail();
+    }
+    /* another thread got here first */
+    if (iter->second == ~0U) {
+        return *entry;
+    }
+    elfio &elf = mod->get_elf();
+    symbol_section_accessor symbols(elf, elf.sections[mod->sym_sec_index]);
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
+    if (!symbols.get_symbol(iter->second, name, value, size, bind, type, section_index, other)) {
+        log_fatal("lazy: cannot read symbol %u of %s\n", iter->second, mod->get_obj_path());
+        lazy_fail();
+    }
+
+    uint64_t addr;
+    Module *owner = nullptr;
+    if (module_find_import(*lazy_env, name, addr, &owner) != 0) {
+        log_fatal("lazy: undefined symbol '%s' in %s\n", name.c_str(), mod->get_obj_path());
+        lazy_fail();
+    }
+    module_add_dep(*mod, owner);
+    symbols.update_symbol(iter->second, addr, size, bind, type, section_index, other);
+    __atomic_store_n(entry, addr, __ATOMIC_RELEASE);
+    iter->second = ~0U;
+    __atomic_fetch_add(&lazy_binds, 1, __ATOMIC_RELAXED);
+    log_debug("lazy: '%s' bound to 0x%lx in %s\n", name.c_str(), addr, mod->get_obj_path());
+    return addr;
+}
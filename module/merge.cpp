@@ -0,0 +1,217 @@
+#include "merge.h"
+#include <cstring>
+#include <algorithm>
+#include <sys/mman.h>
+#include "module.h"
+#include "logger.h"
+
+using namespace ELFIO;
+
+constexpr uint64_t MERGE_CHUNK_SIZE = 64 * 1024;
+constexpr uint64_t MERGE_MIN_SLOTS = 1024;
+constexpr uint64_t MERGE_HASH_MUL = 0x517cc1b727220a95ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* word-at-a-time multiplicative hash, entries are short so keep it cheap */
+uint64_t merge_hash(const void *data, uint64_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h = size * 0x9e3779b97f4a7c15ULL;
+    uint64_t w;
+
+    while (size >= 8) {
+        memcpy(&w, p, 8);
+        h = (rotl64(h, 5) ^ w) * MERGE_HASH_MUL;
+        p += 8;
+        size -= 8;
+    }
+    if (size) {
+        w = 0;
+        memcpy(&w, p, size);
+        h = (rotl64(h, 5) ^ w) * MERGE_HASH_MUL;
+    }
+    return h ^ (h >> 32);
+}
+
+MergePool &MergePool::GetInstance()
+{
+    static MergePool pool;
+    return pool;
+}
+
+char *MergePool::alloc(uint64_t size, uint64_t align)
+{
+    if (!chunks.empty()) {
+        auto &c = chunks.back();
+        uint64_t start = ((uint64_t)c.base + c.used + align - 1) & ~(align - 1);
+        if (start + size <= (uint64_t)c.base + c.size) {
+            if (!c.writable) {
+                mprotect(c.base, c.size, PROT_READ | PROT_WRITE);
+                c.writable = true;
+            }
+            c.used = start + size - (uint64_t)c.base;
+            return (char *)start;
+        }
+    }
+    uint64_t chunk_size = std::max(MERGE_CHUNK_SIZE, (size + align + 4095) & ~4095UL);
+    void *p = mmap(module_area_hint(chunk_size), chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        log_fatal("merge pool:mmap fail %ld\n", chunk_size);
+        return nullptr;
+    }
+    chunks.push_back({(char *)p, chunk_size, size, true});
+    /* mmap is page aligned, which satisfies any section alignment */
+    return (char *)p;
+}
+
+void MergePool::grow()
+{
+    uint64_t num = slots.empty() ? MERGE_MIN_SLOTS : slots.size() * 2;
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.assign(num, Slot{0, 0, 0});
+    for (auto &s : old) {
+        if (s.addr == 0) {
+            continue;
+        }
+        uint64_t i = s.hash & (num - 1);
+        while (slots[i].addr != 0) {
+            i = (i + 1) & (num - 1);
+        }
+        slots[i] = s;
+    }
+}
+
+uint64_t MergePool::intern(const void *data, uint64_t size, uint64_t align)
+{
+    if (align == 0) {
+        align = 1;
+    }
+    input_size += size;
+    if ((slot_used + 1) * 2 > slots.size()) {
+        grow();
+    }
+    uint64_t hash = merge_hash(data, size);
+    uint64_t mask = slots.size() - 1;
+    uint64_t i = hash & mask;
+    for (; slots[i].addr != 0; i = (i + 1) & mask) {
+        auto &s = slots[i];
+        if (s.hash == hash && s.size == size && (s.addr & (align - 1)) == 0
+            && memcmp((const void *)s.addr, data, size) == 0) {
+            return s.addr;
+        }
+    }
+    char *dest = alloc(size, align);
+    if (dest == nullptr) {
+        return 0;
+    }
+    memcpy(dest, data, size);
+    slots[i] = Slot{hash, (uint64_t)dest, size};
+    slot_used++;
+    pool_size += size;
+    return (uint64_t)dest;
+}
+
+void MergePool::seal()
+{
+    for (auto &c : chunks) {
+        if (c.writable) {
+            mprotect(c.base, c.size, PROT_READ);
+            c.writable = false;
+        }
+    }
+}
+
+/* A section can be merged when it is read-only data split into entries,
+   and nothing inside it needs relocating. */
+bool is_mergeable_section(Module &mod, uint32_t sec_idx)
+{
+    elfio &elf = mod.get_elf();
+    auto sec = elf.sections[sec_idx];
+    uint64_t sh_flag = sec->get_flags();
+    uint64_t entsize = sec->get_entry_size();
+
+    if ((sh_flag & (SHF_MERGE | SHF_ALLOC)) != (SHF_MERGE | SHF_ALLOC)
+        || (sh_flag & (SHF_WRITE | SHF_EXECINSTR | SHF_TLS))
+        || sec->get_type() != SHT_PROGBITS
+        || entsize == 0 || sec->get_size() == 0 || sec->get_size() % entsize != 0) {
+        return false;
+    }
+    for (auto &s : elf.sections) {
+        if (s->get_type() == SHT_RELA && s->get_info() == sec_idx) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Split one input section into entries: NUL terminated strings of
+   entsize wide characters for SHF_STRINGS, fixed size constants else. */
+static void merge_one_section(Module &mod, uint32_t sec_idx, MergePool &pool)
+{
+    auto sec = mod.get_elf().sections[sec_idx];
+    auto &entries = mod.get_sec()[sec_idx].merge;
+    const char *data = (const char *)sec->get_address();
+    uint64_t size = sec->get_size();
+    uint64_t entsize = sec->get_entry_size();
+    uint64_t align = sec->get_addr_align();
+    bool strings = sec->get_flags() & SHF_STRINGS;
+    static const char zero[16] = {0};
+
+    uint64_t off = 0;
+    while (off < size) {
+        uint64_t len = entsize;
+        if (strings) {
+            uint64_t end = off;
+            while (end < size && (entsize > sizeof(zero) || memcmp(data + end, zero, entsize) != 0)) {
+                end += entsize;
+            }
+            len = std::min(end + entsize, size) - off;
+        }
+        /* keep whatever alignment the entry had inside its section */
+        uint64_t entry_align = off ? std::min(align, off & -off) : align;
+        uint64_t addr = pool.intern(data + off, len, entry_align);
+        entries.push_back({off, addr});
+        off += len;
+    }
+}
+
+uint32_t merge_sections(Module &mod)
+{
+    auto &pool = MergePool::GetInstance();
+    auto &vsec = mod.get_sec();
+    uint32_t merged = 0;
+
+    for (uint32_t i = 0; i < vsec.size(); i++) {
+        if (!vsec[i].merged) {
+            continue;
+        }
+        merge_one_section(mod, i, pool);
+        log_debug("merge section [%2d] into pool, entries [%ld], name [%s]\n",
+            i, vsec[i].merge.size(), mod.get_elf().sections[i]->get_name().c_str());
+        merged++;
+    }
+    if (merged) {
+        pool.seal();
+        log_info("merge pool: input 0x%lx bytes, pooled 0x%lx bytes after %s\n",
+            pool.get_input_size(), pool.get_pool_size(), mod.get_obj_path());
+    }
+    return 0;
+}
+
+/* translate an offset inside a merged input section to its pool address */
+uint64_t merge_lookup(Module &mod, uint32_t sec_idx, uint64_t offset)
+{
+    auto &entries = mod.get_sec()[sec_idx].merge;
+    auto iter = std::upper_bound(entries.begin(), entries.end(), offset,
+        [](uint64_t off, const MergeEntry &e) { return off < e.offset; });
+    if (iter == entries.begin()) {
+        return 0;
+    }
+    --iter;
+    return iter->addr + (offset - iter->offset);
+}
@@ -1,6 +1,7 @@
 #include "module.h"
 #include <cstdint>
 #include <memory>
+#include <algorithm>
 #include <sstream>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -8,6 +9,19 @@
 #include <fcntl.h>
 #include "logger.h"
 #include "reloc.h"
+#include "got.h"
+#include "tls.h"
+#include "share.h"
+#include "perfmap.h"
+#include "addrindex.h"
+#include "imports.h"
+#include "trace.h"
+#include "initwatch.h"
+#include "instance.h"
+#include "bundle.h"
+#include "heap.h"
+#include "lazy.h"
+#include "defer.h"
 
 
 using namespace ELFIO;
@@ -44,41 +58,73 @@ static long get_offset(uint64_t sec_align, uint64_t sec_size,
 uint32_t load_reloc_elf(Module &mod)
 {
     const char *path = mod.get_obj_path();
-    const int fd = open(path, O_RDONLY);
+    void *p = (void *)mod.get_obj_buffer();
+    uint64_t size = mod.get_obj_size();
+    uint64_t map_size = 0;
 
-    if (fd < 0) {
-        log_fatal("cannot open file %s\n", path);
-        return -1;
+    if (p && bundle_is(p, size)) {
+        uint64_t offset;
+        if (bundle_select(p, size, path, offset, size) != 0) {
+            return -1;
+        }
+        p = (char *)p + offset;
+        mod.set_obj_buffer(p, size);
     }
+    if (p == nullptr) {
+        const int fd = open(path, O_RDONLY);
 
-    struct stat sb;
-    if (fstat(fd, &sb) < 0) {
-        close(fd);
-        log_fatal("load_reloc_elf:cannot stat file %s\n", path);
-        return -1;
-    }
+        if (fd < 0) {
+            log_fatal("cannot open file %s\n", path);
+            return -1;
+        }
+
+        struct stat sb;
+        if (fstat(fd, &sb) < 0) {
+            close(fd);
+            log_fatal("load_reloc_elf:cannot stat file %s\n", path);
+            return -1;
+        }
 
-    /* Get two distinct mappings to the same file -- first to be used for
-        writable sections, second -- for the read-only/exec sections; use
-        the first mapping for libelf purposes */
-    void *p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    close(fd);
+        /* Get two distinct mappings to the same file -- first to be used for
+            writable sections, second -- for the read-only/exec sections; use
+            the first mapping for libelf purposes */
+        p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        size = sb.st_size;
 
-    if(p == MAP_FAILED) {
-        log_fatal("load_reloc_elf:cannot mmap file for %s\n", path);
-        return -1;
+        /* of a bundle only the variant for this CPU is kept mapped */
+        if (p != MAP_FAILED && bundle_is(p, size)) {
+            uint64_t offset;
+            if (bundle_select(p, size, path, offset, size) != 0) {
+                munmap(p, sb.st_size);
+                close(fd);
+                return -1;
+            }
+            munmap(p, sb.st_size);
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+        }
+        close(fd);
+
+        if(p == MAP_FAILED) {
+            log_fatal("load_reloc_elf:cannot mmap file for %s\n", path);
+            return -1;
+        }
+        map_size = size;
     }
 
-    std::string elfbuf((char *)p, sb.st_size);
+    std::string elfbuf((char *)p, size);
     std::stringstream stream(elfbuf);
     elfio &elf = mod.get_elf();
 
     if (!elf.load(stream)) {
         log_fatal("load_reloc_elf:cannot load elf %s\n", path);
+        if (map_size) {
+            munmap(p, map_size);
+        }
         return -1;
     }
-    mod.set_elf_addr(p);
-    log_info("loading file at addr [%p], length [%ld], path [%s]\n", p, sb.st_size, path);
+    /* a buffer given by the caller is borrowed, not mapped by us */
+    mod.set_elf_addr(p, map_size);
+    log_info("loading file at addr [%p], length [%ld], path [%s]\n", p, size, path);
     return 0;
 }
 
@@ -117,6 +163,8 @@ static void layout_sections(Module &mod)
 
 	for (uint32_t i = 0; i < sec_num; i++){
         vsec[i].offset = ~0UL;
+        /* pooled entries would be outside the image of an instance */
+        vsec[i].merged = !mod.instanced && is_mergeable_section(mod, i);
     }
 
     auto &layout = mod.get_layout();
@@ -131,6 +179,8 @@ static void layout_sections(Module &mod)
 			if ((sh_flag & masks[m][0]) != masks[m][0]
 			    || (sh_flag & masks[m][1])
 			    || offset != ~0UL
+			    || vsec[i].merged
+			    || (sh_flag & SHF_TLS)
 			    ){
                     continue;
                 }
@@ -141,11 +191,18 @@ static void layout_sections(Module &mod)
 		}
 		switch (m) {
 		case 0: /* executable */
+			if (layout.plt_size) {
+				layout.plt_offset = get_offset(PLT_ENTRY_SIZE, layout.plt_size, layout.total_size);
+			}
 			layout.total_size = debug_align(layout.total_size);
 			layout.text_size = layout.total_size;
 			break;
 		case 1: /* RO: text and ro-data */
 			layout.total_size = debug_align(layout.total_size);
+			/* instances share this part, the rest is theirs */
+			if (mod.instanced) {
+				layout.total_size = align_as(layout.total_size, 4096);
+			}
 			layout.ro_size = layout.total_size;
 			break;
 		case 2: /* RO after init */ /* RO and RW split */
@@ -158,15 +215,101 @@ static void layout_sections(Module &mod)
 			break;
 		}
 	}
+
+	/* TLS sections get an offset in the module TLS block, only the .tdata
+	   initialization image takes room in the RW part, .tbss takes none */
+	for (uint32_t i = 0; i < sec_num; ++i) {
+		auto sec = elf.sections[i];
+		if (!(sec->get_flags() & SHF_TLS) || !(sec->get_flags() & SHF_ALLOC)) {
+			continue;
+		}
+		uint64_t sh_align = sec->get_addr_align();
+		vsec[i].tls_offset = get_offset(sh_align, sec->get_size(), layout.tls_size);
+		layout.tls_align = std::max(layout.tls_align, sh_align);
+		if (sec->get_type() != SHT_NOBITS) {
+			vsec[i].offset = get_offset(sh_align, sec->get_size(), layout.total_size);
+		}
+		log_debug("section [%2d] tls offset is 0x[%6lx] name [%s]\n", i, vsec[i].tls_offset, sec->get_name().c_str());
+	}
+
+	/* the GOT sized by scan_got goes last */
+	if (layout.got_size) {
+		layout.got_offset = get_offset(8, layout.got_size, layout.total_size);
+	}
+}
+
+
+/* Keep module images close to the host image, like the kernel keeps its
+   module area close to the kernel text, so that PC relative calls from
+   modules to host functions stay in range. */
+#if defined(__aarch64__)
+constexpr uint64_t MODULE_AREA_GAP = 64UL << 20;
+#else
+constexpr uint64_t MODULE_AREA_GAP = 1UL << 30;
+#endif
+extern "C" char _end[];
+
+static uint64_t module_area_next = 0;
+
+static inline uint64_t module_area_start()
+{
+    return ((uint64_t)_end + MODULE_AREA_GAP) & ~0xfffffUL;
+}
+
+void *module_area_hint(uint64_t size)
+{
+    if (module_area_next == 0) {
+        module_area_next = module_area_start();
+    }
+    uint64_t hint = module_area_next;
+    module_area_next += (size + 0xffff) & ~0xffffUL;
+    return (void *)hint;
 }
 
+/* the part of the area handed out so far */
+void module_area_range(uint64_t &start, uint64_t &end)
+{
+    start = module_area_start();
+    end = module_area_next ? module_area_next : start;
+}
+
+/* keep later hints clear of a range mapped by other means, a restore */
+void module_area_claim(uint64_t addr, uint64_t size)
+{
+    uint64_t end = (addr + size + 0xffff) & ~0xffffUL;
+    if (end > module_area_next) {
+        module_area_next = end;
+    }
+}
+
+/* copy the sections placed in [start, end) of the image */
+static void copy_sections(Module &mod, uint64_t start, uint64_t end)
+{
+    elfio &elf = mod.get_elf();
+    auto &vsec = mod.get_sec();
+    char *base = (char *)mod.get_layout().base;
+    char *src = (char *)mod.get_elf_addr();
+    uint32_t sec_num = elf.sections.size();
+	for (uint32_t i = 0; i < sec_num; i++) {
+		auto sec = elf.sections[i];
+        uint64_t offset = vsec[i].offset;
+		if (!(sec->get_flags() & SHF_ALLOC) || offset == ~0UL || sec->get_type() == SHT_NOBITS
+            || offset < start || offset >= end) {
+			continue;
+        }
+		memcpy(base + offset, src + sec->get_offset(), sec->get_size());
+	}
+}
 
-static int move_module(Module &mod)
+/* The read-only part is left to share_attach when copy_ro is false, it
+   may come from a shared file instead. */
+static int move_module(Module &mod, bool copy_ro)
 {
     auto &layout = mod.get_layout();
 
 	/* Do the allocs. */
-    void *ptr = mmap(NULL, layout.total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *ptr = mmap(module_area_hint(layout.total_size), layout.total_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (ptr == MAP_FAILED) {
         log_fatal("move_module:mmap fail %ld\n",layout.total_size);
         return -1;
@@ -174,6 +317,9 @@ static int move_module(Module &mod)
 	memset(ptr, 0, layout.total_size);
 	layout.base = ptr;
     log_info("module mmap addr [%p], size [0x%lx]\n", ptr, layout.total_size);
+    if (mod.instanced && instance_map_shared(mod) != 0) {
+        return -1;
+    }
 
     elfio &elf = mod.get_elf();
     auto &vsec = mod.get_sec();
@@ -182,25 +328,26 @@ static int move_module(Module &mod)
 	for (uint32_t i = 0; i < sec_num; i++) {
 		auto sec = elf.sections[i];
         uint32_t sh_flag = sec->get_flags();
-        uint32_t sh_type = sec->get_type();
         uint64_t addr = sec->get_address();
         uint64_t size = sec->get_size();
 
-		if (!(sh_flag & SHF_ALLOC))
+		if (!(sh_flag & SHF_ALLOC) || vsec[i].offset == ~0UL)
         {
 			continue;
         }
         void *dest = (void *)((char *)layout.base + vsec[i].offset);
 
-		if (sh_type != SHT_NOBITS) {
-			memcpy(dest, (void *)addr, size);
-        }
         log_debug("section layout:[%2d] copy from [0x%lx] to [%p], size 0x[%4lx], name [%s]\n", 
             i, addr, dest, size, sec->get_name().c_str());
 		/* Update sh_addr to point to copy in image. */
 		sec->set_address((unsigned long)dest);
 		//debug("\t0x%lx %s\n",(long)shdr->sh_addr, info->secstrings + shdr->sh_name);
 	}
+    copy_sections(mod, copy_ro ? 0 : layout.ro_after_init_size, layout.total_size);
+    if (mod.instanced) {
+        char *priv = (char *)layout.base + layout.ro_size;
+        mod.get_pristine().assign(priv, priv + layout.total_size - layout.ro_size);
+    }
 
 	return 0;
 }
@@ -216,9 +363,12 @@ uint32_t update_symbol_addr(Module &mod, SysEnv &env, symbol_section_accessor &s
     unsigned char other;
     Elf64_Addr    newValue;
 
+    uint32_t result = 0;
     log_debug("symbol fixed:oigin addr,      new address, size, bind, type, sch_id, name\n");
 
     FuncAddr &func = mod.get_func_addr();
+    auto &layout = mod.get_layout();
+    auto &vsec = mod.get_sec();
     elfio& elf = mod.get_elf();
     uint32_t sym_num =  symbols.get_symbols_num();
     uint32_t section_num = elf.sections.size();
@@ -227,33 +377,77 @@ uint32_t update_symbol_addr(Module &mod, SysEnv &env, symbol_section_accessor &s
         if (!b) {
             continue;
         }
+        /* the null symbol, SHN_ABS, SHN_COMMON and local undefined ones
+           keep their value */
+        newValue = value;
 		if (type == STT_SECTION) {
 			/* Section symbols cannot index anything else but their respective sections */
 			if (section_index == SHN_UNDEF || section_index >= SHN_LORESERVE || section_index >= section_num) {
 				continue;
 			}
             name = elf.sections[section_index]->get_name();
-			newValue = elf.sections[section_index]->get_address();
+            if (elf.sections[section_index]->get_flags() & SHF_TLS) {
+                newValue = layout.tls_tpoff + vsec[section_index].tls_offset;
+            } else {
+                newValue = elf.sections[section_index]->get_address();
+            }
 		} else if (section_index != SHN_UNDEF && section_index < SHN_LORESERVE) {
 			/* Non-section symbols without special indices must index valid sections */
 			if (section_index >= section_num) {
 				continue;
 			}
-			newValue = value + elf.sections[section_index]->get_address();
+            if (type == STT_TLS) {
+                /* TLS symbols take their offset from the thread pointer */
+                newValue = layout.tls_tpoff + vsec[section_index].tls_offset + value;
+            } else if (vsec[section_index].merged) {
+                newValue = merge_lookup(mod, section_index, value);
+            } else {
+                newValue = value + elf.sections[section_index]->get_address();
+            }
+            const ExportSym *kept = mod.replaces && bind == STB_GLOBAL && type == STT_OBJECT
+                ? mod.replaces->find_export(name) : nullptr;
+            if (kept && kept->type == STT_OBJECT && kept->size == size) {
+                /* the state stays where the importers of the old version
+                   have it, the copy in this image is left unused */
+                log_debug("patch: '%s' kept at 0x%lx\n", name.c_str(), kept->addr);
+                newValue = kept->addr;
+            }
+            if (type == STT_GNU_IFUNC) {
+                mod.get_ifuncs().push_back(i);
+            }
             if (bind == STB_GLOBAL) {
-                env.add_symbol(name, newValue);   
+                if (!mod.instanced) {
+                    env.add_symbol(name, newValue, &mod);
+                }
+                mod.get_exports().push_back({name, newValue, size, type});
                 if (name == "Construct") {
                     func.consruct_func = newValue;
+                } else if (name == "Destruct") {
+                    func.destruct_func = newValue;
                 }
             }
  
 		} else if (section_index == SHN_UNDEF && bind == STB_GLOBAL) {
-			/* Seek undefined symbols from this REL in previous RELs */
-            auto ret = env.get_symbol(name, newValue);
-			if (ret != 0) {
-				log_fatal("undefined symbol '%s'\n", name.c_str());
+			/* names of the module itself here, the others wait for link_symbols */
+            if (name == "_TLS_MODULE_BASE_") {
+                newValue = layout.tls_tpoff;
+            } else if (name == "_GLOBAL_OFFSET_TABLE_") {
+                newValue = (uint64_t)layout.base + layout.got_offset;
+            } else if (name == "__dso_handle") {
+                /* the image base identifies the module to __cxa_atexit */
+                newValue = (uint64_t)layout.base;
+                cxa_add_module(layout.base);
+            } else if (heap_bind(mod, name, newValue) == 0) {
+                /* its own heap, see umko_heap.h */
+            } else if (mod.lazy && mod.get_plt().count(i)) {
+                /* only called, bound on the first call */
+                newValue = 0;
+                uint64_t slot = got_slot_addr(mod, i, RELOC_CLASS_GOT) - (uint64_t)layout.base;
+                mod.get_lazy_slots().emplace(slot, i);
+            } else {
+                mod.get_undefs().push_back({i, name});
                 continue;
-			}
+            }
 		}  
         
         b = symbols.update_symbol(i, newValue, size, bind, type, section_index, other); 
@@ -263,11 +457,12 @@ uint32_t update_symbol_addr(Module &mod, SysEnv &env, symbol_section_accessor &s
         log_debug("symbol fixed:%10lx, %16lx, %4lx, %4d, %4d, %6d, %s\n",
             value, newValue, size, bind, type, section_index, name.c_str());
     }
-    return 0;
+    return result;
 }
 
 uint32_t layout_symbol_addr(Module &mod, SysEnv &env)
 {
+    uint32_t result = 0;
     elfio& elf = mod.get_elf();
     uint32_t sec_num = elf.sections.size();
 
@@ -275,18 +470,147 @@ uint32_t layout_symbol_addr(Module &mod, SysEnv &env)
         auto sec = elf.sections[i];
         if (SHT_SYMTAB == sec->get_type()) {
             symbol_section_accessor symbols(elf, sec);   
-            update_symbol_addr(mod, env, symbols); 
+            if (update_symbol_addr(mod, env, symbols) != 0) {
+                result = -1;
+            }
             mod.sym_sec_index = i;   
         }
     }   
+    auto &exports = mod.get_exports();
+    std::sort(exports.begin(), exports.end(),
+        [](const ExportSym &a, const ExportSym &b) { return a.name < b.name; });
+    return result;
+}
+
+void module_add_dep(Module &mod, Module *owner)
+{
+    auto &deps = mod.get_deps();
+    if (owner == nullptr || owner == &mod || (mod.group && owner->group == mod.group)
+        || std::find(deps.begin(), deps.end(), owner) != deps.end()) {
+        return;
+    }
+    deps.push_back(owner);
+    owner->refcnt++;
+}
+
+uint32_t module_find_import(SysEnv &env, const std::string &name, uint64_t &addr, Module **owner)
+{
+    *owner = nullptr;
+    if (env.get_symbol(name, addr, owner) != 0) {
+        return arch_cpu_symbol(name, addr);
+    }
+    if (*owner == nullptr) {
+        addr = import_bind(name, addr);
+    }
     return 0;
 }
 
-int apply_relocate_add(const_relocation_section_accessor &relsec, 
+/* Bind the undefined globals of mods once the exports of all of them are
+   in env. The references are sorted by name, so each name is looked up
+   once however many of the modules import it. */
+static uint32_t link_symbols(std::vector<Module *> &mods, SysEnv &env)
+{
+    struct Ref {
+        const std::string *name;
+        Module *mod;
+        uint32_t index;
+    };
+    std::vector<Ref> refs;
+    for (auto mod : mods) {
+        for (auto &undef : mod->get_undefs()) {
+            refs.push_back({&undef.name, mod, undef.index});
+        }
+    }
+    std::sort(refs.begin(), refs.end(), [](const Ref &a, const Ref &b) { return *a.name < *b.name; });
+
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
+
+    uint32_t result = 0;
+    for (size_t i = 0; i < refs.size();) {
+        const std::string &ref_name = *refs[i].name;
+        uint64_t addr = 0;
+        Module *owner = nullptr;
+        uint32_t ret = module_find_import(env, ref_name, addr, &owner);
+        for (; i < refs.size() && *refs[i].name == ref_name; i++) {
+            Module &mod = *refs[i].mod;
+            if (ret != 0) {
+                log_fatal("undefined symbol '%s' in %s\n", ref_name.c_str(), mod.get_obj_path());
+                result = -1;
+                continue;
+            }
+            module_add_dep(mod, owner);
+            elfio &elf = mod.get_elf();
+            symbol_section_accessor symbols(elf, elf.sections[mod.sym_sec_index]);
+            symbols.get_symbol(refs[i].index, name, value, size, bind, type, section_index, other);
+            /* addr is still the resolver of an ifunc of the group, the
+               references wait for it like those to an ifunc of mod */
+            const ExportSym *exp = owner && mod.group && owner->group == mod.group
+                ? owner->find_export(ref_name) : nullptr;
+            if (exp && exp->type == STT_GNU_IFUNC) {
+                type = STT_GNU_IFUNC;
+                mod.get_ifuncs().push_back(refs[i].index);
+            }
+            symbols.update_symbol(refs[i].index, addr, size, bind, type, section_index, other);
+            log_debug("symbol linked:%16lx, %s in %s\n", addr, ref_name.c_str(), mod.get_obj_path());
+        }
+    }
+    for (auto mod : mods) {
+        mod->get_undefs().clear();
+        mod->get_undefs().shrink_to_fit();
+    }
+    return result;
+}
+
+const ExportSym *Module::find_export(const std::string &name) const
+{
+    auto iter = std::lower_bound(exports.begin(), exports.end(), name,
+        [](const ExportSym &e, const std::string &n) { return e.name < n; });
+    if (iter == exports.end() || iter->name != name) {
+        return nullptr;
+    }
+    return &*iter;
+}
+
+uint32_t Module::find_batch(const std::vector<std::string> &names, std::vector<uint64_t> &addrs) const
+{
+    std::vector<uint32_t> order(names.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(),
+        [&names](uint32_t a, uint32_t b) { return names[a] < names[b]; });
+
+    addrs.assign(names.size(), 0);
+    uint32_t found = 0;
+    auto iter = exports.begin();
+    for (uint32_t idx : order) {
+        while (iter != exports.end() && iter->name < names[idx]) {
+            ++iter;
+        }
+        if (iter == exports.end()) {
+            break;
+        }
+        if (iter->name == names[idx]) {
+            addrs[idx] = iter->addr;
+            found++;
+        }
+    }
+    return found;
+}
+
+int apply_relocate_add(Module &mod,
+    const_relocation_section_accessor &relsec, 
 	section &sec_to_fixed,
 	symbol_section_accessor &symbols,
     uint32_t rela_sec_idx,
-    uint32_t fixed_sec_idx)
+    uint32_t fixed_sec_idx,
+    bool ifunc_pass)
 {
 	Elf64_Addr offset;
 	Elf_Word   symbol_index;
@@ -302,6 +626,7 @@ int apply_relocate_add(const_relocation_section_accessor &relsec,
     unsigned char other;
 
 	auto reloc_num = relsec.get_entries_num();
+	int result = 0;
 
 	auto sec_base_addr = sec_to_fixed.get_address();
 	for (uint32_t i = 0; i < reloc_num; i++) {
@@ -313,19 +638,52 @@ int apply_relocate_add(const_relocation_section_accessor &relsec,
 		if (!b) {
 			continue;
 		}
+		int cls = reloc_class(rel_type);
+		/* references to an ifunc wait for its resolver, which may only
+		   run once the rest is relocated */
+		if ((sym_type == STT_GNU_IFUNC || cls == RELOC_CLASS_IRELATIVE) != ifunc_pass) {
+			continue;
+		}
 		void *loc = (void *)(sec_base_addr + offset);
 		Elf64_Addr val = value + addend;
+		if (cls == RELOC_CLASS_DTPOFF) {
+			val -= mod.get_layout().tls_tpoff;
+		} else if (cls == RELOC_CLASS_IRELATIVE) {
+			val = arch_ifunc_resolve(val);
+		} else if (cls != RELOC_CLASS_PLAIN) {
+			val = got_slot_addr(mod, symbol_index, cls) + addend;
+		} else if (mod.lazy && reloc_is_call(rel_type) && mod.get_plt().count(symbol_index)) {
+			val = (uint64_t)mod.get_layout().base + mod.get_layout().plt_offset
+			    + mod.get_plt()[symbol_index] + addend;
+		} else if (reloc_is_call(rel_type) && mod.get_plt().count(symbol_index)
+		    && !reloc_call_reaches((uint64_t)loc, val)) {
+			val = (uint64_t)mod.get_layout().base + mod.get_layout().plt_offset
+			    + mod.get_plt()[symbol_index] + addend;
+		} else if (sym_type == STT_SECTION && section_index < SHN_LORESERVE
+		    && mod.get_sec()[section_index].merged) {
+			/* section relative reference into a merged section, the
+			   addend selects the entry */
+			val = merge_lookup(mod, section_index, addend);
+		}
+		if (mod.instanced && instance_check_reloc(mod, loc, rel_type, symbol_index, val, addend) != 0) {
+			log_error("instance: relocation type %u against '%s' in [%s] depends on the load address, build with -fPIC\n",
+			    rel_type, name.c_str(), sec_to_fixed.get_name().c_str());
+			result = -1;
+			continue;
+		}
 		int ret = do_relocate_add(rel_type, loc, val);
         if (ret != 0) {
-            log_warn("Reloc Fail:rela  %u sec %u index %03d offset %08lx Type %03x symIdx %03d symName %s Add %ld\n",
+            log_error("Reloc Fail:rela  %u sec %u index %03d offset %08lx Type %03x symIdx %03d symName %s Add %ld\n",
 	        rela_sec_idx, fixed_sec_idx, i, offset, rel_type, symbol_index, name.c_str(), addend);
+            result = -1;
         }
 	}
-    return 0;
+    return result;
 }
 
-void relocate_symbol(Module &mod)
+uint32_t relocate_symbol(Module &mod, bool ifunc_pass = false)
 {
+    uint32_t result = 0;
     elfio &elf = mod.get_elf();
     uint32_t sec_num = elf.sections.size();
     auto sym_sec = elf.sections[mod.sym_sec_index];
@@ -346,6 +704,10 @@ void relocate_symbol(Module &mod)
         }
         auto sec_to_fixed = elf.sections[info];
         auto sh_flag = sec_to_fixed->get_flags();
+        /* already relocated in the pages mapped from a shared file */
+        if (mod.get_sec()[info].offset < mod.get_layout().shared_size) {
+            continue;
+        }
 		if (!(sh_flag & SHF_ALLOC))
         {
             log_debug("rela section[%2d] for section [%2d] with flag [%2x] is skip! [%s]->[%s]\n",
@@ -353,9 +715,133 @@ void relocate_symbol(Module &mod)
 			continue;
         }
         const_relocation_section_accessor rel_sec(elf, sec);
-        apply_relocate_add(rel_sec, *sec_to_fixed, symbols, i, info);
+        if (apply_relocate_add(mod, rel_sec, *sec_to_fixed, symbols, i, info, ifunc_pass) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static bool has_irelative(Module &mod)
+{
+    elfio &elf = mod.get_elf();
+    Elf64_Addr offset;
+    Elf_Word   symbol_index;
+    unsigned   rel_type;
+    Elf_Sxword addend;
+
+    for (uint32_t n = 0; n < elf.sections.size(); n++) {
+        auto sec = elf.sections[n];
+        if (sec->get_type() != SHT_RELA) {
+            continue;
+        }
+        const_relocation_section_accessor relsec(elf, sec);
+        for (uint32_t i = 0; i < relsec.get_entries_num(); i++) {
+            if (relsec.get_entry(i, offset, symbol_index, rel_type, addend)
+                && reloc_class(rel_type) == RELOC_CLASS_IRELATIVE) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Run the ifunc resolvers of mod, with its text executable for a moment,
+   then bind the symbols and their GOT slots to the implementations
+   chosen, so calls pay no dispatch. The ifuncs imported from the group
+   are left to bind_ifuncs. */
+static uint32_t resolve_ifuncs(Module &mod, SysEnv &env)
+{
+    auto &ifuncs = mod.get_ifuncs();
+    if (ifuncs.empty() && !has_irelative(mod)) {
+        return 0;
+    }
+    auto &layout = mod.get_layout();
+    elfio &elf = mod.get_elf();
+    symbol_section_accessor symbols(elf, elf.sections[mod.sym_sec_index]);
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
+
+    mprotect(layout.base, layout.text_size, PROT_READ | PROT_EXEC);
+    __builtin___clear_cache((char *)layout.base, (char *)layout.base + layout.text_size);
+    for (uint32_t i : ifuncs) {
+        if (!symbols.get_symbol(i, name, value, size, bind, type, section_index, other)) {
+            log_error("ifunc: cannot read symbol %u of %s\n", i, mod.get_obj_path());
+            return -1;
+        }
+        if (section_index == SHN_UNDEF) {
+            continue;
+        }
+        uint64_t impl = arch_ifunc_resolve(value);
+        log_debug("ifunc '%s': resolver 0x%lx chose 0x%lx\n", name.c_str(), value, impl);
+        symbols.update_symbol(i, impl, size, bind, type, section_index, other);
+        fill_got_symbol(mod, i, impl);
+        if (bind != STB_GLOBAL) {
+            continue;
+        }
+        auto &exports = mod.get_exports();
+        auto iter = std::lower_bound(exports.begin(), exports.end(), name,
+            [](const ExportSym &e, const std::string &n) { return e.name < n; });
+        if (iter != exports.end() && iter->name == name) {
+            iter->addr = impl;
+        }
+        Module *owner = nullptr;
+        uint64_t addr;
+        if (!mod.instanced && env.get_symbol(name, addr, &owner) == 0 && owner == &mod) {
+            env.replace_symbol(name, impl, &mod);
+        }
+    }
+    /* the deferred relocations may be in the text, the shared pages of
+       it are relocated already */
+    if (layout.text_size > layout.shared_size) {
+        mprotect((char *)layout.base + layout.shared_size, layout.text_size - layout.shared_size,
+            PROT_READ | PROT_WRITE);
+    }
+    return 0;
+}
+
+/* Bind the ifuncs mod imports from its group, once the resolvers of all
+   members ran, then apply the relocations deferred to the ifuncs */
+static uint32_t bind_ifuncs(Module &mod, SysEnv &env)
+{
+    auto &ifuncs = mod.get_ifuncs();
+    if (ifuncs.empty() && !has_irelative(mod)) {
+        return 0;
+    }
+    elfio &elf = mod.get_elf();
+    symbol_section_accessor symbols(elf, elf.sections[mod.sym_sec_index]);
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
 
+    for (uint32_t i : ifuncs) {
+        if (!symbols.get_symbol(i, name, value, size, bind, type, section_index, other)) {
+            log_error("ifunc: cannot read symbol %u of %s\n", i, mod.get_obj_path());
+            return -1;
+        }
+        if (section_index != SHN_UNDEF) {
+            continue;
+        }
+        Module *owner = nullptr;
+        uint64_t impl;
+        if (env.get_symbol(name, impl, &owner) != 0) {
+            log_error("ifunc: '%s' imported by %s is gone\n", name.c_str(), mod.get_obj_path());
+            return -1;
+        }
+        log_debug("ifunc '%s': bound to 0x%lx in %s\n", name.c_str(), impl, mod.get_obj_path());
+        symbols.update_symbol(i, impl, size, bind, type, section_index, other);
+        fill_got_symbol(mod, i, impl);
     }
+    return relocate_symbol(mod, true);
 }
 
 uint32_t mod_protect(Module &mod)
@@ -371,7 +857,21 @@ uint32_t mod_protect(Module &mod)
 }
 
 typedef void (*InitFunc)(void);
-uint32_t mod_init_and_construct(Module &mod)
+/* one constructor, timed and named after its symbol */
+static void call_init(Module &mod, InitFunc fn, const char *what)
+{
+    AddrInfo info;
+    std::string name = what;
+    if (addr_index_lookup((uint64_t)fn, info) && info.sym_addr && name != info.sym_name) {
+        name = name + " " + info.sym_name;
+    }
+    TraceScope trace(name, "init");
+    uint64_t start = init_watch_begin(name, mod.get_obj_path());
+    fn();
+    init_watch_end(name, mod.get_obj_path(), start);
+}
+
+uint32_t mod_init_and_construct(Module &mod, int64_t delta)
 {
     elfio& elf = mod.get_elf();
     uint32_t sec_num = elf.sections.size();
@@ -379,41 +879,300 @@ uint32_t mod_init_and_construct(Module &mod)
 	for (uint32_t i = 0; i < sec_num; i++) {
         auto sec = elf.sections[i];
         if (SHT_INIT_ARRAY == sec->get_type()) {
-            uint64_t addr = sec->get_address();
+            uint64_t addr = sec->get_address() + delta;
             uint64_t num = sec->get_size() / sec->get_entry_size(); 
             log_info("call init_array(0x%lx) count(%ld) for %s\n", addr, num, mod.get_obj_path());
             InitFunc *fn = (InitFunc *)addr;
             for (uint64_t j = 0; j < num; j++) {
-                fn[j]();
+                call_init(mod, fn[j], "init_array");
             }
         }
     }  
     auto func = mod.get_func_addr();
     if (func.consruct_func) {
-        log_info("call Construct(0x%lx) for %s\n", func.consruct_func, mod.get_obj_path());
+        log_info("call Construct(0x%lx) for %s\n", func.consruct_func + delta, mod.get_obj_path());
 
-        InitFunc fn = (InitFunc)func.consruct_func;
-        fn();
+        call_init(mod, (InitFunc)(func.consruct_func + delta), "Construct");
     }
     return 0;
 }
 
-uint32_t load_module(Module &mod, SysEnv &env)
+/* read, lay out and map mod, then put its exports into env; its imports
+   are left to link_symbols */
+static uint32_t load_define(Module &mod, SysEnv &env)
 {
-    load_reloc_elf(mod);
+    TracePhases phase;
+
+    phase.next("read");
+    if (load_reloc_elf(mod) != 0) {
+        return -1;
+    }
 
+    phase.next("layout");
     init_section_addr(mod);
+    /* instances replay their GOT, they bind at load */
+    mod.lazy = lazy_enabled() && !mod.instanced;
+
+    if (scan_got(mod) != 0) {
+        return -1;
+    }
 
     layout_sections(mod);
+    if (mod.instanced && mod.get_layout().tls_size) {
+        log_error("instance: %s has TLS, instances would share it\n", mod.get_obj_path());
+        return -1;
+    }
+
+    phase.next("map");
+    bool share = !env.get_share_dir().empty() && !mod.instanced && !mod.lazy && !mod.replaces;
+    if (move_module(mod, !share) != 0 || tls_register_module(mod) != 0) {
+        return -1;
+    }
+
+    phase.next("merge");
+    merge_sections(mod);
+
+    phase.next("symbols");
+    return layout_symbol_addr(mod, env);
+}
+
+/* relocate mod once its imports are bound and run its ifunc resolvers */
+static uint32_t load_relocate(Module &mod, SysEnv &env)
+{
+    TracePhases phase;
+    bool share = !env.get_share_dir().empty() && !mod.instanced && !mod.lazy && !mod.replaces;
+
+    phase.next("got");
+    fill_got(mod);
+    fill_plt(mod);
+
+    if (share) {
+        phase.next("share attach");
+        if (share_attach(mod, env.get_share_dir()) != 0) {
+            copy_sections(mod, 0, mod.get_layout().ro_after_init_size);
+        }
+    }
 
-    move_module(mod);
+    phase.next("relocate");
+    if (relocate_symbol(mod) != 0 || resolve_ifuncs(mod, env) != 0) {
+        return -1;
+    }
+    return 0;
+}
 
-    layout_symbol_addr(mod, env);
+/* bind the ifuncs of mod and protect it, once the whole group is
+   relocated and resolved */
+static uint32_t load_finish(Module &mod, SysEnv &env)
+{
+    TracePhases phase;
+    bool share = !env.get_share_dir().empty() && !mod.instanced && !mod.lazy && !mod.replaces;
 
-    relocate_symbol(mod);
+    phase.next("ifunc");
+    if (bind_ifuncs(mod, env) != 0) {
+        return -1;
+    }
 
-    mod_protect(mod);
+    phase.next("protect");
+    if (mod_protect(mod) != 0) {
+        return -1;
+    }
+    /* a template is only copied from, instance_create runs the copies */
+    if (mod.instanced) {
+        return 0;
+    }
+    if (share) {
+        phase.next("share publish");
+        share_publish(mod, env.get_share_dir());
+    }
+    phase.next("index");
+    perf_module_load(mod);
+    addr_index_add(mod);
+    return 0;
+}
 
+static void load_construct(Module &mod)
+{
+    TraceScope trace("construct", "phase");
     mod_init_and_construct(mod);
+    mod.constructed = true;
+}
+
+uint32_t load_module(Module &mod, SysEnv &env)
+{
+    TraceScope trace(std::string("load ") + mod.get_obj_path(), "module");
+    std::vector<Module *> mods = {&mod};
+
+    if (load_define(mod, env) != 0) {
+        unload_module(mod, env);
+        return -1;
+    }
+    uint32_t ret;
+    {
+        TraceScope link("link", "phase");
+        ret = link_symbols(mods, env);
+    }
+    if (ret != 0 || load_relocate(mod, env) != 0 || load_finish(mod, env) != 0) {
+        unload_module(mod, env);
+        return -1;
+    }
+    /* a new version takes over the state the old one constructed, what
+       changed goes through its Migrate hook, see patch.h */
+    if (!mod.instanced && !mod.replaces) {
+        load_construct(mod);
+    }
+    /* the exports show once the module is constructed */
+    env.publish();
+    return 0;
+}
+
+static uint32_t group_next = 0;
+
+uint32_t module_new_group()
+{
+    return ++group_next;
+}
+
+uint32_t load_modules(std::vector<Module *> &mods, SysEnv &env)
+{
+    TraceScope trace("load " + std::to_string(mods.size()) + " modules", "module");
+    uint32_t group = module_new_group();
+    for (auto mod : mods) {
+        mod->group = group;
+    }
+
+    uint32_t ret = 0;
+    for (auto mod : mods) {
+        TraceScope load(std::string("load ") + mod->get_obj_path(), "module");
+        if (load_define(*mod, env) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0) {
+        TraceScope link("link", "phase");
+        ret = link_symbols(mods, env);
+    }
+    for (auto mod : mods) {
+        if (ret != 0) {
+            break;
+        }
+        TraceScope load(std::string("relocate ") + mod->get_obj_path(), "module");
+        ret = load_relocate(*mod, env);
+    }
+    /* every resolver of the group ran, the imports of ifuncs can bind */
+    for (auto mod : mods) {
+        if (ret != 0) {
+            break;
+        }
+        TraceScope load(std::string("finish ") + mod->get_obj_path(), "module");
+        ret = load_finish(*mod, env);
+    }
+    if (ret != 0) {
+        unload_modules(mods, env);
+        return -1;
+    }
+    for (auto mod : mods) {
+        load_construct(*mod);
+    }
+    env.publish();
+    return 0;
+}
+
+/* Reverse of mod_init_and_construct: the Destruct hook, the destructors
+   registered with __cxa_atexit, then .fini_array from the last entry. */
+uint32_t mod_fini_and_destruct(Module &mod, int64_t delta)
+{
+    auto func = mod.get_func_addr();
+    if (func.destruct_func) {
+        log_info("call Destruct(0x%lx) for %s\n", func.destruct_func + delta, mod.get_obj_path());
+
+        InitFunc fn = (InitFunc)(func.destruct_func + delta);
+        fn();
+    }
+    cxa_finalize_module((char *)mod.get_layout().base + delta);
+
+    elfio& elf = mod.get_elf();
+    uint32_t sec_num = elf.sections.size();
+	for (uint32_t i = sec_num; i-- > 0;) {
+        auto sec = elf.sections[i];
+        if (SHT_FINI_ARRAY == sec->get_type()) {
+            uint64_t addr = sec->get_address() + delta;
+            uint64_t num = sec->get_size() / sec->get_entry_size();
+            log_info("call fini_array(0x%lx) count(%ld) for %s\n", addr, num, mod.get_obj_path());
+            InitFunc *fn = (InitFunc *)addr;
+            for (uint64_t j = num; j-- > 0;) {
+                fn[j]();
+            }
+        }
+    }
+    return 0;
+}
+
+/* Take the exports of the module back and release its memory, this also
+   undoes a load that failed half way. Modules importing from it must be
+   unloaded first. */
+uint32_t unload_module(Module &mod, SysEnv &env)
+{
+    if (mod.refcnt) {
+        log_error("cannot unload %s, still used by %u module(s)\n", mod.get_obj_path(), mod.refcnt);
+        return -1;
+    }
+    if (mod.constructed) {
+        mod_fini_and_destruct(mod);
+        mod.constructed = false;
+    }
+    heap_destroy(mod);
+
+    for (auto &sym : mod.get_exports()) {
+        env.remove_symbol(sym.name, sym.addr);
+    }
+    mod.get_exports().clear();
+    env.publish();
+    defer_release(mod);
+    for (auto dep : mod.get_deps()) {
+        dep->refcnt--;
+    }
+    mod.get_deps().clear();
+    perf_module_unload(mod);
+    addr_index_remove(&mod);
+
+    auto &layout = mod.get_layout();
+    /* forget the dso handle of a load that failed before constructors */
+    cxa_remove_module(layout.base);
+    tls_unregister_module(mod);
+    if (layout.base) {
+        munmap(layout.base, layout.total_size);
+        log_info("module munmap addr [%p], size [0x%lx] for %s\n", layout.base, layout.total_size, mod.get_obj_path());
+        layout.base = nullptr;
+    }
+    share_release(mod);
+    if (mod.memfd >= 0) {
+        close(mod.memfd);
+        mod.memfd = -1;
+    }
+    if (mod.get_elf_size()) {
+        munmap(mod.get_elf_addr(), mod.get_elf_size());
+        mod.set_elf_addr(nullptr, 0);
+    }
+    return 0;
+}
+
+uint32_t unload_modules(std::vector<Module *> &mods, SysEnv &env)
+{
+    for (auto mod : mods) {
+        if (mod->refcnt) {
+            log_error("cannot unload %s, still used by %u module(s)\n", mod->get_obj_path(), mod->refcnt);
+            return -1;
+        }
+    }
+    for (auto iter = mods.rbegin(); iter != mods.rend(); ++iter) {
+        if ((*iter)->constructed) {
+            mod_fini_and_destruct(**iter);
+            (*iter)->constructed = false;
+        }
+    }
+    for (auto iter = mods.rbegin(); iter != mods.rend(); ++iter) {
+        unload_module(**iter, env);
+    }
     return 0;
 }
@@ -0,0 +1,109 @@
+#include "patch.h"
+#include <sys/mman.h>
+#include "module.h"
+#include "share.h"
+#include "perfmap.h"
+#include "logger.h"
+
+using namespace ELFIO;
+
+/* data that changed size has a copy of its own in new_mod, filled by
+   the hook; modules importing the old one keep it */
+static uint32_t migrate_data(Module &old_mod, const ExportSym &old_sym, const ExportSym &new_sym, MigrateFunc hook)
+{
+    if (hook == nullptr) {
+        log_warn("patch: '%s' changed size 0x%lx -> 0x%lx, not migrated\n",
+            old_sym.name.c_str(), old_sym.size, new_sym.size);
+        return -1;
+    }
+    hook(old_sym.name.c_str(), (void *)old_sym.addr, (void *)new_sym.addr, old_sym.size);
+    if (old_mod.refcnt) {
+        log_warn("patch: '%s' changed size, modules importing it from %s keep the old copy\n",
+            old_sym.name.c_str(), old_mod.get_obj_path());
+    }
+    return 0;
+}
+
+/* nothing jumps into new_mod yet, it may be unloaded alone; it was never
+   constructed, so that leaves the data it shares with old_mod alone */
+static uint32_t patch_cancel(Module &new_mod)
+{
+    new_mod.group = 0;
+    return -1;
+}
+
+/* Redirect old_mod to new_mod, which was loaded with old_mod as the one
+   it replaces and not constructed. old_mod stays mapped, its code now
+   jumps into new_mod, whose data mostly is that of old_mod; both are in
+   one group and unloaded together, the destructors of old_mod tear the
+   state down. */
+uint32_t patch_module(Module &old_mod, Module &new_mod, SysEnv &env)
+{
+    auto &layout = old_mod.get_layout();
+    const ExportSym *migrate = new_mod.find_export("Migrate");
+    MigrateFunc hook = migrate ? (MigrateFunc)migrate->addr : nullptr;
+
+    if (share_detach(old_mod) != 0) {
+        return patch_cancel(new_mod);
+    }
+    /* all data first, the redirected functions use it at once */
+    uint32_t kept_num = 0;
+    uint32_t data_num = 0;
+    for (auto &sym : old_mod.get_exports()) {
+        const ExportSym *new_sym = new_mod.find_export(sym.name);
+        if (sym.type != STT_OBJECT || new_sym == nullptr || new_sym->type != STT_OBJECT) {
+            continue;
+        }
+        if (new_sym->addr == sym.addr) {
+            kept_num++;
+        } else if (migrate_data(old_mod, sym, *new_sym, hook) == 0) {
+            data_num++;
+        }
+    }
+
+    if (mprotect(layout.base, layout.text_size, PROT_READ | PROT_WRITE | PROT_EXEC)) {
+        log_fatal("patch: cannot make text of %s writable\n", old_mod.get_obj_path());
+        return patch_cancel(new_mod);
+    }
+    uint32_t func_num = 0;
+    uint32_t ret = 0;
+    for (auto &sym : old_mod.get_exports()) {
+        const ExportSym *new_sym = new_mod.find_export(sym.name);
+        if (new_sym == nullptr) {
+            log_warn("patch: '%s' is gone in %s, left as is\n", sym.name.c_str(), new_mod.get_obj_path());
+            continue;
+        }
+        if (sym.type != STT_FUNC || new_sym->type != STT_FUNC) {
+            continue;
+        }
+        if (arch_patch_jump((void *)sym.addr, sym.size, (void *)new_sym->addr) != 0) {
+            ret = -1;
+            break;
+        }
+        perf_code_patched(old_mod, sym.addr);
+        func_num++;
+    }
+    mprotect(layout.base, layout.text_size, PROT_READ | PROT_EXEC);
+    if (ret != 0) {
+        if (func_num == 0) {
+            return patch_cancel(new_mod);
+        }
+        /* patched entries jump into new_mod already, the group keeps it */
+        log_error("patch: %s is partially patched\n", old_mod.get_obj_path());
+        return ret;
+    }
+
+    /* modules loaded from now on bind to the new version */
+    for (auto &sym : new_mod.get_exports()) {
+        Module *owner = nullptr;
+        uint64_t addr;
+        if (env.get_symbol(sym.name, addr, &owner) != 0 || owner == &old_mod) {
+            env.replace_symbol(sym.name, sym.addr, &new_mod);
+        }
+    }
+    env.publish();
+
+    log_info("patch: %s -> %s, %u functions redirected, %u data kept, %u migrated\n",
+        old_mod.get_obj_path(), new_mod.get_obj_path(), func_num, kept_num, data_num);
+    return 0;
+}
@@ -0,0 +1,251 @@
+#include "perfmap.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "module.h"
+#include "logger.h"
+
+using namespace ELFIO;
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_CLOSE 3
+
+#if defined(__x86_64__)
+#define JITDUMP_ELF_MACH 62     /* EM_X86_64 */
+#elif defined(__aarch64__)
+#define JITDUMP_ELF_MACH 183    /* EM_AARCH64 */
+#endif
+
+/* layouts of tools/perf/util/jitdump.h */
+struct JitHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct JitRecord {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct JitCodeLoad {
+    JitRecord p;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+struct PerfEntry {
+    uint64_t addr;
+    uint64_t size;
+    std::string name;
+    Module *owner;
+};
+
+static std::mutex perf_lock;
+static uint32_t perf_flags = 0;
+static std::vector<PerfEntry> perf_entries;
+static FILE *jit_file = nullptr;
+static void *jit_marker = nullptr;
+static uint64_t jit_code_index = 0;
+
+/* perf record -k mono */
+static uint64_t perf_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void jit_close()
+{
+    if (jit_file == nullptr) {
+        return;
+    }
+    JitRecord rec = {JIT_CODE_CLOSE, sizeof(JitRecord), perf_timestamp()};
+    fwrite(&rec, sizeof(rec), 1, jit_file);
+    fclose(jit_file);
+    jit_file = nullptr;
+}
+
+static uint32_t jit_open()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "jit-%d.dump", getpid());
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd < 0) {
+        log_error("perf: cannot create %s\n", path);
+        return -1;
+    }
+    /* perf record finds the dump through this executable mapping */
+    jit_marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (jit_marker == MAP_FAILED) {
+        jit_marker = nullptr;
+        log_error("perf: cannot mmap %s\n", path);
+        close(fd);
+        return -1;
+    }
+    jit_file = fdopen(fd, "wb");
+    JitHeader header = {JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(JitHeader), JITDUMP_ELF_MACH,
+        0, (uint32_t)getpid(), perf_timestamp(), 0};
+    fwrite(&header, sizeof(header), 1, jit_file);
+    fflush(jit_file);
+    atexit(jit_close);
+    return 0;
+}
+
+static void jit_code_load(const PerfEntry &e)
+{
+    JitCodeLoad rec;
+    rec.p.id = JIT_CODE_LOAD;
+    rec.p.total_size = sizeof(rec) + e.name.size() + 1 + e.size;
+    rec.p.timestamp = perf_timestamp();
+    rec.pid = getpid();
+    rec.tid = syscall(SYS_gettid);
+    rec.vma = e.addr;
+    rec.code_addr = e.addr;
+    rec.code_size = e.size;
+    rec.code_index = jit_code_index++;
+    fwrite(&rec, sizeof(rec), 1, jit_file);
+    fwrite(e.name.c_str(), e.name.size() + 1, 1, jit_file);
+    fwrite((const void *)e.addr, e.size, 1, jit_file);
+}
+
+/* rewritten whole, a range of unloaded code must not keep its names */
+static void map_write()
+{
+    char path[64];
+    char tmp[80];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == nullptr) {
+        log_error("perf: cannot write %s\n", path);
+        return;
+    }
+    for (auto &e : perf_entries) {
+        fprintf(fp, "%lx %lx %s\n", e.addr, e.size, e.name.c_str());
+    }
+    fclose(fp);
+    rename(tmp, path);
+}
+
+static void map_append(size_t from)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    FILE *fp = fopen(path, "a");
+    if (fp == nullptr) {
+        log_error("perf: cannot write %s\n", path);
+        return;
+    }
+    for (size_t i = from; i < perf_entries.size(); i++) {
+        auto &e = perf_entries[i];
+        fprintf(fp, "%lx %lx %s\n", e.addr, e.size, e.name.c_str());
+    }
+    fclose(fp);
+}
+
+uint32_t perf_enable(uint32_t flags)
+{
+    std::lock_guard<std::mutex> guard(perf_lock);
+    if ((flags & PERF_FLAG_JITDUMP) && jit_file == nullptr && jit_open() != 0) {
+        flags &= ~PERF_FLAG_JITDUMP;
+    }
+    perf_flags |= flags;
+    return 0;
+}
+
+/* every function in the image, locals included, once it is relocated */
+void perf_module_load(Module &mod)
+{
+    std::lock_guard<std::mutex> guard(perf_lock);
+    if (perf_flags == 0) {
+        return;
+    }
+    elfio &elf = mod.get_elf();
+    symbol_section_accessor symbols(elf, elf.sections[mod.sym_sec_index]);
+    auto &vsec = mod.get_sec();
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
+
+    size_t first = perf_entries.size();
+    for (Elf_Xword i = 0; i < symbols.get_symbols_num(); i++) {
+        symbols.get_symbol(i, name, value, size, bind, type, section_index, other);
+        if (type != STT_FUNC || size == 0 || section_index >= vsec.size() || vsec[section_index].offset == ~0UL) {
+            continue;
+        }
+        perf_entries.push_back({value, size, name, &mod});
+    }
+    if (perf_flags & PERF_FLAG_MAP) {
+        map_append(first);
+    }
+    if (perf_flags & PERF_FLAG_JITDUMP) {
+        for (size_t i = first; i < perf_entries.size(); i++) {
+            jit_code_load(perf_entries[i]);
+        }
+        fflush(jit_file);
+    }
+}
+
+/* a jitdump keeps its records, later loads at the same address win by
+   their timestamp; the map only keeps what is live */
+void perf_module_unload(Module &mod)
+{
+    std::lock_guard<std::mutex> guard(perf_lock);
+    if (perf_flags == 0) {
+        return;
+    }
+    size_t num = perf_entries.size();
+    perf_entries.erase(std::remove_if(perf_entries.begin(), perf_entries.end(),
+        [&mod](const PerfEntry &e) { return e.owner == &mod; }), perf_entries.end());
+    if ((perf_flags & PERF_FLAG_MAP) && perf_entries.size() != num) {
+        map_write();
+    }
+}
+
+void perf_code_patched(Module &mod, uint64_t addr)
+{
+    std::lock_guard<std::mutex> guard(perf_lock);
+    if (perf_flags == 0) {
+        return;
+    }
+    for (auto &e : perf_entries) {
+        if (e.owner != &mod || e.addr != addr) {
+            continue;
+        }
+        e.name += " [patched]";
+        if (perf_flags & PERF_FLAG_MAP) {
+            map_write();
+        }
+        if (perf_flags & PERF_FLAG_JITDUMP) {
+            jit_code_load(e);
+            fflush(jit_file);
+        }
+        break;
+    }
+}
@@ -0,0 +1,211 @@
+#include "profile.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "addrindex.h"
+#include "crash.h"
+#include "logger.h"
+
+struct Sample {
+    uint32_t depth;
+    uint32_t pad;
+    uint64_t pc[PROFILE_MAX_DEPTH];
+};
+
+/* one per thread, written by its own signal handler only */
+struct ProfileBuffer {
+    uint64_t num;
+    uint64_t dropped;
+    Sample samples[PROFILE_BUF_SAMPLES];
+};
+
+static ProfileBuffer *prof_buffers;
+static uint32_t prof_buffer_used;
+static uint64_t prof_lost_threads;
+static bool prof_running;
+/* bumped by each start, a thread takes a new buffer in a new run */
+static uint32_t prof_generation;
+static std::string prof_prefix;
+static struct sigaction prof_old_action;
+static thread_local ProfileBuffer *prof_buf __attribute__((tls_model("initial-exec")));
+static thread_local uint32_t prof_buf_generation __attribute__((tls_model("initial-exec")));
+
+static void prof_handler(int sig, siginfo_t *info, void *ctx)
+{
+    int saved_errno = errno;
+    ProfileBuffer *buf = prof_buf;
+    if (buf == nullptr || prof_buf_generation != prof_generation) {
+        uint32_t idx = __atomic_fetch_add(&prof_buffer_used, 1, __ATOMIC_RELAXED);
+        if (idx >= PROFILE_MAX_THREADS) {
+            __atomic_fetch_add(&prof_lost_threads, 1, __ATOMIC_RELAXED);
+            errno = saved_errno;
+            return;
+        }
+        buf = prof_buf = &prof_buffers[idx];
+        prof_buf_generation = prof_generation;
+    }
+    if (buf->num >= PROFILE_BUF_SAMPLES) {
+        buf->dropped++;
+        errno = saved_errno;
+        return;
+    }
+    /* frames are read 16 bytes at a time, code built without frame
+       pointers only cuts the chain short */
+    Sample &s = buf->samples[buf->num];
+    s.depth = context_frames(ctx, s.pc, PROFILE_MAX_DEPTH);
+    /* the writer publishes the sample, the reader runs at stop */
+    __atomic_store_n(&buf->num, buf->num + 1, __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+static std::string frame_name(uint64_t pc, bool leaf)
+{
+    AddrInfo info;
+    /* return addresses point after the call */
+    if (!addr_index_lookup(leaf ? pc : pc - 1, info)) {
+        return "[host]";
+    }
+    std::string mod = info.mod_name;
+    size_t slash = mod.rfind('/');
+    if (slash != std::string::npos) {
+        mod = mod.substr(slash + 1);
+    }
+    std::string sym = info.sym_name;
+    if (sym.empty()) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "+0x%lx", info.offset);
+        sym = buf;
+    }
+    return mod + "`" + sym;
+}
+
+static void write_profile()
+{
+    std::map<std::string, uint64_t> flat;
+    std::map<std::string, uint64_t> folded;
+    uint64_t total = 0;
+    uint64_t dropped = 0;
+    uint32_t threads = std::min(prof_buffer_used, (uint32_t)PROFILE_MAX_THREADS);
+
+    for (uint32_t t = 0; t < threads; t++) {
+        auto &buf = prof_buffers[t];
+        uint64_t num = __atomic_load_n(&buf.num, __ATOMIC_ACQUIRE);
+        dropped += buf.dropped;
+        for (uint64_t i = 0; i < num; i++) {
+            auto &s = buf.samples[i];
+            std::string stack;
+            for (uint32_t d = s.depth; d-- > 0;) {
+                stack += frame_name(s.pc[d], d == 0);
+                if (d) {
+                    stack += ";";
+                }
+            }
+            flat[frame_name(s.pc[0], true)]++;
+            folded[stack]++;
+            total++;
+        }
+    }
+
+    std::string path = prof_prefix + ".folded";
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp) {
+        for (auto &f : folded) {
+            fprintf(fp, "%s %lu\n", f.first.c_str(), f.second);
+        }
+        fclose(fp);
+    }
+    path = prof_prefix + ".txt";
+    fp = fopen(path.c_str(), "w");
+    if (fp == nullptr) {
+        log_error("profile: cannot write %s\n", path.c_str());
+        return;
+    }
+    std::vector<std::pair<uint64_t, std::string>> order;
+    for (auto &f : flat) {
+        order.emplace_back(f.second, f.first);
+    }
+    std::sort(order.rbegin(), order.rend());
+    fprintf(fp, "# %lu samples, %u threads, %lu dropped, %lu threads not sampled\n",
+        total, threads, dropped, prof_lost_threads);
+    fprintf(fp, "# %8s %7s  %s\n", "samples", "self%", "symbol");
+    for (auto &o : order) {
+        fprintf(fp, "  %8lu %6.2f%%  %s\n", o.first, total ? 100.0 * o.first / total : 0.0, o.second.c_str());
+    }
+    fclose(fp);
+    log_info("profile: %lu samples written to %s.txt and %s.folded\n", total, prof_prefix.c_str(), prof_prefix.c_str());
+}
+
+uint32_t profile_start(const char *prefix, uint32_t hz)
+{
+    if (prof_running) {
+        return -1;
+    }
+    if (prof_buffers == nullptr) {
+        void *p = mmap(nullptr, sizeof(ProfileBuffer) * PROFILE_MAX_THREADS, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            log_error("profile: cannot allocate sample buffers\n");
+            return -1;
+        }
+        prof_buffers = (ProfileBuffer *)p;
+    }
+    /* the handler is not installed between runs, the samples of the last
+       one were written at its stop */
+    uint32_t used = std::min(prof_buffer_used, (uint32_t)PROFILE_MAX_THREADS);
+    for (uint32_t t = 0; t < used; t++) {
+        prof_buffers[t].num = 0;
+        prof_buffers[t].dropped = 0;
+    }
+    prof_buffer_used = 0;
+    prof_lost_threads = 0;
+    prof_generation++;
+    prof_prefix = prefix;
+    hz = hz ? hz : PROFILE_HZ_DEFAULT;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = prof_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, &prof_old_action);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+        sigaction(SIGPROF, &prof_old_action, nullptr);
+        log_error("profile: cannot start the timer\n");
+        return -1;
+    }
+    prof_running = true;
+    log_info("profile: sampling at %u Hz\n", hz);
+    return 0;
+}
+
+uint32_t profile_stop()
+{
+    if (!prof_running) {
+        return -1;
+    }
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    /* a SIGPROF still pending must not kill the process */
+    if (!(prof_old_action.sa_flags & SA_SIGINFO) && prof_old_action.sa_handler == SIG_DFL) {
+        signal(SIGPROF, SIG_IGN);
+    } else {
+        sigaction(SIGPROF, &prof_old_action, nullptr);
+    }
+    prof_running = false;
+    write_profile();
+    return 0;
+}
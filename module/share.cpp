@@ -0,0 +1,255 @@
+#include "share.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "module.h"
+#include "logger.h"
+
+using namespace ELFIO;
+
+/* the files this process maps, by descriptor */
+static std::map<int, std::string> share_files;
+
+static void share_release_fd(int fd)
+{
+    auto iter = share_files.find(fd);
+    if (iter == share_files.end()) {
+        return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        unlink(iter->second.c_str());
+    }
+    close(fd);
+    share_files.erase(iter);
+}
+
+/* modules left loaded at exit let go of their files too */
+static void share_release_all()
+{
+    while (!share_files.empty()) {
+        share_release_fd(share_files.begin()->first);
+    }
+}
+
+static void share_track(Module &mod, int fd, const std::string &path)
+{
+    static bool registered = false;
+    if (!registered) {
+        atexit(share_release_all);
+        registered = true;
+    }
+    share_files[fd] = path;
+    mod.share_fd = fd;
+}
+
+static std::string share_name(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "umko-%016lx", key);
+    return name;
+}
+
+/* dir/umko-<euid>, made on first use. It must be ours and closed to
+   others, or anyone could plant code that we map executable. */
+static int share_open_dir(const std::string &dir, std::string &path)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/umko-%u", (unsigned)geteuid());
+    path = dir + name;
+    if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+        log_warn("share: cannot create %s\n", path.c_str());
+        return -1;
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0 || !S_ISDIR(sb.st_mode) || sb.st_uid != geteuid() || (sb.st_mode & 077)) {
+        log_warn("share: %s is not a private directory of this user, not sharing\n", path.c_str());
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/* Everything the relocated bytes depend on: the object, where the image
+   is, the final symbol values, which cover imports and merged sections,
+   the pool addresses of merged entries and the TLS block offset. */
+uint64_t share_key(Module &mod)
+{
+    auto &layout = mod.get_layout();
+    const void *obj = mod.get_obj_buffer() ? mod.get_obj_buffer() : mod.get_elf_addr();
+    uint64_t obj_size = mod.get_obj_buffer() ? mod.get_obj_size() : mod.get_elf_size();
+
+    std::vector<uint64_t> parts;
+    parts.push_back(merge_hash(obj, obj_size));
+    parts.push_back((uint64_t)layout.base);
+    parts.push_back(layout.ro_after_init_size);
+    parts.push_back(layout.tls_tpoff);
+
+    elfio &elf = mod.get_elf();
+    symbol_section_accessor symbols(elf, elf.sections[mod.sym_sec_index]);
+    std::string   name;
+    Elf64_Addr    value;
+    Elf_Xword     size;
+    unsigned char bind;
+    unsigned char type;
+    Elf_Half      section_index;
+    unsigned char other;
+    auto &vsec = mod.get_sec();
+    for (Elf_Xword i = 0; i < symbols.get_symbols_num(); i++) {
+        symbols.get_symbol(i, name, value, size, bind, type, section_index, other);
+        /* symbols of sections left out of the image point into the
+           object mapping, which moves from process to process */
+        if (section_index == SHN_UNDEF || section_index == SHN_ABS
+            || (section_index < vsec.size() && vsec[section_index].offset != ~0UL)) {
+            parts.push_back(value);
+        }
+    }
+    for (auto &sec : vsec) {
+        for (auto &entry : sec.merge) {
+            parts.push_back(entry.addr);
+        }
+    }
+    return merge_hash(parts.data(), parts.size() * sizeof(uint64_t));
+}
+
+/* a file of ours nobody else may write, of the size of the shared part */
+static bool share_file_ok(Module &mod, int fd)
+{
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+        return false;
+    }
+    if (sb.st_uid != geteuid() || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+        log_warn("share: a shared file for %s is not private, not mapped\n", mod.get_obj_path());
+        return false;
+    }
+    return (uint64_t)sb.st_size == mod.get_layout().ro_after_init_size;
+}
+
+static uint32_t map_shared(Module &mod, int fd)
+{
+    auto &layout = mod.get_layout();
+    void *p = mmap(layout.base, layout.ro_after_init_size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    layout.shared_size = layout.ro_after_init_size;
+    return 0;
+}
+
+/* Every process mapping a file holds a shared lock on it, the last one
+   to let go removes it. */
+uint32_t share_attach(Module &mod, const std::string &dir)
+{
+    auto &layout = mod.get_layout();
+    if (layout.ro_after_init_size == 0) {
+        return -1;
+    }
+    /* the ifunc resolvers change symbols before share_publish, both go
+       by the key of the symbols as linked */
+    mod.share_hash = share_key(mod);
+    std::string dir_path;
+    int dir_fd = share_open_dir(dir, dir_path);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    std::string name = share_name(mod.share_hash);
+    int fd = openat(dir_fd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    close(dir_fd);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!share_file_ok(mod, fd) || flock(fd, LOCK_SH) != 0 || map_shared(mod, fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    share_track(mod, fd, dir_path + "/" + name);
+    log_info("share: mapped 0x%lx bytes from %s/%s for %s\n", layout.shared_size, dir_path.c_str(), name.c_str(), mod.get_obj_path());
+    return 0;
+}
+
+uint32_t share_publish(Module &mod, const std::string &dir)
+{
+    auto &layout = mod.get_layout();
+    if (layout.ro_after_init_size == 0 || layout.shared_size) {
+        return 0;
+    }
+    std::string dir_path;
+    int dir_fd = share_open_dir(dir, dir_path);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    close(dir_fd);
+    std::string path = dir_path + "/" + share_name(mod.share_hash);
+    /* written aside and renamed, readers never see a partial file */
+    std::string tmp = path + ".XXXXXX";
+    int fd = mkostemp(&tmp[0], O_CLOEXEC);
+    if (fd < 0) {
+        log_warn("share: cannot create %s\n", tmp.c_str());
+        return -1;
+    }
+    const char *p = (const char *)layout.base;
+    uint64_t left = layout.ro_after_init_size;
+    while (left) {
+        ssize_t n = write(fd, p, left);
+        if (n <= 0) {
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    if (left || fchmod(fd, 0400) != 0 || flock(fd, LOCK_SH) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        log_warn("share: cannot write %s\n", path.c_str());
+        close(fd);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    /* drop the private copy for the shared pages, a noexec mount only
+       costs the sharing */
+    share_track(mod, fd, path);
+    if (map_shared(mod, fd) != 0) {
+        log_warn("share: cannot map %s executable\n", path.c_str());
+        share_release(mod);
+        return -1;
+    }
+    log_info("share: published 0x%lx bytes to %s for %s\n", layout.ro_after_init_size, path.c_str(), mod.get_obj_path());
+    return 0;
+}
+
+void share_release(Module &mod)
+{
+    if (mod.share_fd >= 0) {
+        share_release_fd(mod.share_fd);
+        mod.share_fd = -1;
+    }
+}
+
+/* back to private pages, before the shared part is written to */
+uint32_t share_detach(Module &mod)
+{
+    auto &layout = mod.get_layout();
+    if (layout.shared_size == 0) {
+        return 0;
+    }
+    std::vector<char> copy((char *)layout.base, (char *)layout.base + layout.shared_size);
+    void *p = mmap(layout.base, layout.shared_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (p == MAP_FAILED) {
+        log_fatal("share: cannot detach %s\n", mod.get_obj_path());
+        return -1;
+    }
+    memcpy(p, copy.data(), copy.size());
+    mprotect(p, layout.shared_size, PROT_READ | PROT_EXEC);
+    layout.shared_size = 0;
+    share_release(mod);
+    return 0;
+}
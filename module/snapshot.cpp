@@ -0,0 +1,317 @@
+#include "snapshot.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "module.h"
+#include "logger.h"
+#include "tls.h"
+#include "imports.h"
+#include "heap.h"
+#include "lazy.h"
+#include "defer.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+constexpr uint64_t SNAP_PAGE_SIZE = 4096;
+
+struct SnapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t build_id_size;
+    uint8_t build_id[UMKO_BUILD_ID_MAX];
+    uint64_t area_start;        /* follows the host image, checks its address */
+    uint64_t tls_reserve_tpoff;
+    uint32_t region_num;
+    uint32_t tls_num;
+    uint32_t symbol_num;
+    uint32_t reserved;
+    uint64_t meta_size;         /* header and tables, regions follow page aligned */
+};
+
+struct SnapRegion {
+    uint64_t addr;
+    uint64_t size;
+    uint64_t prot;
+    uint64_t file_offset;
+};
+
+/* followed by init_num TlsInit, then size bytes of the block content */
+struct SnapTls {
+    uint32_t id;
+    uint32_t init_num;
+    uint64_t tpoff;
+    uint64_t size;
+};
+
+/* followed by the name, padded to 8 bytes */
+struct SnapSymbol {
+    uint64_t addr;
+    uint32_t name_size;
+    uint32_t reserved;
+};
+
+static inline uint64_t page_align(uint64_t v)
+{
+    return (v + SNAP_PAGE_SIZE - 1) & ~(SNAP_PAGE_SIZE - 1);
+}
+
+static void append(std::vector<char> &meta, const void *data, uint64_t size)
+{
+    meta.insert(meta.end(), (const char *)data, (const char *)data + size);
+    meta.resize((meta.size() + 7) & ~7UL);
+}
+
+static bool write_all(int fd, const void *data, uint64_t size)
+{
+    const char *p = (const char *)data;
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* every mapping of the module area, with the protection it has now */
+static void collect_regions(std::vector<SnapRegion> &regions)
+{
+    uint64_t area_start, area_end;
+    module_area_range(area_start, area_end);
+    FILE *fp = fopen("/proc/self/maps", "r");
+    if (fp == nullptr) {
+        return;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        uint64_t start, end;
+        char perms[8];
+        if (sscanf(line, "%lx-%lx %7s", &start, &end, perms) != 3 || start < area_start || end > area_end) {
+            continue;
+        }
+        uint64_t prot = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0)
+            | (perms[2] == 'x' ? PROT_EXEC : 0);
+        regions.push_back({start, end - start, prot, 0});
+    }
+    fclose(fp);
+}
+
+uint32_t snapshot_save(const char *path, std::list<Module> &mods, SysEnv &env)
+{
+    SnapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UMKO_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = UMKO_SNAPSHOT_VERSION;
+    header.build_id_size = host_build_id(header.build_id, UMKO_BUILD_ID_MAX);
+    if (header.build_id_size == 0) {
+        log_error("snapshot: the host has no build id, link it with --build-id\n");
+        return -1;
+    }
+    if (import_enabled()) {
+        /* the stubs jump through a table of the host, which is not saved */
+        log_error("snapshot: modules call the host through counting stubs\n");
+        return -1;
+    }
+    if (lazy_enabled()) {
+        /* the PLT headers point at Module objects of this process */
+        log_error("snapshot: lazily bound modules are not saved\n");
+        return -1;
+    }
+    for (auto &mod : mods) {
+        if (mod.defer) {
+            /* its stubs call into the loader of this process */
+            log_error("snapshot: %s is deferred\n", mod.get_obj_path());
+            return -1;
+        }
+    }
+    if (heap_in_use()) {
+        /* the heaps are outside the module area */
+        log_error("snapshot: modules allocate from their own heaps\n");
+        return -1;
+    }
+    uint64_t area_end;
+    module_area_range(header.area_start, area_end);
+    header.tls_reserve_tpoff = tls_reserve_tpoff();
+
+    std::vector<SnapRegion> regions;
+    collect_regions(regions);
+    for (auto &r : regions) {
+        if (!(r.prot & PROT_READ)) {
+            log_error("snapshot: region %lx is not readable\n", r.addr);
+            return -1;
+        }
+    }
+    std::vector<TlsBlock> blocks;
+    tls_get_blocks(blocks);
+
+    std::vector<char> meta;
+    header.region_num = regions.size();
+    header.tls_num = blocks.size();
+    append(meta, &header, sizeof(header));
+    uint64_t region_pos = meta.size();
+    for (auto &r : regions) {
+        append(meta, &r, sizeof(r));
+    }
+    for (auto &b : blocks) {
+        SnapTls t = {b.id, (uint32_t)b.init.size(), b.tpoff, b.size};
+        append(meta, &t, sizeof(t));
+        for (auto &seg : b.init) {
+            append(meta, &seg, sizeof(seg));
+        }
+        /* the block as the constructors of this thread left it */
+        TlsIndex ti = {b.id, 0};
+        append(meta, umko_tls_get_addr(&ti), b.size);
+    }
+    /* exports still bound to the module that defined them */
+    uint32_t symbol_num = 0;
+    for (auto &mod : mods) {
+        for (auto &sym : mod.get_exports()) {
+            uint64_t addr;
+            Module *owner = nullptr;
+            if (env.get_symbol(sym.name, addr, &owner) != 0 || owner != &mod) {
+                continue;
+            }
+            SnapSymbol s = {addr, (uint32_t)sym.name.size(), 0};
+            append(meta, &s, sizeof(s));
+            append(meta, sym.name.data(), sym.name.size());
+            symbol_num++;
+        }
+    }
+
+    uint64_t offset = page_align(meta.size());
+    SnapHeader *h = (SnapHeader *)meta.data();
+    h->symbol_num = symbol_num;
+    h->meta_size = meta.size();
+    SnapRegion *table = (SnapRegion *)(meta.data() + region_pos);
+    for (uint32_t i = 0; i < regions.size(); i++) {
+        table[i].file_offset = offset;
+        offset += page_align(table[i].size);
+    }
+    meta.resize(page_align(meta.size()));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_error("snapshot: cannot create %s\n", path);
+        return -1;
+    }
+    bool ok = write_all(fd, meta.data(), meta.size());
+    for (uint32_t i = 0; ok && i < regions.size(); i++) {
+        ok = write_all(fd, (const void *)table[i].addr, table[i].size);
+    }
+    close(fd);
+    if (!ok) {
+        log_error("snapshot: cannot write %s\n", path);
+        unlink(path);
+        return -1;
+    }
+    log_info("snapshot: %u regions, %u tls blocks, %u symbols, 0x%lx bytes to %s\n",
+        header.region_num, header.tls_num, symbol_num, offset, path);
+    return 0;
+}
+
+static uint32_t check_header(const SnapHeader &header, const char *path)
+{
+    uint8_t build_id[UMKO_BUILD_ID_MAX];
+    uint32_t build_id_size = host_build_id(build_id, UMKO_BUILD_ID_MAX);
+    uint64_t area_start, area_end;
+    module_area_range(area_start, area_end);
+
+    if (memcmp(header.magic, UMKO_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || header.version != UMKO_SNAPSHOT_VERSION) {
+        log_error("restore: %s is not a snapshot\n", path);
+        return -1;
+    }
+    if (header.build_id_size != build_id_size || memcmp(header.build_id, build_id, build_id_size) != 0) {
+        log_error("restore: %s was taken by another host build\n", path);
+        return -1;
+    }
+    if (header.area_start != area_start || header.tls_reserve_tpoff != tls_reserve_tpoff()) {
+        log_error("restore: the host is not loaded where %s was taken\n", path);
+        return -1;
+    }
+    if (area_end != area_start) {
+        log_error("restore: modules are loaded already\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Map the regions back read-only/private from the file, the image pages
+   are shared through the page cache until a process writes to them. */
+uint32_t snapshot_restore(const char *path, SysEnv &env)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("restore: cannot open %s\n", path);
+        return -1;
+    }
+    SnapHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || check_header(header, path) != 0) {
+        close(fd);
+        return -1;
+    }
+    std::vector<char> meta(header.meta_size);
+    if (pread(fd, meta.data(), meta.size(), 0) != (ssize_t)meta.size()) {
+        log_error("restore: %s is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+
+    const char *p = meta.data() + ((sizeof(header) + 7) & ~7UL);
+    const SnapRegion *regions = (const SnapRegion *)p;
+    p += header.region_num * sizeof(SnapRegion);
+    uint32_t mapped = 0;
+    for (; mapped < header.region_num; mapped++) {
+        auto &r = regions[mapped];
+        void *addr = mmap((void *)r.addr, r.size, r.prot, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, r.file_offset);
+        if (addr != (void *)r.addr) {
+            log_error("restore: cannot map region %lx size 0x%lx\n", r.addr, r.size);
+            if (addr != MAP_FAILED) {
+                munmap(addr, r.size);
+            }
+            break;
+        }
+        module_area_claim(r.addr, r.size);
+    }
+    close(fd);
+    if (mapped != header.region_num) {
+        for (uint32_t i = 0; i < mapped; i++) {
+            munmap((void *)regions[i].addr, regions[i].size);
+        }
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < header.tls_num; i++) {
+        const SnapTls *t = (const SnapTls *)p;
+        p += sizeof(SnapTls);
+        TlsBlock block = {t->id, t->tpoff, t->size, {}};
+        for (uint32_t j = 0; j < t->init_num; j++) {
+            block.init.push_back(*(const TlsInit *)p);
+            p += sizeof(TlsInit);
+        }
+        if (tls_restore_block(block) != 0) {
+            return -1;
+        }
+        TlsIndex ti = {t->id, 0};
+        memcpy(umko_tls_get_addr(&ti), p, t->size);
+        p += (t->size + 7) & ~7UL;
+    }
+    for (uint32_t i = 0; i < header.symbol_num; i++) {
+        const SnapSymbol *s = (const SnapSymbol *)p;
+        p += sizeof(SnapSymbol);
+        env.add_symbol(std::string(p, s->name_size), s->addr);
+        p += (s->name_size + 7) & ~7UL;
+    }
+    env.publish();
+    log_info("restore: %u regions, %u tls blocks, %u symbols from %s\n",
+        header.region_num, header.tls_num, header.symbol_num, path);
+    return 0;
+}
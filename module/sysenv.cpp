@@ -0,0 +1,257 @@
+#include <cstring>
+#include <sched.h>
+#include <vector>
+#include <sys/mman.h>
+#include "module.h"
+#include "logger.h"
+
+struct SymSlot {
+    uint64_t hash;
+    uint64_t addr;
+    uint64_t name;      /* offset in the arena, 0 for an empty slot */
+};
+
+/* set in the name of a slot stacked over base, the name is gone */
+#define SLOT_REMOVED (1UL << 63)
+
+/* one mapping: header, open addressed slots, at most half of them used,
+   then the arena */
+struct SymTable {
+    uint64_t map_size;
+    uint64_t mask;
+    uint64_t num;
+    const SymTable *base;   /* looked up when a name is not here */
+    SymSlot slots[];
+};
+
+/* one per reader thread, odd while it is in a lookup; slots are never
+   freed, a thread that exits leaves its slot to the next one */
+struct alignas(64) ReaderSlot {
+    uint64_t seq;
+    bool used;
+    ReaderSlot *next;
+};
+
+static ReaderSlot *reader_slots;
+static thread_local ReaderSlot *reader_slot __attribute__((tls_model("initial-exec")));
+
+static ReaderSlot *reader_attach()
+{
+    ReaderSlot *slot = __atomic_load_n(&reader_slots, __ATOMIC_ACQUIRE);
+    for (; slot; slot = slot->next) {
+        bool used = false;
+        if (!__atomic_load_n(&slot->used, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&slot->used, &used, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (slot == nullptr) {
+        slot = new ReaderSlot();
+        slot->used = true;
+        slot->next = __atomic_load_n(&reader_slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&reader_slots, &slot->next, slot, true, __ATOMIC_RELEASE,
+            __ATOMIC_RELAXED)) {
+        }
+    }
+    reader_slot = slot;
+
+    static thread_local struct ReaderThread {
+        ~ReaderThread()
+        {
+            if (reader_slot) {
+                __atomic_store_n(&reader_slot->used, false, __ATOMIC_RELEASE);
+                reader_slot = nullptr;
+            }
+        }
+    } reader_thread;
+    (void)reader_thread;
+    return slot;
+}
+
+/* the readers inside a lookup now are out of it once this returns; the
+   counters are read all first, a lookup started since sees the new table */
+static void wait_readers()
+{
+    std::vector<std::pair<ReaderSlot *, uint64_t>> inside;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (ReaderSlot *slot = __atomic_load_n(&reader_slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            inside.emplace_back(slot, seq);
+        }
+    }
+    for (auto &reader : inside) {
+        while (__atomic_load_n(&reader.first->seq, __ATOMIC_ACQUIRE) == reader.second) {
+            sched_yield();
+        }
+    }
+}
+
+static uint64_t sym_hash(const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325UL;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t)*name) * 0x100000001b3UL;
+    }
+    return hash;
+}
+
+static inline const char *table_arena(const SymTable *table)
+{
+    return (const char *)&table->slots[table->mask + 1];
+}
+
+static const SymSlot *table_find(const SymTable *t, const char *name, uint64_t hash)
+{
+    const char *arena = table_arena(t);
+    for (uint64_t i = hash & t->mask; t->slots[i].name; i = (i + 1) & t->mask) {
+        if (t->slots[i].hash == hash && strcmp(arena + (t->slots[i].name & ~SLOT_REMOVED), name) == 0) {
+            return &t->slots[i];
+        }
+    }
+    return nullptr;
+}
+
+static SymTable *table_map(uint64_t num, uint64_t arena_size, const SymTable *base)
+{
+    uint64_t slot_num = 2;
+    while (slot_num < num * 2) {
+        slot_num <<= 1;
+    }
+    uint64_t map_size = (sizeof(SymTable) + slot_num * sizeof(SymSlot) + arena_size + 4095) & ~4095UL;
+    void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+    SymTable *table = (SymTable *)p;
+    table->map_size = map_size;
+    table->mask = slot_num - 1;
+    table->base = base;
+    /* offset 0 stays empty, it marks a free slot */
+    table->num = 1;
+    return table;
+}
+
+/* num counts the arena bytes while filling, the names once done */
+static void table_put(SymTable *table, const std::string &name, uint64_t addr, uint64_t flags)
+{
+    uint64_t hash = sym_hash(name.c_str());
+    uint64_t i = hash & table->mask;
+    while (table->slots[i].name) {
+        i = (i + 1) & table->mask;
+    }
+    table->slots[i] = {hash, addr, table->num | flags};
+    memcpy((char *)table_arena(table) + table->num, name.c_str(), name.size() + 1);
+    table->num += name.size() + 1;
+}
+
+static SymTable *table_seal(SymTable *table, uint64_t num)
+{
+    table->num = num;
+    mprotect(table, table->map_size, PROT_READ);
+    return table;
+}
+
+static SymTable *build_table(const SymMap &map)
+{
+    uint64_t arena_size = 1;
+    for (auto &entry : map) {
+        arena_size += entry.first.size() + 1;
+    }
+    SymTable *table = table_map(map.size(), arena_size, nullptr);
+    if (table == nullptr) {
+        return nullptr;
+    }
+    for (auto &entry : map) {
+        table_put(table, entry.first, entry.second.addr, 0);
+    }
+    return table_seal(table, map.size());
+}
+
+/* the names of changed as they are in map, over base */
+static SymTable *build_changes(const SymMap &map, const std::unordered_set<std::string> &changed,
+    const SymTable *base)
+{
+    uint64_t arena_size = 1;
+    for (auto &name : changed) {
+        arena_size += name.size() + 1;
+    }
+    SymTable *table = table_map(changed.size(), arena_size, base);
+    if (table == nullptr) {
+        return nullptr;
+    }
+    uint64_t num = 0;
+    for (auto &name : changed) {
+        auto iter = map.find(name);
+        if (iter != map.end()) {
+            table_put(table, name, iter->second.addr, 0);
+        } else if (table_find(base, name.c_str(), sym_hash(name.c_str()))) {
+            table_put(table, name, 0, SLOT_REMOVED);
+        } else {
+            continue;
+        }
+        num++;
+    }
+    return table_seal(table, num);
+}
+
+/* Rebuilding base costs its size, the changes cost what changed since:
+   letting them grow to about the square root of base keeps a publish of
+   a few names near that root instead of the size of the whole table. */
+void SysEnv::publish()
+{
+    if (changed.empty()) {
+        __atomic_store_n(&host_unpublished, false, __ATOMIC_RELEASE);
+        return;
+    }
+    bool full = base == nullptr || changed.size() * changed.size() > 16 * base->num + 4096;
+    SymTable *next = full ? build_table(map) : build_changes(map, changed, base);
+    if (next == nullptr) {
+        log_error("sysenv: cannot map the symbol table, lookups see the last one\n");
+        return;
+    }
+    SymTable *old = table;
+    SymTable *old_base = base;
+    __atomic_store_n(&table, next, __ATOMIC_RELEASE);
+    __atomic_store_n(&host_unpublished, false, __ATOMIC_RELEASE);
+    if (full) {
+        base = next;
+        changed.clear();
+    }
+    wait_readers();
+    if (old && old != old_base) {
+        munmap(old, old->map_size);
+    }
+    if (full && old_base) {
+        munmap(old_base, old_base->map_size);
+    }
+}
+
+uint32_t SysEnv::lookup(const char *name, uint64_t &addr) const
+{
+    ReaderSlot *slot = reader_slot ? reader_slot : reader_attach();
+    uint64_t seq = slot->seq;
+    /* odd when a signal handler looks up inside a lookup, the outer one
+       keeps the tables mapped */
+    bool outer = (seq & 1) == 0;
+    if (outer) {
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    uint64_t hash = sym_hash(name);
+    uint32_t ret = -1;
+    for (const SymTable *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE); t; t = t->base) {
+        const SymSlot *s = table_find(t, name, hash);
+        if (s) {
+            if ((s->name & SLOT_REMOVED) == 0) {
+                addr = s->addr;
+                ret = 0;
+            }
+            break;
+        }
+    }
+    if (outer) {
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
@@ -0,0 +1,227 @@
+#include "tls.h"
+#include <cstring>
+#include <algorithm>
+#include "module.h"
+#include "logger.h"
+#include "register.h"
+
+using namespace ELFIO;
+
+/*
+ * Module TLS blocks are carved out of a reserve in the static TLS of
+ * the host. Every thread has the reserve at the same offset from its
+ * thread pointer, so local-exec and initial-exec accesses in module
+ * code resolve to a constant TP offset, like for the main executable.
+ * initial-exec keeps the reserve in static TLS when built into
+ * libumko.so, which therefore has to be linked, not dlopen'ed.
+ */
+static thread_local char tls_reserve[UMKO_TLS_RESERVE]
+    __attribute__((aligned(64), tls_model("initial-exec")));
+/* generation of the block each thread last initialized, a block id
+   reused by another module gets a new generation */
+static thread_local uint32_t tls_thread_gen[UMKO_TLS_MAX_MODULES]
+    __attribute__((tls_model("initial-exec")));
+
+struct TlsModule {
+    uint64_t offset;        /* offset in the reserve */
+    uint64_t tpoff;
+    uint64_t size;          /* 0 when the id is free */
+    uint32_t gen;
+    std::vector<TlsInit> init;
+};
+
+static TlsModule tls_modules[UMKO_TLS_MAX_MODULES];
+static uint32_t tls_module_num = 1;     /* id 0 is "no block" */
+
+static inline char *thread_pointer()
+{
+    char *tp;
+#if defined(__x86_64__)
+    asm volatile("mov %%fs:0, %0" : "=r"(tp));
+#elif defined(__aarch64__)
+    asm volatile("mrs %0, tpidr_el0" : "=r"(tp));
+#else
+#error "thread pointer is not supported on this arch"
+#endif
+    return tp;
+}
+
+/* copy the .tdata image into the calling thread's block, .tbss is zeroed */
+static void tls_init_block(uint32_t id)
+{
+    auto &m = tls_modules[id];
+    char *block = thread_pointer() + m.tpoff;
+    memset(block, 0, m.size);
+    for (auto &seg : m.init) {
+        memcpy(block + seg.offset, seg.image, seg.size);
+    }
+    tls_thread_gen[id] = m.gen;
+}
+
+/* first fit in the reserve, between the blocks still in use */
+static int64_t tls_alloc_range(uint64_t size, uint64_t align)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> used;
+    for (uint32_t id = 1; id < tls_module_num; id++) {
+        if (tls_modules[id].size) {
+            used.emplace_back(tls_modules[id].offset, tls_modules[id].size);
+        }
+    }
+    std::sort(used.begin(), used.end());
+    uint64_t start = 0;
+    for (auto &range : used) {
+        uint64_t offset = (start + align - 1) & ~(align - 1);
+        if (offset + size <= range.first) {
+            return offset;
+        }
+        start = std::max(start, range.first + range.second);
+    }
+    uint64_t offset = (start + align - 1) & ~(align - 1);
+    if (offset + size > UMKO_TLS_RESERVE) {
+        return -1;
+    }
+    return offset;
+}
+
+static uint32_t tls_alloc_id()
+{
+    for (uint32_t id = 1; id < tls_module_num; id++) {
+        if (tls_modules[id].size == 0) {
+            return id;
+        }
+    }
+    return tls_module_num < UMKO_TLS_MAX_MODULES ? tls_module_num++ : 0;
+}
+
+uint32_t tls_register_module(Module &mod)
+{
+    auto &layout = mod.get_layout();
+    if (layout.tls_size == 0) {
+        return 0;
+    }
+    if (layout.tls_align > 64) {
+        log_fatal("tls: alignment %ld of %s is not supported\n", layout.tls_align, mod.get_obj_path());
+        return -1;
+    }
+    uint64_t align = layout.tls_align ? layout.tls_align : 1;
+    int64_t offset = tls_alloc_range(layout.tls_size, align);
+    uint32_t id = offset < 0 ? 0 : tls_alloc_id();
+    if (id == 0) {
+        log_fatal("tls: static reserve exhausted, need 0x%lx for %s\n", layout.tls_size, mod.get_obj_path());
+        return -1;
+    }
+
+    auto &m = tls_modules[id];
+    m.offset = offset;
+    m.tpoff = tls_reserve_tpoff() + offset;
+    m.size = layout.tls_size;
+    m.gen++;
+    m.init.clear();
+
+    elfio &elf = mod.get_elf();
+    auto &vsec = mod.get_sec();
+    for (uint32_t i = 0; i < elf.sections.size(); i++) {
+        auto sec = elf.sections[i];
+        if ((sec->get_flags() & SHF_TLS) && sec->get_type() != SHT_NOBITS) {
+            m.init.push_back({vsec[i].tls_offset, (const void *)sec->get_address(), sec->get_size()});
+        }
+    }
+    layout.tls_id = id;
+    layout.tls_tpoff = m.tpoff;
+    tls_init_block(id);
+    log_info("tls block [%u] tpoff [0x%lx], size [0x%lx] for %s\n", id, m.tpoff, m.size, mod.get_obj_path());
+    return 0;
+}
+
+/* Give the block back to the reserve. Threads holding stale data for
+   the range re-initialize it on their next use, by generation. */
+void tls_unregister_module(Module &mod)
+{
+    auto &layout = mod.get_layout();
+    uint32_t id = layout.tls_id;
+    if (id == 0 || id >= tls_module_num) {
+        return;
+    }
+    auto &m = tls_modules[id];
+    log_info("tls block [%u] released, size [0x%lx] for %s\n", id, m.size, mod.get_obj_path());
+    m.size = 0;
+    m.init.clear();
+    layout.tls_id = 0;
+}
+
+uint32_t tls_find_module(uint64_t tpoff)
+{
+    for (uint32_t id = 1; id < tls_module_num; id++) {
+        if (tls_modules[id].size && tpoff - tls_modules[id].tpoff < tls_modules[id].size) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+uint64_t tls_block_tpoff(uint32_t tls_id)
+{
+    return tls_id < tls_module_num ? tls_modules[tls_id].tpoff : 0;
+}
+
+uint64_t tls_reserve_tpoff()
+{
+    return (uint64_t)(tls_reserve - thread_pointer());
+}
+
+void tls_get_blocks(std::vector<TlsBlock> &blocks)
+{
+    for (uint32_t id = 1; id < tls_module_num; id++) {
+        auto &m = tls_modules[id];
+        if (m.size) {
+            blocks.push_back({id, m.tpoff, m.size, m.init});
+        }
+    }
+}
+
+/* take a block back at the id and offset it had when it was saved, the
+   GOT entries of the restored modules hold both */
+uint32_t tls_restore_block(const TlsBlock &block)
+{
+    uint64_t offset = block.tpoff - tls_reserve_tpoff();
+    if (block.id == 0 || block.id >= UMKO_TLS_MAX_MODULES || tls_modules[block.id].size
+        || offset + block.size > UMKO_TLS_RESERVE) {
+        log_error("tls: cannot restore block [%u] tpoff [0x%lx]\n", block.id, block.tpoff);
+        return -1;
+    }
+    auto &m = tls_modules[block.id];
+    m.offset = offset;
+    m.tpoff = block.tpoff;
+    m.size = block.size;
+    m.gen++;
+    m.init = block.init;
+    if (block.id >= tls_module_num) {
+        tls_module_num = block.id + 1;
+    }
+    tls_init_block(block.id);
+    return 0;
+}
+
+/* general-dynamic fallback, also initializes the block on first use */
+void *umko_tls_get_addr(TlsIndex *ti)
+{
+    uint32_t id = ti->module;
+    if (tls_thread_gen[id] != tls_modules[id].gen) {
+        tls_init_block(id);
+    }
+    return thread_pointer() + tls_modules[id].tpoff + ti->offset;
+}
+
+/* threads using initial/local-exec accesses call this once before
+   touching module TLS, blocks of the loading thread are ready already */
+void umko_tls_thread_init(void)
+{
+    for (uint32_t id = 1; id < tls_module_num; id++) {
+        if (tls_modules[id].size && tls_thread_gen[id] != tls_modules[id].gen) {
+            tls_init_block(id);
+        }
+    }
+}
+
+RegFuncName("__tls_get_addr", umko_tls_get_addr);
+RegFunc(umko_tls_thread_init);
@@ -0,0 +1,110 @@
+#include "trace.h"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "logger.h"
+
+struct TraceEvent {
+    std::string name;
+    const char *cat;
+    uint64_t start;     /* ns */
+    uint64_t end;
+    uint32_t tid;
+};
+
+static std::mutex trace_lock;
+static std::vector<TraceEvent> trace_events;
+static std::string trace_path;
+static bool trace_on = false;
+static bool trace_atexit = false;
+static pid_t trace_pid;     /* forked children leave the file alone */
+
+uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+bool trace_enabled()
+{
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+}
+
+void trace_span(const std::string &name, const char *cat, uint64_t start, uint64_t end)
+{
+    uint32_t tid = syscall(SYS_gettid);
+    std::lock_guard<std::mutex> guard(trace_lock);
+    if (trace_on) {
+        trace_events.push_back({name, cat, start, end, tid});
+    }
+}
+
+static void put_json_string(FILE *fp, const std::string &s)
+{
+    fputc('"', fp);
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/* complete events, timestamps in microseconds */
+uint32_t trace_flush()
+{
+    std::lock_guard<std::mutex> guard(trace_lock);
+    if (!trace_on || getpid() != trace_pid) {
+        return 0;
+    }
+    trace_on = false;
+    FILE *fp = fopen(trace_path.c_str(), "w");
+    if (fp == nullptr) {
+        log_error("trace: cannot create %s\n", trace_path.c_str());
+        return -1;
+    }
+    uint32_t pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"umko\"}}",
+        pid, pid);
+    for (auto &e : trace_events) {
+        fprintf(fp, ",\n{\"name\":");
+        put_json_string(fp, e.name);
+        fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"pid\":%u,\"tid\":%u}",
+            e.cat, e.start / 1000, e.start % 1000, (e.end - e.start) / 1000, (e.end - e.start) % 1000, pid, e.tid);
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    log_info("trace: %zu spans written to %s\n", trace_events.size(), trace_path.c_str());
+    trace_events.clear();
+    return 0;
+}
+
+static void trace_exit()
+{
+    trace_flush();
+}
+
+uint32_t trace_enable(const char *path)
+{
+    std::lock_guard<std::mutex> guard(trace_lock);
+    trace_path = path;
+    trace_pid = getpid();
+    trace_events.clear();
+    if (!trace_atexit) {
+        atexit(trace_exit);
+        trace_atexit = true;
+    }
+    __atomic_store_n(&trace_on, true, __ATOMIC_RELAXED);
+    return 0;
+}